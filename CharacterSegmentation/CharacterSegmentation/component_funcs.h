@@ -0,0 +1,315 @@
+#ifndef COMPONENT_FUNCS_H
+#define COMPONENT_FUNCS_H
+
+#include "image_funcs.h"
+#include "morphology_funcs.h"
+
+constexpr int COMPONENT_MIN_ROWS_PER_THREAD = 64;
+
+namespace imgf
+{
+
+// A horizontal run of ink pixels.
+struct ComponentRun
+{
+	int line, firstColumn, lastColumn;
+};
+
+// An 8-connected group of ink pixels, position is its bounding box.
+struct ConnectedComponent
+{
+	CharacterPosition position;
+	int64_t area;
+	double centroidLine, centroidColumn;
+};
+
+// The runs of a strip of rows, labelled within the strip. Parents are indices into runs.
+struct ComponentStrip
+{
+	std::vector<ComponentRun> runs;
+	std::vector<int> parent;
+	int firstLineRunCount, lastLineFirstRun;
+};
+
+int lowestSetBit(const uint64_t word)
+{
+#if defined(_MSC_VER)
+	unsigned long index;
+
+	if (_BitScanForward(&index, (unsigned long)word))
+	{
+		return (int)index;
+	}
+
+	_BitScanForward(&index, (unsigned long)(word >> 32));
+
+	return (int)index + 32;
+#else
+	return __builtin_ctzll(word);
+#endif
+}
+
+// Index of the first bit from on that is set (or clear, when inverted) in a packed row,
+// wordCount * BITS_PER_WORD when there is none.
+int nextBit(const uint64_t *bits, const int wordCount, const int from, const bool isInverted)
+{
+	int wordIndex = from / BITS_PER_WORD;
+
+	if (wordIndex >= wordCount)
+	{
+		return wordCount * BITS_PER_WORD;
+	}
+
+	uint64_t word = (isInverted ? ~bits[wordIndex] : bits[wordIndex]) & (~(uint64_t)0 << (from % BITS_PER_WORD));
+
+	while (word == 0)
+	{
+		if (++wordIndex == wordCount)
+		{
+			return wordCount * BITS_PER_WORD;
+		}
+
+		word = isInverted ? ~bits[wordIndex] : bits[wordIndex];
+	}
+
+	return wordIndex * BITS_PER_WORD + lowestSetBit(word);
+}
+
+// Appends the ink runs of a packed row, in which ink pixels are the clear bits.
+void appendRuns(const uint64_t *bits, const int width, const int line, std::vector<ComponentRun> &runs)
+{
+	const int wordCount = (width + BITS_PER_WORD - 1) / BITS_PER_WORD;
+
+	int column = nextBit(bits, wordCount, 0, true);
+
+	while (column < width)
+	{
+		const int end = std::min(nextBit(bits, wordCount, column, false), width);
+
+		runs.push_back({ line, column, end - 1 });
+
+		column = nextBit(bits, wordCount, end, true);
+	}
+}
+
+int findRoot(int *parent, int run)
+{
+	while (parent[run] != run)
+	{
+		parent[run] = parent[parent[run]];
+		run = parent[run];
+	}
+
+	return run;
+}
+
+// The root of a component is always its first run in raster order.
+void uniteRuns(int *parent, const int a, const int b)
+{
+	const int rootA = findRoot(parent, a);
+	const int rootB = findRoot(parent, b);
+
+	if (rootA < rootB)
+	{
+		parent[rootB] = rootA;
+	}
+	else if (rootB < rootA)
+	{
+		parent[rootA] = rootB;
+	}
+}
+
+// Unites the runs of two neighbouring lines which touch, diagonally included. Both ranges are
+// sorted by column, so one sweep over them finds every touching pair.
+void uniteTouchingRuns(const ComponentRun *runs, int *parent, int upper, const int upperEnd, int lower, const int lowerEnd)
+{
+	while ((upper < upperEnd) && (lower < lowerEnd))
+	{
+		if (runs[upper].lastColumn + 1 < runs[lower].firstColumn)
+		{
+			++upper;
+		}
+		else if (runs[lower].lastColumn + 1 < runs[upper].firstColumn)
+		{
+			++lower;
+		}
+		else
+		{
+			uniteRuns(parent, upper, lower);
+
+			if (runs[upper].lastColumn < runs[lower].lastColumn)
+			{
+				++upper;
+			}
+			else
+			{
+				++lower;
+			}
+		}
+	}
+}
+
+void labelStrip(const unsigned char *data, const int width, const int firstLine, const int lastLine, ComponentStrip &strip)
+{
+	std::vector<uint64_t> bits((width + BITS_PER_WORD - 1) / BITS_PER_WORD);
+
+	int previousBegin = 0, previousEnd = 0;
+
+	strip.firstLineRunCount = 0;
+	strip.lastLineFirstRun = 0;
+
+	for (int line = firstLine; line < lastLine; ++line)
+	{
+		packBinaryRow(data + indexOf(0, line, width), width, bits.data());
+
+		const int begin = (int)strip.runs.size();
+
+		appendRuns(bits.data(), width, line, strip.runs);
+
+		const int end = (int)strip.runs.size();
+
+		for (int run = begin; run < end; ++run)
+		{
+			strip.parent.push_back(run);
+		}
+
+		if (line == firstLine)
+		{
+			strip.firstLineRunCount = end;
+		}
+		else
+		{
+			uniteTouchingRuns(strip.runs.data(), strip.parent.data(), previousBegin, previousEnd, begin, end);
+		}
+
+		previousBegin = begin;
+		previousEnd = end;
+	}
+
+	strip.lastLineFirstRun = previousBegin;
+}
+
+// Labels the 8-connected components of the ink (dark) pixels of a binary image and returns them
+// in the raster order of their first pixel, with their bounding box, area and centroid. Strips
+// of rows are run-length encoded and labelled with union-find in parallel, then the strips are
+// joined by uniting the touching runs across every strip border, and the statistics are summed
+// over the runs, so no label image is written.
+std::vector<ConnectedComponent> labelConnectedComponents(const unsigned char *data, const int width, const int height)
+{
+	std::vector<ComponentStrip> strips(chunkCountFor(height, COMPONENT_MIN_ROWS_PER_THREAD));
+
+	parallelFor(height, COMPONENT_MIN_ROWS_PER_THREAD, [&](const int chunk, const int firstLine, const int lastLine)
+	{
+		labelStrip(data, width, firstLine, lastLine, strips[chunk]);
+	});
+
+	std::vector<int> stripOffsets(strips.size() + 1, 0);
+
+	for (size_t strip = 0; strip < strips.size(); ++strip)
+	{
+		stripOffsets[strip + 1] = stripOffsets[strip] + (int)strips[strip].runs.size();
+	}
+
+	std::vector<ComponentRun> runs(stripOffsets.back());
+	std::vector<int> parent(stripOffsets.back());
+
+	for (size_t strip = 0; strip < strips.size(); ++strip)
+	{
+		const int offset = stripOffsets[strip];
+
+		std::copy(strips[strip].runs.begin(), strips[strip].runs.end(), runs.begin() + offset);
+
+		for (size_t run = 0; run < strips[strip].parent.size(); ++run)
+		{
+			parent[offset + run] = strips[strip].parent[run] + offset;
+		}
+	}
+
+	for (size_t strip = 1; strip < strips.size(); ++strip)
+	{
+		const ComponentStrip &upper = strips[strip - 1];
+		const ComponentStrip &lower = strips[strip];
+
+		uniteTouchingRuns(runs.data(), parent.data(), stripOffsets[strip - 1] + upper.lastLineFirstRun, stripOffsets[strip],
+			stripOffsets[strip], stripOffsets[strip] + lower.firstLineRunCount);
+	}
+
+	std::vector<ConnectedComponent> components;
+	std::vector<int> labels(runs.size());
+	std::vector<int64_t> lineSums, columnSums;
+
+	for (int run = 0; run < (int)runs.size(); ++run)
+	{
+		const ComponentRun &current = runs[run];
+		const int root = findRoot(parent.data(), run);
+		const int length = current.lastColumn - current.firstColumn + 1;
+
+		if (root == run)
+		{
+			labels[run] = (int)components.size();
+
+			components.push_back({ { current.line, current.firstColumn, current.line, current.lastColumn }, 0, 0.0, 0.0 });
+			lineSums.push_back(0);
+			columnSums.push_back(0);
+		}
+		else
+		{
+			labels[run] = labels[root];
+		}
+
+		const int label = labels[run];
+		CharacterPosition &position = components[label].position;
+
+		position.topLeftColumn = std::min(position.topLeftColumn, current.firstColumn);
+		position.bottomRightColumn = std::max(position.bottomRightColumn, current.lastColumn);
+		position.bottomRightLine = current.line;
+
+		components[label].area += length;
+		lineSums[label] += (int64_t)current.line * length;
+		columnSums[label] += (int64_t)(current.firstColumn + current.lastColumn) * length / 2;
+	}
+
+	for (size_t label = 0; label < components.size(); ++label)
+	{
+		components[label].centroidLine = (double)lineSums[label] / components[label].area;
+		components[label].centroidColumn = (double)columnSums[label] / components[label].area;
+	}
+
+	return components;
+}
+
+// Sorts components into reading order, text lines top to bottom and each line left to right.
+// A text line is a band of consecutive rows with ink, as the scan and profile segmentations
+// find them, so it is the union of the overlapping or adjoining line spans of its components.
+void sortComponentsInReadingOrder(std::vector<ConnectedComponent> &components)
+{
+	std::stable_sort(components.begin(), components.end(), [](const ConnectedComponent &a, const ConnectedComponent &b)
+	{
+		return a.position.topLeftLine < b.position.topLeftLine;
+	});
+
+	size_t lineBegin = 0;
+
+	while (lineBegin < components.size())
+	{
+		int lastLine = components[lineBegin].position.bottomRightLine;
+		size_t lineEnd = lineBegin + 1;
+
+		while ((lineEnd < components.size()) && (components[lineEnd].position.topLeftLine <= lastLine + 1))
+		{
+			lastLine = std::max(lastLine, components[lineEnd].position.bottomRightLine);
+
+			++lineEnd;
+		}
+
+		std::stable_sort(components.begin() + lineBegin, components.begin() + lineEnd, [](const ConnectedComponent &a, const ConnectedComponent &b)
+		{
+			return a.position.topLeftColumn < b.position.topLeftColumn;
+		});
+
+		lineBegin = lineEnd;
+	}
+}
+
+}
+#endif
@@ -4,6 +4,20 @@
 #include <random>
 #include <cstdint>
 #include <algorithm>
+#include <cmath>
+#include <vector>
+#include <thread>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define IMGF_TARGET_SSSE3
+#define IMGF_TARGET_AVX2
+#else
+#include <cpuid.h>
+#include <x86intrin.h>
+#define IMGF_TARGET_SSSE3 __attribute__((target("ssse3")))
+#define IMGF_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
 
 enum Component
 {
@@ -12,6 +26,12 @@ enum Component
 	B = 2
 };
 
+enum LocalThresholdMethod
+{
+	NIBLACK,
+	SAUVOLA
+};
+
 constexpr int COMPONENT_COUNT = 3;
 constexpr int BUCKET_COUNT = 256;
 
@@ -19,12 +39,141 @@ constexpr float R_WEIGHT = 0.3f;
 constexpr float G_WEIGHT = 0.59f;
 constexpr float B_WEIGHT = 0.11f;
 
+// 8.8 fixed-point versions of the weights above, they add up to exactly 256, so gray stays gray
+constexpr int GRAYSCALE_FIXED_SHIFT = 8;
+constexpr int GRAYSCALE_FIXED_ROUNDING = 1 << (GRAYSCALE_FIXED_SHIFT - 1);
+constexpr int R_FIXED_WEIGHT = (int)(R_WEIGHT * (1 << GRAYSCALE_FIXED_SHIFT) + 0.5f);
+constexpr int G_FIXED_WEIGHT = (int)(G_WEIGHT * (1 << GRAYSCALE_FIXED_SHIFT) + 0.5f);
+constexpr int B_FIXED_WEIGHT = (int)(B_WEIGHT * (1 << GRAYSCALE_FIXED_SHIFT) + 0.5f);
+
 constexpr int MIN_RGB_VALUE = 0;
 constexpr int MAX_RGB_VALUE = 255;
 
+constexpr int LOCAL_THRESHOLD_WINDOW_SIZE = 31;
+constexpr float NIBLACK_K = -0.2f;
+constexpr float SAUVOLA_K = 0.34f;
+constexpr double SAUVOLA_DYNAMIC_RANGE = 128.0;
+
+// Up to this many pixels count^2 * 255^2 / 4, the largest count^2 times the variance of a
+// window, is below 2^64.
+constexpr uint64_t EXACT_VARIANCE_MAX_COUNT = (uint64_t)1 << 25;
+
 namespace imgf
 {
 
+struct CpuFeatures
+{
+	bool ssse3;
+	bool avx2;
+};
+
+void cpuid(int registers[4], const int leaf, const int subleaf)
+{
+#if defined(_MSC_VER)
+	__cpuidex(registers, leaf, subleaf);
+#else
+	__cpuid_count(leaf, subleaf, registers[0], registers[1], registers[2], registers[3]);
+#endif
+}
+
+uint64_t extendedControlRegister()
+{
+#if defined(_MSC_VER)
+	return _xgetbv(0);
+#else
+	uint32_t low, high;
+
+	__asm__ volatile ("xgetbv" : "=a"(low), "=d"(high) : "c"(0));
+
+	return ((uint64_t)high << 32) | low;
+#endif
+}
+
+CpuFeatures detectCpuFeatures()
+{
+	CpuFeatures features = { false, false };
+
+	int registers[4];
+
+	cpuid(registers, 0, 0);
+
+	const int maxLeaf = registers[0];
+
+	if (maxLeaf < 1)
+	{
+		return features;
+	}
+
+	cpuid(registers, 1, 0);
+
+	features.ssse3 = (registers[2] & (1 << 9)) != 0;
+
+	const bool osSavesYmm = ((registers[2] & (1 << 27)) != 0) && ((extendedControlRegister() & 0x6) == 0x6);
+
+	if (osSavesYmm && (maxLeaf >= 7))
+	{
+		cpuid(registers, 7, 0);
+
+		features.avx2 = (registers[1] & (1 << 5)) != 0;
+	}
+
+	return features;
+}
+
+int workerCount()
+{
+	const int hardwareThreads = (int)std::thread::hardware_concurrency();
+
+	return hardwareThreads > 0 ? hardwareThreads : 1;
+}
+
+// Number of chunks parallelFor() will use, so callers can size per-chunk scratch space beforehand.
+int chunkCountFor(const int count, const int minChunkSize)
+{
+	const int maxChunks = std::max(1, count / std::max(1, minChunkSize));
+
+	return std::max(1, std::min(workerCount(), maxChunks));
+}
+
+// Splits [0, count) into chunkCountFor() contiguous chunks and calls
+// function(chunkIndex, begin, end) for each of them on its own thread.
+template <typename Function>
+int parallelFor(const int count, const int minChunkSize, Function function)
+{
+	const int chunkCount = chunkCountFor(count, minChunkSize);
+
+	if (chunkCount == 1)
+	{
+		function(0, 0, count);
+
+		return 1;
+	}
+
+	std::vector<std::thread> threads;
+
+	for (int chunk = 0; chunk < chunkCount; ++chunk)
+	{
+		const int begin = (int)((int64_t)count * chunk / chunkCount);
+		const int end = (int)((int64_t)count * (chunk + 1) / chunkCount);
+
+		threads.emplace_back(function, chunk, begin, end);
+	}
+
+	for (std::thread &thread : threads)
+	{
+		thread.join();
+	}
+
+	return chunkCount;
+}
+
+const CpuFeatures &cpuFeatures()
+{
+	static const CpuFeatures features = detectCpuFeatures();
+
+	return features;
+}
+
 struct CharacterPosition
 {
 	int topLeftLine, topLeftColumn;
@@ -36,45 +185,306 @@ int indexOf(const int x, const int y, const int width)
 	return y * width * COMPONENT_COUNT + x * COMPONENT_COUNT;
 }
 
-bool isGrayscale(const unsigned char *data)
+bool isGrayPixel(const unsigned char *pixel)
 {
-	return data[0] == data[1] == data[2];
+	return (pixel[R] == pixel[G]) && (pixel[G] == pixel[B]);
 }
 
-void convertToGrayscale(unsigned char *data, const int width, const int height)
+// Comparing the buffer against itself shifted by one byte yields R==G and G==B in the
+// first two bytes of every pixel, the third byte compares B to the next pixel's R and is ignored.
+uint32_t grayscaleCompareMask(const int byteOffset, const int byteCount)
 {
-	for (int y = 0; y < height; ++y)
+	uint32_t mask = 0;
+
+	for (int i = 0; i < byteCount; ++i)
 	{
-		for (int x = 0; x < width; ++x)
+		if (((byteOffset + i) % COMPONENT_COUNT) != B)
+		{
+			mask |= 1u << i;
+		}
+	}
+
+	return mask;
+}
+
+// Returns the number of leading pixels verified to be gray, or -1 when a colored pixel was found.
+IMGF_TARGET_AVX2
+int64_t scanGrayPixelsAvx2(const unsigned char *data, const int64_t byteCount)
+{
+	const uint32_t masks[3] = { grayscaleCompareMask(0, 32), grayscaleCompareMask(32, 32), grayscaleCompareMask(64, 32) };
+
+	int64_t i = 0;
+
+	// strictly less, the shifted load reads one byte past the block
+	for (; i + 96 < byteCount; i += 96)
+	{
+		for (int block = 0; block < 3; ++block)
 		{
-			const int position = indexOf(x, y, width);
-			const int grayValue = R_WEIGHT * data[position + R]
-				+ G_WEIGHT * data[position + G]
-				+ B_WEIGHT * data[position + B];
+			const unsigned char *position = data + i + block * 32;
 
-			memset(data + position, grayValue, COMPONENT_COUNT);
+			const __m256i equal = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)position),
+				_mm256_loadu_si256((const __m256i *)(position + 1)));
+
+			if (((uint32_t)_mm256_movemask_epi8(equal) & masks[block]) != masks[block])
+			{
+				return -1;
+			}
 		}
 	}
+
+	return i / COMPONENT_COUNT;
 }
 
-void convertToBinary(unsigned char *data, const int width, const int height, const int threshold)
+int64_t scanGrayPixelsSse2(const unsigned char *data, const int64_t byteCount)
 {
-	if ((threshold < MIN_RGB_VALUE) || (threshold > MAX_RGB_VALUE))
+	const uint32_t masks[3] = { grayscaleCompareMask(0, 16), grayscaleCompareMask(16, 16), grayscaleCompareMask(32, 16) };
+
+	int64_t i = 0;
+
+	for (; i + 48 < byteCount; i += 48)
 	{
-		return;
+		for (int block = 0; block < 3; ++block)
+		{
+			const unsigned char *position = data + i + block * 16;
+
+			const __m128i equal = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)position),
+				_mm_loadu_si128((const __m128i *)(position + 1)));
+
+			if (((uint32_t)_mm_movemask_epi8(equal) & masks[block]) != masks[block])
+			{
+				return -1;
+			}
+		}
 	}
 
-	for (int y = 0; y < height; ++y)
+	return i / COMPONENT_COUNT;
+}
+
+// Checks R == G == B over the whole image and stops at the first colored pixel.
+bool isGrayscale(const unsigned char *data, const int width, const int height)
+{
+	const int64_t pixelCount = (int64_t)width * height;
+
+	const int64_t verified = cpuFeatures().avx2
+		? scanGrayPixelsAvx2(data, pixelCount * COMPONENT_COUNT)
+		: scanGrayPixelsSse2(data, pixelCount * COMPONENT_COUNT);
+
+	if (verified < 0)
 	{
-		for (int x = 0; x < width; ++x)
+		return false;
+	}
+
+	for (int64_t i = verified; i < pixelCount; ++i)
+	{
+		if (!isGrayPixel(data + i * COMPONENT_COUNT))
 		{
-			const int newValue = data[indexOf(x, y, width) + R] < threshold ? 0 : 255;
+			return false;
+		}
+	}
+
+	return true;
+}
+
+unsigned char grayValueOf(const unsigned char *pixel)
+{
+	return (R_FIXED_WEIGHT * pixel[R]
+		+ G_FIXED_WEIGHT * pixel[G]
+		+ B_FIXED_WEIGHT * pixel[B]
+		+ GRAYSCALE_FIXED_ROUNDING) >> GRAYSCALE_FIXED_SHIFT;
+}
+
+// Splits 16 packed RGB pixels (48 bytes) into one register per component.
+IMGF_TARGET_SSSE3
+void deinterleaveRgb(const unsigned char *pixels, __m128i *r, __m128i *g, __m128i *b)
+{
+	const __m128i first = _mm_loadu_si128((const __m128i *)pixels);
+	const __m128i second = _mm_loadu_si128((const __m128i *)(pixels + 16));
+	const __m128i third = _mm_loadu_si128((const __m128i *)(pixels + 32));
+
+	*r = _mm_or_si128(_mm_or_si128(
+		_mm_shuffle_epi8(first, _mm_setr_epi8(0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1)),
+		_mm_shuffle_epi8(second, _mm_setr_epi8(-1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14, -1, -1, -1, -1, -1))),
+		_mm_shuffle_epi8(third, _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 1, 4, 7, 10, 13)));
+
+	*g = _mm_or_si128(_mm_or_si128(
+		_mm_shuffle_epi8(first, _mm_setr_epi8(1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1)),
+		_mm_shuffle_epi8(second, _mm_setr_epi8(-1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1))),
+		_mm_shuffle_epi8(third, _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14)));
+
+	*b = _mm_or_si128(_mm_or_si128(
+		_mm_shuffle_epi8(first, _mm_setr_epi8(2, 5, 8, 11, 14, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1)),
+		_mm_shuffle_epi8(second, _mm_setr_epi8(-1, -1, -1, -1, -1, 1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1))),
+		_mm_shuffle_epi8(third, _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15)));
+}
+
+// Writes every byte of value three times, producing 16 gray RGB pixels (48 bytes).
+IMGF_TARGET_SSSE3
+void storeTriplicated(unsigned char *pixels, const __m128i value)
+{
+	_mm_storeu_si128((__m128i *)pixels,
+		_mm_shuffle_epi8(value, _mm_setr_epi8(0, 0, 0, 1, 1, 1, 2, 2, 2, 3, 3, 3, 4, 4, 4, 5)));
+	_mm_storeu_si128((__m128i *)(pixels + 16),
+		_mm_shuffle_epi8(value, _mm_setr_epi8(5, 5, 6, 6, 6, 7, 7, 7, 8, 8, 8, 9, 9, 9, 10, 10)));
+	_mm_storeu_si128((__m128i *)(pixels + 32),
+		_mm_shuffle_epi8(value, _mm_setr_epi8(10, 11, 11, 11, 12, 12, 12, 13, 13, 13, 14, 14, 14, 15, 15, 15)));
+}
+
+IMGF_TARGET_SSSE3
+__m128i weightedGray(const __m128i r, const __m128i g, const __m128i b)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i rWeight = _mm_set1_epi16(R_FIXED_WEIGHT);
+	const __m128i gWeight = _mm_set1_epi16(G_FIXED_WEIGHT);
+	const __m128i bWeight = _mm_set1_epi16(B_FIXED_WEIGHT);
+	const __m128i rounding = _mm_set1_epi16(GRAYSCALE_FIXED_ROUNDING);
+
+	// 255 * 256 + 128 still fits into an unsigned 16 bit lane
+	__m128i low = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(r, zero), rWeight), rounding);
+	low = _mm_add_epi16(low, _mm_mullo_epi16(_mm_unpacklo_epi8(g, zero), gWeight));
+	low = _mm_add_epi16(low, _mm_mullo_epi16(_mm_unpacklo_epi8(b, zero), bWeight));
+
+	__m128i high = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(r, zero), rWeight), rounding);
+	high = _mm_add_epi16(high, _mm_mullo_epi16(_mm_unpackhi_epi8(g, zero), gWeight));
+	high = _mm_add_epi16(high, _mm_mullo_epi16(_mm_unpackhi_epi8(b, zero), bWeight));
+
+	return _mm_packus_epi16(_mm_srli_epi16(low, GRAYSCALE_FIXED_SHIFT), _mm_srli_epi16(high, GRAYSCALE_FIXED_SHIFT));
+}
 
-			memset(data + indexOf(x, y, width), newValue, COMPONENT_COUNT);
+IMGF_TARGET_SSSE3
+int convertPixelsToGrayscaleSsse3(const unsigned char *rgb, unsigned char *gray, const int count, const bool triplicate)
+{
+	int i = 0;
+
+	for (; i + 16 <= count; i += 16)
+	{
+		__m128i r, g, b;
+
+		deinterleaveRgb(rgb + i * COMPONENT_COUNT, &r, &g, &b);
+
+		const __m128i value = weightedGray(r, g, b);
+
+		if (triplicate)
+		{
+			storeTriplicated(gray + i * COMPONENT_COUNT, value);
+		}
+		else
+		{
+			_mm_storeu_si128((__m128i *)(gray + i), value);
+		}
+	}
+
+	return i;
+}
+
+IMGF_TARGET_AVX2
+int convertPixelsToGrayscaleAvx2(const unsigned char *rgb, unsigned char *gray, const int count, const bool triplicate)
+{
+	const __m256i rWeight = _mm256_set1_epi16(R_FIXED_WEIGHT);
+	const __m256i gWeight = _mm256_set1_epi16(G_FIXED_WEIGHT);
+	const __m256i bWeight = _mm256_set1_epi16(B_FIXED_WEIGHT);
+	const __m256i rounding = _mm256_set1_epi16(GRAYSCALE_FIXED_ROUNDING);
+
+	int i = 0;
+
+	for (; i + 32 <= count; i += 32)
+	{
+		__m128i r[2], g[2], b[2];
+
+		// pshufb does not cross 128 bit lanes, so the 96 input bytes are split in two halves
+		deinterleaveRgb(rgb + i * COMPONENT_COUNT, &r[0], &g[0], &b[0]);
+		deinterleaveRgb(rgb + (i + 16) * COMPONENT_COUNT, &r[1], &g[1], &b[1]);
+
+		__m256i sum[2];
+
+		for (int half = 0; half < 2; ++half)
+		{
+			sum[half] = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_cvtepu8_epi16(r[half]), rWeight), rounding);
+			sum[half] = _mm256_add_epi16(sum[half], _mm256_mullo_epi16(_mm256_cvtepu8_epi16(g[half]), gWeight));
+			sum[half] = _mm256_add_epi16(sum[half], _mm256_mullo_epi16(_mm256_cvtepu8_epi16(b[half]), bWeight));
+			sum[half] = _mm256_srli_epi16(sum[half], GRAYSCALE_FIXED_SHIFT);
+		}
+
+		// packus works per lane, the permute restores pixel order
+		const __m256i value = _mm256_permute4x64_epi64(_mm256_packus_epi16(sum[0], sum[1]), 0xD8);
+
+		if (triplicate)
+		{
+			storeTriplicated(gray + i * COMPONENT_COUNT, _mm256_castsi256_si128(value));
+			storeTriplicated(gray + (i + 16) * COMPONENT_COUNT, _mm256_extracti128_si256(value, 1));
+		}
+		else
+		{
+			_mm256_storeu_si256((__m256i *)(gray + i), value);
+		}
+	}
+
+	return i;
+}
+
+// Converts count packed RGB pixels. The output is either one byte per pixel (planar)
+// or the gray value repeated for all three components (triplicated), which may alias the input.
+void convertPixelsToGrayscale(const unsigned char *rgb, unsigned char *gray, const int count, const bool triplicate)
+{
+	int i = 0;
+
+	if (cpuFeatures().avx2)
+	{
+		i = convertPixelsToGrayscaleAvx2(rgb, gray, count, triplicate);
+	}
+	else if (cpuFeatures().ssse3)
+	{
+		i = convertPixelsToGrayscaleSsse3(rgb, gray, count, triplicate);
+	}
+
+	for (; i < count; ++i)
+	{
+		const unsigned char value = grayValueOf(rgb + i * COMPONENT_COUNT);
+
+		if (triplicate)
+		{
+			memset(gray + i * COMPONENT_COUNT, value, COMPONENT_COUNT);
+		}
+		else
+		{
+			gray[i] = value;
 		}
 	}
 }
 
+IMGF_TARGET_SSSE3
+int triplicatePixelsSsse3(const unsigned char *gray, unsigned char *rgb, const int count)
+{
+	int i = 0;
+
+	for (; i + 16 <= count; i += 16)
+	{
+		storeTriplicated(rgb + i * COMPONENT_COUNT, _mm_loadu_si128((const __m128i *)(gray + i)));
+	}
+
+	return i;
+}
+
+// Writes count planar gray values as gray RGB pixels.
+void triplicatePixels(const unsigned char *gray, unsigned char *rgb, const int count)
+{
+	int i = cpuFeatures().ssse3 ? triplicatePixelsSsse3(gray, rgb, count) : 0;
+
+	for (; i < count; ++i)
+	{
+		memset(rgb + i * COMPONENT_COUNT, gray[i], COMPONENT_COUNT);
+	}
+}
+
+void convertToGrayscale(unsigned char *data, const int width, const int height)
+{
+	convertPixelsToGrayscale(data, data, width * height, true);
+}
+
+void convertToGrayscalePlanar(const unsigned char *data, unsigned char *gray, const int width, const int height)
+{
+	convertPixelsToGrayscale(data, gray, width * height, false);
+}
+
 int firstNonBlankPixelInLine(const unsigned char *data, const int width, const int height, const int line)
 {
 	for (int i = 0; i < width; ++i)
@@ -182,6 +592,134 @@ std::vector<CharacterPosition> createSegmentsFromImage(unsigned char *data, cons
 	return positions;
 }
 
+// Finds the characters of a line in its column ink counts, as createSegmentsFromLine() does:
+// every run of inked columns is a character, except a run of several columns reaching the
+// right edge, which is never closed by a blank column. A single column run at the right edge
+// is closed by the column createSegmentsFromLine() reads past the edge, which is column 0 one
+// row further down, so it is kept only when isWrappedColumnInked is false.
+void createSegmentsFromColumnProfile(const unsigned char *columnInk, const int width, const int firstLine, const int lastLine, const bool isWrappedColumnInked, std::vector<CharacterPosition> &positions)
+{
+	int startingColumn = 0;
+
+	while (startingColumn < width)
+	{
+		if (columnInk[startingColumn] == 0)
+		{
+			++startingColumn;
+
+			continue;
+		}
+
+		int lastColumn = startingColumn + 1;
+
+		while ((lastColumn < width) && (columnInk[lastColumn] != 0))
+		{
+			++lastColumn;
+		}
+
+		if ((lastColumn < width) || ((lastColumn == startingColumn + 1) && !isWrappedColumnInked))
+		{
+			positions.push_back({ firstLine, startingColumn, lastLine, lastColumn - 1 });
+		}
+
+		startingColumn = lastColumn + 1;
+	}
+}
+
+// Adds the ink pixels of a row of count pixels to their column counts, which saturate at 255,
+// and returns the processed pixel count. *rowInk receives the ink pixels of the row.
+IMGF_TARGET_SSSE3
+int accumulateInkProfileSsse3(const unsigned char *row, const int count, unsigned char *columnInk, int *rowInk)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i one = _mm_set1_epi8(1);
+
+	__m128i inkSum = _mm_setzero_si128();
+
+	int i = 0;
+
+	for (; i + 16 <= count; i += 16)
+	{
+		__m128i r, g, b;
+
+		deinterleaveRgb(row + i * COMPONENT_COUNT, &r, &g, &b);
+
+		const __m128i ink = _mm_and_si128(_mm_cmpeq_epi8(r, zero), one);
+		const __m128i counts = _mm_loadu_si128((const __m128i *)(columnInk + i));
+
+		_mm_storeu_si128((__m128i *)(columnInk + i), _mm_adds_epu8(counts, ink));
+
+		inkSum = _mm_add_epi64(inkSum, _mm_sad_epu8(ink, zero));
+	}
+
+	*rowInk = _mm_cvtsi128_si32(inkSum) + _mm_cvtsi128_si32(_mm_unpackhi_epi64(inkSum, inkSum));
+
+	return i;
+}
+
+int accumulateInkProfile(const unsigned char *row, const int width, unsigned char *columnInk)
+{
+	int rowInk = 0;
+	int column = 0;
+
+	if (cpuFeatures().ssse3)
+	{
+		column = accumulateInkProfileSsse3(row, width, columnInk, &rowInk);
+	}
+
+	for (; column < width; ++column)
+	{
+		if (row[column * COMPONENT_COUNT] == 0)
+		{
+			columnInk[column] += columnInk[column] < MAX_RGB_VALUE;
+
+			++rowInk;
+		}
+	}
+
+	return rowInk;
+}
+
+// Same boxes as createSegmentsFromImage(), in one pass over the image: every row adds its
+// pixels to the ink count of the row and of the columns of the current line. A line is a run
+// of inked rows, when it ends, its characters are read from the column counts. A line reaching
+// the bottom ends at the last row, where createSegmentsFromImage() reads one row past the image;
+// that row counts as blank, also where it is read as the column past the right edge.
+std::vector<CharacterPosition> createSegmentsFromProfiles(const unsigned char *data, const int width, const int height)
+{
+	std::vector<CharacterPosition> positions;
+	std::vector<unsigned char> columnInk(width, 0);
+	int firstLine = -1;
+	int firstLineColumnZeroInk = 0;
+
+	for (int line = 0; line <= height; ++line)
+	{
+		const int rowInk = (line < height) ? accumulateInkProfile(data + indexOf(0, line, width), width, columnInk.data()) : 0;
+
+		if (rowInk != 0)
+		{
+			if (firstLine == -1)
+			{
+				firstLine = line;
+				firstLineColumnZeroInk = columnInk[0];
+			}
+		}
+		else if (firstLine != -1)
+		{
+			// the column past the right edge is column 0 of the rows below the first one of the line
+			const bool isWrappedColumnInked = columnInk[0] > firstLineColumnZeroInk;
+
+			createSegmentsFromColumnProfile(columnInk.data(), width, firstLine, line - 1, isWrappedColumnInked, positions);
+
+			std::fill(columnInk.begin(), columnInk.end(), 0);
+
+			firstLine = -1;
+		}
+	}
+
+	return positions;
+}
+
 int firstNonBlankPixelBetweenColumns(unsigned char *data, const int width, const int line, const int firstColumn, const int lastColumn)
 {
 	for (int column = firstColumn; column < lastColumn; ++column)
@@ -297,7 +835,7 @@ int meanFilter(unsigned char **data, const int width, const int height, const in
 		}
 	}
 
-	delete *data;
+	delete[] *data;
 
 	*data = result;
 
@@ -346,7 +884,7 @@ int medianFilter(unsigned char **data, const int width, const int height, const
 		}
 	}
 
-	delete *data;
+	delete[] *data;
 
 	*data = result;
 
@@ -381,59 +919,521 @@ int additiveBinaryNoise(unsigned char *data, const int width, const int height,
 	return 0;
 }
 
-int makeHistogram(unsigned char *data, const int width, const int height, uint64_t **histogram)
+constexpr int HISTOGRAM_LANES = 4;
+constexpr int HISTOGRAM_MIN_ROWS_PER_THREAD = 64;
+
+// Adds every stride-th byte of data to histogram. Consecutive pixels go to different
+// sub-histograms, so runs of the same value (e.g. binarized text) do not serialize on
+// the store-to-load dependency of a single counter.
+void accumulateHistogram(const unsigned char *data, const int64_t pixelCount, const int stride, uint64_t *histogram)
 {
-	uint64_t *result = new uint64_t[BUCKET_COUNT];
+	uint32_t lanes[HISTOGRAM_LANES][BUCKET_COUNT];
 
-	memset(result, 0, BUCKET_COUNT * sizeof(uint64_t));
+	memset(lanes, 0, sizeof(lanes));
 
-	for (int y = 0; y < height; ++y)
+	int64_t i = 0;
+
+	// a 32 bit lane counter cannot overflow before it is flushed
+	while (i < pixelCount)
 	{
-		for (int x = 0; x < width; ++x)
+		const int64_t batchEnd = std::min(pixelCount, i + ((int64_t)UINT32_MAX / HISTOGRAM_LANES) * HISTOGRAM_LANES);
+
+		for (; i + HISTOGRAM_LANES <= batchEnd; i += HISTOGRAM_LANES)
+		{
+			const unsigned char *pixel = data + i * stride;
+
+			lanes[0][pixel[0]] += 1;
+			lanes[1][pixel[stride]] += 1;
+			lanes[2][pixel[2 * stride]] += 1;
+			lanes[3][pixel[3 * stride]] += 1;
+		}
+
+		for (; i < batchEnd; ++i)
+		{
+			lanes[0][data[i * stride]] += 1;
+		}
+
+		for (int bucket = 0; bucket < BUCKET_COUNT; ++bucket)
+		{
+			histogram[bucket] += (uint64_t)lanes[0][bucket] + lanes[1][bucket] + lanes[2][bucket] + lanes[3][bucket];
+		}
+
+		memset(lanes, 0, sizeof(lanes));
+	}
+}
+
+// Row bands are counted into private histograms on separate threads, then summed in band order.
+void computeHistogram(const unsigned char *data, const int width, const int height, const int stride, uint64_t *histogram)
+{
+	const int chunkCount = chunkCountFor(height, HISTOGRAM_MIN_ROWS_PER_THREAD);
+
+	std::vector<uint64_t> partials((size_t)chunkCount * BUCKET_COUNT, 0);
+
+	parallelFor(height, HISTOGRAM_MIN_ROWS_PER_THREAD, [&](const int chunk, const int firstRow, const int lastRow)
+	{
+		accumulateHistogram(data + (int64_t)firstRow * width * stride, (int64_t)(lastRow - firstRow) * width, stride,
+			partials.data() + (size_t)chunk * BUCKET_COUNT);
+	});
+
+	memset(histogram, 0, BUCKET_COUNT * sizeof(uint64_t));
+
+	for (int chunk = 0; chunk < chunkCount; ++chunk)
+	{
+		for (int bucket = 0; bucket < BUCKET_COUNT; ++bucket)
 		{
-			result[data[indexOf(x, y, width)]] += 1;
+			histogram[bucket] += partials[(size_t)chunk * BUCKET_COUNT + bucket];
 		}
 	}
+}
+
+int makeHistogram(unsigned char *data, const int width, const int height, uint64_t **histogram)
+{
+	uint64_t *result = new uint64_t[BUCKET_COUNT];
+
+	computeHistogram(data, width, height, COMPONENT_COUNT, result);
 
 	*histogram = result;
 
 	return 0;
 }
 
+constexpr int REMAP_MIN_ROWS_PER_THREAD = 64;
+
+// A 256 entry table as 16 pshufb tables of 16 entries, indexed by the high nibble.
+IMGF_TARGET_SSSE3
+__m128i lookupSsse3(const __m128i *tables, const __m128i indices)
+{
+	const __m128i nibbleMask = _mm_set1_epi8(0x0F);
+	const __m128i low = _mm_and_si128(indices, nibbleMask);
+	const __m128i high = _mm_and_si128(_mm_srli_epi16(indices, 4), nibbleMask);
+
+	__m128i result = _mm_setzero_si128();
+
+	for (int table = 0; table < 16; ++table)
+	{
+		const __m128i selected = _mm_cmpeq_epi8(high, _mm_set1_epi8((char)table));
+
+		result = _mm_or_si128(result, _mm_and_si128(_mm_shuffle_epi8(tables[table], low), selected));
+	}
+
+	return result;
+}
+
+IMGF_TARGET_AVX2
+__m256i lookupAvx2(const __m256i *tables, const __m256i indices)
+{
+	const __m256i nibbleMask = _mm256_set1_epi8(0x0F);
+	const __m256i low = _mm256_and_si256(indices, nibbleMask);
+	const __m256i high = _mm256_and_si256(_mm256_srli_epi16(indices, 4), nibbleMask);
+
+	__m256i result = _mm256_setzero_si256();
+
+	for (int table = 0; table < 16; ++table)
+	{
+		const __m256i selected = _mm256_cmpeq_epi8(high, _mm256_set1_epi8((char)table));
+
+		result = _mm256_or_si256(result, _mm256_and_si256(_mm256_shuffle_epi8(tables[table], low), selected));
+	}
+
+	return result;
+}
+
+// Gathers the R components of 16 packed RGB pixels.
+IMGF_TARGET_SSSE3
+__m128i loadRedComponents(const unsigned char *pixels)
+{
+	__m128i r, g, b;
+
+	deinterleaveRgb(pixels, &r, &g, &b);
+
+	return r;
+}
+
+IMGF_TARGET_SSSE3
+int remapPixelsSsse3(unsigned char *data, const int count, const unsigned char *lookupTable)
+{
+	__m128i tables[16];
+
+	for (int table = 0; table < 16; ++table)
+	{
+		tables[table] = _mm_loadu_si128((const __m128i *)(lookupTable + table * 16));
+	}
+
+	int i = 0;
+
+	for (; i + 16 <= count; i += 16)
+	{
+		unsigned char *pixels = data + i * COMPONENT_COUNT;
+
+		storeTriplicated(pixels, lookupSsse3(tables, loadRedComponents(pixels)));
+	}
+
+	return i;
+}
+
+IMGF_TARGET_AVX2
+int remapPixelsAvx2(unsigned char *data, const int count, const unsigned char *lookupTable)
+{
+	__m256i tables[16];
+
+	for (int table = 0; table < 16; ++table)
+	{
+		tables[table] = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)(lookupTable + table * 16)));
+	}
+
+	int i = 0;
+
+	for (; i + 32 <= count; i += 32)
+	{
+		unsigned char *pixels = data + i * COMPONENT_COUNT;
+
+		const __m256i indices = _mm256_inserti128_si256(_mm256_castsi128_si256(loadRedComponents(pixels)),
+			loadRedComponents(pixels + 16 * COMPONENT_COUNT), 1);
+
+		const __m256i values = lookupAvx2(tables, indices);
+
+		storeTriplicated(pixels, _mm256_castsi256_si128(values));
+		storeTriplicated(pixels + 16 * COMPONENT_COUNT, _mm256_extracti128_si256(values, 1));
+	}
+
+	return i;
+}
+
+// Replaces every pixel by lookupTable[R], written to all three components.
+void remapPixels(unsigned char *data, const int count, const unsigned char *lookupTable)
+{
+	int i = 0;
+
+	if (cpuFeatures().avx2)
+	{
+		i = remapPixelsAvx2(data, count, lookupTable);
+	}
+	else if (cpuFeatures().ssse3)
+	{
+		i = remapPixelsSsse3(data, count, lookupTable);
+	}
+
+	for (; i < count; ++i)
+	{
+		memset(data + i * COMPONENT_COUNT, lookupTable[data[i * COMPONENT_COUNT + R]], COMPONENT_COUNT);
+	}
+}
+
+void applyLookupTable(unsigned char *data, const int width, const int height, const unsigned char *lookupTable)
+{
+	parallelFor(height, REMAP_MIN_ROWS_PER_THREAD, [&](const int /*chunk*/, const int firstRow, const int lastRow)
+	{
+		remapPixels(data + indexOf(0, firstRow, width), (lastRow - firstRow) * width, lookupTable);
+	});
+}
+
+// Uses the same float accumulation as the per-pixel version did, so the table holds the exact same values.
+void makeEqualizationLookupTable(const uint64_t *histogram, const int64_t pixelCount, unsigned char *lookupTable)
+{
+	float cumulativeHistogram = 0.0f;
+
+	for (int i = 0; i < BUCKET_COUNT; ++i)
+	{
+		cumulativeHistogram += (float)histogram[i] / (float)pixelCount;
+
+		lookupTable[i] = (unsigned char)(int)std::floor((float)(BUCKET_COUNT - 1) * cumulativeHistogram);
+	}
+}
+
 int histogramEqualization(unsigned char *data, const int width, const int height)
 {
-	uint64_t *histogram = nullptr;
+	uint64_t histogram[BUCKET_COUNT];
+
+	computeHistogram(data, width, height, COMPONENT_COUNT, histogram);
+
+	unsigned char lookupTable[BUCKET_COUNT];
+
+	makeEqualizationLookupTable(histogram, (int64_t)width * height, lookupTable);
+
+	applyLookupTable(data, width, height, lookupTable);
+
+	return 0;
+}
+
+
+constexpr int FUSED_BLOCK_PIXELS = 4096;
+constexpr int MAX_OTSU_THRESHOLDS = 8;
+
+// Converts to grayscale and counts the gray values in the same sweep. Every block is
+// histogrammed right after its conversion, while it is still in the L1 cache.
+void convertToGrayscaleWithHistogram(unsigned char *data, const int width, const int height, uint64_t *histogram)
+{
+	const int chunkCount = chunkCountFor(height, HISTOGRAM_MIN_ROWS_PER_THREAD);
+
+	std::vector<uint64_t> partials((size_t)chunkCount * BUCKET_COUNT, 0);
+
+	parallelFor(height, HISTOGRAM_MIN_ROWS_PER_THREAD, [&](const int chunk, const int firstRow, const int lastRow)
+	{
+		unsigned char *band = data + indexOf(0, firstRow, width);
+		const int64_t pixelCount = (int64_t)(lastRow - firstRow) * width;
 
-	makeHistogram(data, width, height, &histogram);
+		for (int64_t i = 0; i < pixelCount; i += FUSED_BLOCK_PIXELS)
+		{
+			const int count = (int)std::min<int64_t>(FUSED_BLOCK_PIXELS, pixelCount - i);
+
+			convertPixelsToGrayscale(band + i * COMPONENT_COUNT, band + i * COMPONENT_COUNT, count, true);
+			accumulateHistogram(band + i * COMPONENT_COUNT, count, COMPONENT_COUNT, partials.data() + (size_t)chunk * BUCKET_COUNT);
+		}
+	});
 
-	float *cumulativeHistogram = new float[BUCKET_COUNT];
+	memset(histogram, 0, BUCKET_COUNT * sizeof(uint64_t));
+
+	for (int chunk = 0; chunk < chunkCount; ++chunk)
+	{
+		for (int bucket = 0; bucket < BUCKET_COUNT; ++bucket)
+		{
+			histogram[bucket] += partials[(size_t)chunk * BUCKET_COUNT + bucket];
+		}
+	}
+}
+
+// Otsu's method: the threshold maximizing the between-class variance. Values below
+// the returned threshold belong to the dark class, like in convertToBinary(). Empty
+// buckets make a range of thresholds equally good, the middle of the range is taken.
+int otsuThreshold(const uint64_t *histogram)
+{
+	double totalCount = 0.0, totalSum = 0.0;
 
 	for (int i = 0; i < BUCKET_COUNT; ++i)
 	{
-		cumulativeHistogram[i] = (float)histogram[i] / (float)(width * height);
+		totalCount += (double)histogram[i];
+		totalSum += (double)i * histogram[i];
+	}
+
+	double darkCount = 0.0, darkSum = 0.0;
+	double bestVariance = -1.0;
+	int firstBest = MIN_RGB_VALUE + 1, lastBest = MIN_RGB_VALUE + 1;
+
+	for (int i = 0; i < BUCKET_COUNT - 1; ++i)
+	{
+		darkCount += (double)histogram[i];
+		darkSum += (double)i * histogram[i];
 
-		if (i > 0)
+		const double lightCount = totalCount - darkCount;
+
+		if ((darkCount == 0.0) || (lightCount == 0.0))
+		{
+			continue;
+		}
+
+		const double meanDifference = darkSum / darkCount - (totalSum - darkSum) / lightCount;
+		const double variance = darkCount * lightCount * meanDifference * meanDifference;
+
+		if (variance > bestVariance)
+		{
+			bestVariance = variance;
+			firstBest = lastBest = i + 1;
+		}
+		else if ((variance == bestVariance) && (lastBest == i))
 		{
-			cumulativeHistogram[i] += cumulativeHistogram[i - 1];
+			lastBest = i + 1;
 		}
 	}
 
-	for (int y = 0; y < height; ++y)
+	return (firstBest + lastBest + 1) / 2;
+}
+
+// Multi-level Otsu: splits the histogram into thresholdCount + 1 classes maximizing the
+// between-class variance, by dynamic programming over the class boundaries. thresholds
+// receives the ascending lower bounds of the classes after the first one.
+int multiLevelOtsuThresholds(const uint64_t *histogram, const int thresholdCount, int *thresholds)
+{
+	if ((thresholdCount < 1) || (thresholdCount > MAX_OTSU_THRESHOLDS))
 	{
-		for (int x = 0; x < width; ++x)
+		return -1;
+	}
+
+	// prefix sums over [0, i), the variance of a class is maximized through sum^2 / count
+	std::vector<double> counts(BUCKET_COUNT + 1, 0.0), sums(BUCKET_COUNT + 1, 0.0);
+
+	for (int i = 0; i < BUCKET_COUNT; ++i)
+	{
+		counts[i + 1] = counts[i] + (double)histogram[i];
+		sums[i + 1] = sums[i] + (double)i * histogram[i];
+	}
+
+	auto classScore = [&](const int begin, const int end)
+	{
+		const double count = counts[end] - counts[begin];
+		const double sum = sums[end] - sums[begin];
+
+		return count > 0.0 ? sum * sum / count : 0.0;
+	};
+
+	const int classCount = thresholdCount + 1;
+
+	// best[c][end]: best score of c + 1 classes covering [0, end), start[c][end]: where the last one begins
+	std::vector<double> best((size_t)classCount * (BUCKET_COUNT + 1), -1.0);
+	std::vector<int> start((size_t)classCount * (BUCKET_COUNT + 1), 0);
+
+	for (int end = 1; end <= BUCKET_COUNT; ++end)
+	{
+		best[end] = classScore(0, end);
+	}
+
+	for (int c = 1; c < classCount; ++c)
+	{
+		for (int end = c + 1; end <= BUCKET_COUNT; ++end)
 		{
-			const int newValue = std::floor((float)(BUCKET_COUNT - 1) * cumulativeHistogram[data[indexOf(x, y, width)]]);
+			for (int begin = c; begin < end; ++begin)
+			{
+				const double score = best[(size_t)(c - 1) * (BUCKET_COUNT + 1) + begin] + classScore(begin, end);
 
-			memset(data + indexOf(x, y, width), newValue, COMPONENT_COUNT);
+				if (score > best[(size_t)c * (BUCKET_COUNT + 1) + end])
+				{
+					best[(size_t)c * (BUCKET_COUNT + 1) + end] = score;
+					start[(size_t)c * (BUCKET_COUNT + 1) + end] = begin;
+				}
+			}
 		}
 	}
 
-	delete cumulativeHistogram;
+	int end = BUCKET_COUNT;
 
-	delete histogram;
+	for (int c = classCount - 1; c > 0; --c)
+	{
+		end = start[(size_t)c * (BUCKET_COUNT + 1) + end];
+		thresholds[c - 1] = end;
+	}
 
 	return 0;
+}
+
+void makeBinaryLookupTable(const int threshold, unsigned char *lookupTable)
+{
+	for (int i = 0; i < BUCKET_COUNT; ++i)
+	{
+		lookupTable[i] = i < threshold ? MIN_RGB_VALUE : MAX_RGB_VALUE;
+	}
+}
+
+void convertToBinary(unsigned char *data, const int width, const int height, const int threshold)
+{
+	if ((threshold < MIN_RGB_VALUE) || (threshold > MAX_RGB_VALUE))
+	{
+		return;
+	}
+
+	unsigned char lookupTable[BUCKET_COUNT];
+
+	makeBinaryLookupTable(threshold, lookupTable);
+
+	applyLookupTable(data, width, height, lookupTable);
+}
 
+constexpr int LOCAL_THRESHOLD_MIN_ROWS_PER_THREAD = 32;
+
+// Appends the next row to a pair of integral rows: sums[x] = previousSums[x] + row[0] + ... + row[x - 1].
+void accumulateIntegralRow(const unsigned char *row, const int width, const uint64_t *previousSums, const uint64_t *previousSquares, uint64_t *sums, uint64_t *squares)
+{
+	uint32_t rowSum = 0;
+	uint64_t rowSquares = 0;
+
+	sums[0] = 0;
+	squares[0] = 0;
+
+	for (int x = 0; x < width; ++x)
+	{
+		rowSum += row[x];
+		rowSquares += (uint32_t)row[x] * row[x];
+
+		sums[x + 1] = previousSums[x + 1] + rowSum;
+		squares[x + 1] = previousSquares[x + 1] + rowSquares;
+	}
+}
+
+// Local thresholding by Niblack (mean + k * deviation) or Sauvola (mean * (1 + k * (deviation / R - 1)))
+// over a windowSize x windowSize neighbourhood, clipped at the image border. Window sums come from
+// 64 bit integral images of the values and their squares, so the cost per pixel does not depend on
+// the window size. Every row band keeps only the last windowSize + 1 integral rows, relative to
+// the first row its windows touch.
+int adaptiveBinarization(unsigned char *data, const int width, const int height, const LocalThresholdMethod method, const int windowSize, const float k)
+{
+	if (!(windowSize % 2) || (windowSize < 3))
+	{
+		return -1;
+	}
+
+	const int radius = windowSize / 2;
+	const int ringSize = windowSize + 1;
+	const int integralWidth = width + 1;
+
+	// the bands overwrite their rows while the neighbouring bands still read them, so the windows use a copy
+	std::vector<unsigned char> gray((size_t)width * height);
+
+	parallelFor(height, REMAP_MIN_ROWS_PER_THREAD, [&](const int /*chunk*/, const int firstRow, const int lastRow)
+	{
+		convertPixelsToGrayscale(data + indexOf(0, firstRow, width), gray.data() + (size_t)firstRow * width, (lastRow - firstRow) * width, false);
+	});
+
+	parallelFor(height, LOCAL_THRESHOLD_MIN_ROWS_PER_THREAD, [&](const int /*chunk*/, const int firstRow, const int lastRow)
+	{
+		const int originRow = std::max(0, firstRow - radius);
+
+		std::vector<uint64_t> sums((size_t)ringSize * integralWidth, 0), squares((size_t)ringSize * integralWidth, 0);
+
+		// integral row j covers the image rows [originRow, j)
+		auto integralRow = [&](std::vector<uint64_t> &ring, const int row)
+		{
+			return ring.data() + (size_t)((row - originRow) % ringSize) * integralWidth;
+		};
+
+		int builtRow = originRow;
+
+		for (int y = firstRow; y < lastRow; ++y)
+		{
+			const int top = std::max(0, y - radius);
+			const int bottom = std::min(height, y + radius + 1);
+
+			for (; builtRow < bottom; ++builtRow)
+			{
+				accumulateIntegralRow(gray.data() + (size_t)builtRow * width, width,
+					integralRow(sums, builtRow), integralRow(squares, builtRow), integralRow(sums, builtRow + 1), integralRow(squares, builtRow + 1));
+			}
+
+			const uint64_t *topSums = integralRow(sums, top), *bottomSums = integralRow(sums, bottom);
+			const uint64_t *topSquares = integralRow(squares, top), *bottomSquares = integralRow(squares, bottom);
+
+			const unsigned char *grayRow = gray.data() + (size_t)y * width;
+			unsigned char *row = data + indexOf(0, y, width);
+
+			for (int x = 0; x < width; ++x)
+			{
+				const int left = std::max(0, x - radius);
+				const int right = std::min(width, x + radius + 1);
+
+				const uint64_t count = (uint64_t)(bottom - top) * (right - left);
+				const uint64_t sum = bottomSums[right] - bottomSums[left] - topSums[right] + topSums[left];
+				const uint64_t squareSum = bottomSquares[right] - bottomSquares[left] - topSquares[right] + topSquares[left];
+
+				// count * squareSum - sum * sum is count^2 times the variance. The unsigned products wrap
+				// around, but the difference is exact up to EXACT_VARIANCE_MAX_COUNT pixels, larger
+				// windows compute it in doubles.
+				const double scaledVariance = (count <= EXACT_VARIANCE_MAX_COUNT) ?
+					(double)(count * squareSum - sum * sum) :
+					std::max(0.0, (double)count * squareSum - (double)sum * sum);
+				const double mean = (double)sum / count;
+				const double deviation = std::sqrt(scaledVariance) / count;
+
+				const double threshold = (method == SAUVOLA) ?
+					mean * (1.0 + k * (deviation / SAUVOLA_DYNAMIC_RANGE - 1.0)) :
+					mean + k * deviation;
+
+				const unsigned char value = grayRow[x] < threshold ? MIN_RGB_VALUE : MAX_RGB_VALUE;
+
+				row[x * COMPONENT_COUNT + R] = value;
+				row[x * COMPONENT_COUNT + G] = value;
+				row[x * COMPONENT_COUNT + B] = value;
+			}
+		}
+	});
+
+	return 0;
 }
 
 }
@@ -0,0 +1,481 @@
+#ifndef MORPHOLOGY_FUNCS_H
+#define MORPHOLOGY_FUNCS_H
+
+#include "image_funcs.h"
+
+constexpr int MORPHOLOGY_MIN_ROWS_PER_THREAD = 32;
+
+// Gray column passes run on strips this wide, so the running extrema of a strip stay cached.
+constexpr int MORPHOLOGY_STRIP_COLUMNS = 256;
+constexpr int MORPHOLOGY_ROW_LANES = 16;
+
+constexpr int BITS_PER_WORD = 64;
+
+// The operations act on the bright pixels: erosion takes the minimum of the window, dilation
+// the maximum. On dark text opening fills small gaps inside the glyphs and closing removes
+// dark specks smaller than the window. The top-hats keep what opening, respectively closing,
+// changed.
+enum MorphologyOperation
+{
+	MORPHOLOGY_ERODE,
+	MORPHOLOGY_DILATE,
+	MORPHOLOGY_OPEN,
+	MORPHOLOGY_CLOSE,
+	MORPHOLOGY_TOP_HAT,
+	MORPHOLOGY_BLACK_TOP_HAT
+};
+
+namespace imgf
+{
+
+template <bool IsMax, typename T>
+T combineValues(const T a, const T b)
+{
+	return IsMax ? std::max(a, b) : std::min(a, b);
+}
+
+// On packed binary rows the extrema of 64 pixels at once are bitwise or and and.
+template <bool IsMax>
+uint64_t combineWords(const uint64_t a, const uint64_t b)
+{
+	return IsMax ? (a | b) : (a & b);
+}
+
+template <bool IsMax>
+void combineRows(const unsigned char *a, const unsigned char *b, unsigned char *output, const int count)
+{
+	int i = 0;
+
+	for (; i + 16 <= count; i += 16)
+	{
+		const __m128i first = _mm_loadu_si128((const __m128i *)(a + i));
+		const __m128i second = _mm_loadu_si128((const __m128i *)(b + i));
+
+		_mm_storeu_si128((__m128i *)(output + i), IsMax ? _mm_max_epu8(first, second) : _mm_min_epu8(first, second));
+	}
+
+	for (; i < count; ++i)
+	{
+		output[i] = combineValues<IsMax>(a[i], b[i]);
+	}
+}
+
+template <bool IsMax>
+void combineRows(const uint64_t *a, const uint64_t *b, uint64_t *output, const int count)
+{
+	for (int i = 0; i < count; ++i)
+	{
+		output[i] = combineWords<IsMax>(a[i], b[i]);
+	}
+}
+
+// Rows or columns a window reaches before the pixel it belongs to. An even window has no
+// center, it reaches one pixel further before the pixel than after it, and the reflected
+// window, which the second pass of opening and closing needs, one pixel further after it.
+int windowAnchor(const int windowSize, const bool isReflected)
+{
+	return isReflected ? (windowSize - 1) / 2 : windowSize / 2;
+}
+
+// van Herk/Gil-Werman running extremum of windowSize rows down a strip of lanes columns, the
+// window of row y starts anchor rows above it. The rows, padded with identity rows,
+// are cut into blocks of windowSize rows. forward holds the extrema from the start of each
+// block, backward those up to its end, and every window spans at most two blocks, so each
+// value costs three comparisons whatever the window size. Rows are stride values apart in
+// input and output, which may alias, forward and backward hold (height + windowSize - 1) *
+// lanes values and identity one row of lanes values.
+template <bool IsMax, typename T>
+void vanHerkColumns(const T *input, T *output, const int stride, const int lanes, const int height, const int windowSize, const int anchor, const T *identity, T *forward, T *backward)
+{
+	const int length = height + windowSize - 1;
+
+	auto padded = [&](const int j)
+	{
+		const int y = j - anchor;
+
+		return ((y >= 0) && (y < height)) ? input + (size_t)y * stride : identity;
+	};
+
+	for (int blockStart = 0; blockStart < length; blockStart += windowSize)
+	{
+		const int blockEnd = std::min(length, blockStart + windowSize);
+
+		std::copy(padded(blockStart), padded(blockStart) + lanes, forward + (size_t)blockStart * lanes);
+
+		for (int j = blockStart + 1; j < blockEnd; ++j)
+		{
+			combineRows<IsMax>(forward + (size_t)(j - 1) * lanes, padded(j), forward + (size_t)j * lanes, lanes);
+		}
+
+		std::copy(padded(blockEnd - 1), padded(blockEnd - 1) + lanes, backward + (size_t)(blockEnd - 1) * lanes);
+
+		for (int j = blockEnd - 2; j >= blockStart; --j)
+		{
+			combineRows<IsMax>(backward + (size_t)(j + 1) * lanes, padded(j), backward + (size_t)j * lanes, lanes);
+		}
+	}
+
+	for (int y = 0; y < height; ++y)
+	{
+		combineRows<IsMax>(backward + (size_t)y * lanes, forward + (size_t)(y + windowSize - 1) * lanes, output + (size_t)y * stride, lanes);
+	}
+}
+
+// Erosion or dilation of a planar gray image with a windowWidth x windowHeight rectangle, or
+// its reflection, pixels outside the image are ignored. input and output may alias.
+template <bool IsMax>
+void extremumFilterPlanar(const unsigned char *input, unsigned char *output, const int width, const int height, const int windowWidth, const int windowHeight, const bool isReflected)
+{
+	const unsigned char identity = IsMax ? MIN_RGB_VALUE : MAX_RGB_VALUE;
+
+	std::vector<unsigned char> rows((size_t)width * height);
+
+	// the row pass runs on MORPHOLOGY_ROW_LANES interleaved rows, so that it can also combine
+	// whole vectors like the column pass
+	const int blockCount = (height + MORPHOLOGY_ROW_LANES - 1) / MORPHOLOGY_ROW_LANES;
+
+	parallelFor(blockCount, 1, [&](const int /*chunk*/, const int firstBlock, const int lastBlock)
+	{
+		const size_t bufferSize = (size_t)(width + windowWidth) * MORPHOLOGY_ROW_LANES;
+
+		std::vector<unsigned char> block((size_t)width * MORPHOLOGY_ROW_LANES), forward(bufferSize), backward(bufferSize), identityRow(MORPHOLOGY_ROW_LANES, identity);
+
+		for (int index = firstBlock; index < lastBlock; ++index)
+		{
+			const int firstRow = index * MORPHOLOGY_ROW_LANES;
+			const int lanes = std::min(MORPHOLOGY_ROW_LANES, height - firstRow);
+
+			for (int lane = 0; lane < lanes; ++lane)
+			{
+				const unsigned char *row = input + (size_t)(firstRow + lane) * width;
+
+				for (int x = 0; x < width; ++x)
+				{
+					block[x * MORPHOLOGY_ROW_LANES + lane] = row[x];
+				}
+			}
+
+			vanHerkColumns<IsMax>(block.data(), block.data(), MORPHOLOGY_ROW_LANES, MORPHOLOGY_ROW_LANES, width, windowWidth, windowAnchor(windowWidth, isReflected), identityRow.data(), forward.data(), backward.data());
+
+			for (int lane = 0; lane < lanes; ++lane)
+			{
+				unsigned char *row = rows.data() + (size_t)(firstRow + lane) * width;
+
+				for (int x = 0; x < width; ++x)
+				{
+					row[x] = block[x * MORPHOLOGY_ROW_LANES + lane];
+				}
+			}
+		}
+	});
+
+	const int stripCount = (width + MORPHOLOGY_STRIP_COLUMNS - 1) / MORPHOLOGY_STRIP_COLUMNS;
+
+	parallelFor(stripCount, 1, [&](const int /*chunk*/, const int firstStrip, const int lastStrip)
+	{
+		const size_t bufferSize = (size_t)(height + windowHeight) * MORPHOLOGY_STRIP_COLUMNS;
+
+		std::vector<unsigned char> forward(bufferSize), backward(bufferSize), identityRow(MORPHOLOGY_STRIP_COLUMNS, identity);
+
+		for (int strip = firstStrip; strip < lastStrip; ++strip)
+		{
+			const int firstColumn = strip * MORPHOLOGY_STRIP_COLUMNS;
+			const int lanes = std::min(MORPHOLOGY_STRIP_COLUMNS, width - firstColumn);
+
+			vanHerkColumns<IsMax>(rows.data() + firstColumn, output + firstColumn, width, lanes, height, windowHeight, windowAnchor(windowHeight, isReflected), identityRow.data(), forward.data(), backward.data());
+		}
+	});
+}
+
+// Saturating difference of two planar images, written into minuend.
+void subtractPlanar(unsigned char *minuend, const unsigned char *subtrahend, const int64_t count)
+{
+	int64_t i = 0;
+
+	for (; i + 16 <= count; i += 16)
+	{
+		const __m128i difference = _mm_subs_epu8(_mm_loadu_si128((const __m128i *)(minuend + i)), _mm_loadu_si128((const __m128i *)(subtrahend + i)));
+
+		_mm_storeu_si128((__m128i *)(minuend + i), difference);
+	}
+
+	for (; i < count; ++i)
+	{
+		minuend[i] = (minuend[i] > subtrahend[i]) ? minuend[i] - subtrahend[i] : MIN_RGB_VALUE;
+	}
+}
+
+// Applies operation with a windowWidth x windowHeight rectangle to a gray RGB image in place.
+int morphology(unsigned char *data, const int width, const int height, const MorphologyOperation operation, const int windowWidth, const int windowHeight)
+{
+	if ((windowWidth < 1) || (windowHeight < 1))
+	{
+		return -1;
+	}
+
+	const int64_t pixelCount = (int64_t)width * height;
+
+	std::vector<unsigned char> gray(pixelCount), result(pixelCount);
+
+	convertToGrayscalePlanar(data, gray.data(), width, height);
+
+	switch (operation)
+	{
+	case MORPHOLOGY_ERODE:
+		extremumFilterPlanar<false>(gray.data(), result.data(), width, height, windowWidth, windowHeight, false);
+		break;
+	case MORPHOLOGY_DILATE:
+		extremumFilterPlanar<true>(gray.data(), result.data(), width, height, windowWidth, windowHeight, false);
+		break;
+	case MORPHOLOGY_OPEN:
+	case MORPHOLOGY_TOP_HAT:
+		extremumFilterPlanar<false>(gray.data(), result.data(), width, height, windowWidth, windowHeight, false);
+		extremumFilterPlanar<true>(result.data(), result.data(), width, height, windowWidth, windowHeight, true);
+		break;
+	case MORPHOLOGY_CLOSE:
+	case MORPHOLOGY_BLACK_TOP_HAT:
+		extremumFilterPlanar<true>(gray.data(), result.data(), width, height, windowWidth, windowHeight, false);
+		extremumFilterPlanar<false>(result.data(), result.data(), width, height, windowWidth, windowHeight, true);
+		break;
+	}
+
+	if (operation == MORPHOLOGY_TOP_HAT)
+	{
+		subtractPlanar(gray.data(), result.data(), pixelCount);
+		result.swap(gray);
+	}
+	else if (operation == MORPHOLOGY_BLACK_TOP_HAT)
+	{
+		subtractPlanar(result.data(), gray.data(), pixelCount);
+	}
+
+	triplicatePixels(result.data(), data, (int)pixelCount);
+
+	return 0;
+}
+
+// Packs 64 pixels of a gray RGB row into every word, bit x % 64 of word x / 64 is set for
+// pixels of at least 128. Returns the number of pixels packed.
+IMGF_TARGET_SSSE3
+int packBinaryPixelsSsse3(const unsigned char *row, const int width, uint64_t *bits)
+{
+	int x = 0;
+
+	for (; x + BITS_PER_WORD <= width; x += BITS_PER_WORD)
+	{
+		uint64_t word = 0;
+
+		for (int part = 0; part < BITS_PER_WORD / 16; ++part)
+		{
+			__m128i r, g, b;
+
+			deinterleaveRgb(row + (x + part * 16) * COMPONENT_COUNT, &r, &g, &b);
+
+			word |= (uint64_t)(uint16_t)_mm_movemask_epi8(r) << (part * 16);
+		}
+
+		bits[x / BITS_PER_WORD] = word;
+	}
+
+	return x;
+}
+
+void packBinaryRow(const unsigned char *row, const int width, uint64_t *bits)
+{
+	int x = cpuFeatures().ssse3 ? packBinaryPixelsSsse3(row, width, bits) : 0;
+
+	for (; x < width; ++x)
+	{
+		const uint64_t bit = (uint64_t)1 << (x % BITS_PER_WORD);
+
+		bits[x / BITS_PER_WORD] = (x % BITS_PER_WORD == 0) ? 0 : bits[x / BITS_PER_WORD];
+		bits[x / BITS_PER_WORD] |= (row[x * COMPONENT_COUNT] & 0x80) ? bit : 0;
+	}
+}
+
+IMGF_TARGET_SSSE3
+int unpackBinaryPixelsSsse3(const uint64_t *bits, const int width, unsigned char *row)
+{
+	const __m128i spread = _mm_setr_epi8(0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1);
+	const __m128i bitMasks = _mm_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8, 16, 32, 64, -128);
+
+	int x = 0;
+
+	for (; x + 16 <= width; x += 16)
+	{
+		const int pixels = (int)((bits[x / BITS_PER_WORD] >> (x % BITS_PER_WORD)) & 0xFFFF);
+		const __m128i masked = _mm_and_si128(_mm_shuffle_epi8(_mm_cvtsi32_si128(pixels), spread), bitMasks);
+
+		storeTriplicated(row + x * COMPONENT_COUNT, _mm_cmpeq_epi8(masked, bitMasks));
+	}
+
+	return x;
+}
+
+void unpackBinaryRow(const uint64_t *bits, const int width, unsigned char *row)
+{
+	int x = cpuFeatures().ssse3 ? unpackBinaryPixelsSsse3(bits, width, row) : 0;
+
+	for (; x < width; ++x)
+	{
+		const bool isSet = (bits[x / BITS_PER_WORD] >> (x % BITS_PER_WORD)) & 1;
+
+		memset(row + x * COMPONENT_COUNT, isSet ? MAX_RGB_VALUE : MIN_RGB_VALUE, COMPONENT_COUNT);
+	}
+}
+
+// Bit x of output is bit x + offset of input, bits from outside the row are fill.
+void shiftBitRow(const uint64_t *input, uint64_t *output, const int wordCount, const int offset, const uint64_t fill)
+{
+	const int wordOffset = (offset >= 0) ? offset / BITS_PER_WORD : -((BITS_PER_WORD - 1 - offset) / BITS_PER_WORD);
+	const int bitOffset = offset - wordOffset * BITS_PER_WORD;
+
+	auto word = [&](const int i)
+	{
+		return ((i >= 0) && (i < wordCount)) ? input[i] : fill;
+	};
+
+	for (int i = 0; i < wordCount; ++i)
+	{
+		const uint64_t low = word(i + wordOffset);
+
+		output[i] = bitOffset ? (low >> bitOffset) | (word(i + wordOffset + 1) << (BITS_PER_WORD - bitOffset)) : low;
+	}
+}
+
+// Combines every bit with the span - 1 bits following it (direction 1) or preceding it
+// (direction -1), by combining the row with itself shifted by 1, 2, 4, ... bits, which takes
+// log2(span) passes over the words.
+template <bool IsMax>
+void spreadBitRow(uint64_t *bits, const int wordCount, const int span, const int direction, uint64_t *shifted)
+{
+	const uint64_t fill = IsMax ? 0 : ~(uint64_t)0;
+
+	for (int covered = 1; covered < span;)
+	{
+		const int step = std::min(covered, span - covered);
+
+		shiftBitRow(bits, shifted, wordCount, step * direction, fill);
+		combineRows<IsMax>(bits, shifted, bits, wordCount);
+
+		covered += step;
+	}
+}
+
+// Erosion or dilation of a packed row in place. A word holds 64 neighbouring pixels, so
+// instead of van Herk/Gil-Werman the window is covered by spreading the bits to the left
+// and to the right of the anchor. scratch holds 2 * wordCount words.
+template <bool IsMax>
+void extremumFilterBitRow(uint64_t *bits, const int width, const int windowSize, const int anchor, uint64_t *scratch)
+{
+	const int wordCount = (width + BITS_PER_WORD - 1) / BITS_PER_WORD;
+
+	// the bits past the last pixel stand for pixels outside the image
+	if (width % BITS_PER_WORD)
+	{
+		const uint64_t padding = ~(uint64_t)0 << (width % BITS_PER_WORD);
+
+		bits[wordCount - 1] = IsMax ? (bits[wordCount - 1] & ~padding) : (bits[wordCount - 1] | padding);
+	}
+
+	uint64_t *preceding = scratch;
+	uint64_t *shifted = scratch + wordCount;
+
+	std::copy(bits, bits + wordCount, preceding);
+
+	spreadBitRow<IsMax>(preceding, wordCount, anchor + 1, -1, shifted);
+	spreadBitRow<IsMax>(bits, wordCount, windowSize - anchor, 1, shifted);
+	combineRows<IsMax>(bits, preceding, bits, wordCount);
+}
+
+// Erosion or dilation of packed rows of wordCount words each with a windowWidth x windowHeight
+// rectangle, or its reflection, in place.
+template <bool IsMax>
+void extremumFilterBits(uint64_t *bits, const int width, const int height, const int windowWidth, const int windowHeight, const bool isReflected)
+{
+	const int wordCount = (width + BITS_PER_WORD - 1) / BITS_PER_WORD;
+
+	parallelFor(height, MORPHOLOGY_MIN_ROWS_PER_THREAD, [&](const int /*chunk*/, const int firstRow, const int lastRow)
+	{
+		std::vector<uint64_t> scratch(2 * wordCount);
+
+		for (int y = firstRow; y < lastRow; ++y)
+		{
+			extremumFilterBitRow<IsMax>(bits + (size_t)y * wordCount, width, windowWidth, windowAnchor(windowWidth, isReflected), scratch.data());
+		}
+	});
+
+	// a row of words is only a few dozen words wide, so the column pass runs as a single strip
+	const size_t bufferSize = (size_t)(height + windowHeight) * wordCount;
+
+	std::vector<uint64_t> forward(bufferSize), backward(bufferSize), identity(wordCount, IsMax ? 0 : ~(uint64_t)0);
+
+	vanHerkColumns<IsMax>(bits, bits, wordCount, wordCount, height, windowHeight, windowAnchor(windowHeight, isReflected), identity.data(), forward.data(), backward.data());
+}
+
+// morphology() for binary images, on one bit per pixel. Pixels of at least 128 count as white,
+// the result is black and white.
+int binaryMorphology(unsigned char *data, const int width, const int height, const MorphologyOperation operation, const int windowWidth, const int windowHeight)
+{
+	if ((windowWidth < 1) || (windowHeight < 1))
+	{
+		return -1;
+	}
+
+	const int wordCount = (width + BITS_PER_WORD - 1) / BITS_PER_WORD;
+
+	std::vector<uint64_t> bits((size_t)wordCount * height);
+
+	parallelFor(height, MORPHOLOGY_MIN_ROWS_PER_THREAD, [&](const int /*chunk*/, const int firstRow, const int lastRow)
+	{
+		for (int y = firstRow; y < lastRow; ++y)
+		{
+			packBinaryRow(data + indexOf(0, y, width), width, bits.data() + (size_t)y * wordCount);
+		}
+	});
+
+	std::vector<uint64_t> original;
+
+	if ((operation == MORPHOLOGY_TOP_HAT) || (operation == MORPHOLOGY_BLACK_TOP_HAT))
+	{
+		original = bits;
+	}
+
+	switch (operation)
+	{
+	case MORPHOLOGY_ERODE:
+		extremumFilterBits<false>(bits.data(), width, height, windowWidth, windowHeight, false);
+		break;
+	case MORPHOLOGY_DILATE:
+		extremumFilterBits<true>(bits.data(), width, height, windowWidth, windowHeight, false);
+		break;
+	case MORPHOLOGY_OPEN:
+	case MORPHOLOGY_TOP_HAT:
+		extremumFilterBits<false>(bits.data(), width, height, windowWidth, windowHeight, false);
+		extremumFilterBits<true>(bits.data(), width, height, windowWidth, windowHeight, true);
+		break;
+	case MORPHOLOGY_CLOSE:
+	case MORPHOLOGY_BLACK_TOP_HAT:
+		extremumFilterBits<true>(bits.data(), width, height, windowWidth, windowHeight, false);
+		extremumFilterBits<false>(bits.data(), width, height, windowWidth, windowHeight, true);
+		break;
+	}
+
+	for (size_t i = 0; i < original.size(); ++i)
+	{
+		bits[i] = (operation == MORPHOLOGY_TOP_HAT) ? (original[i] & ~bits[i]) : (bits[i] & ~original[i]);
+	}
+
+	parallelFor(height, MORPHOLOGY_MIN_ROWS_PER_THREAD, [&](const int /*chunk*/, const int firstRow, const int lastRow)
+	{
+		for (int y = firstRow; y < lastRow; ++y)
+		{
+			unpackBinaryRow(bits.data() + (size_t)y * wordCount, width, data + indexOf(0, y, width));
+		}
+	});
+
+	return 0;
+}
+
+}
+#endif
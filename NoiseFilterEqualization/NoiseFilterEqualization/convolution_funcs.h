@@ -0,0 +1,721 @@
+#ifndef CONVOLUTION_FUNCS_H
+#define CONVOLUTION_FUNCS_H
+
+#include <type_traits>
+#include <complex>
+
+#include "image_funcs.h"
+
+// Integer Gaussian weights are scaled to sum up to 2^GAUSSIAN_WEIGHT_BITS per dimension.
+constexpr int GAUSSIAN_WEIGHT_BITS = 8;
+constexpr int MAX_GAUSSIAN_RADIUS = 4;
+constexpr int CONVOLUTION_MIN_ROWS_PER_THREAD = 16;
+
+// The recursive Gaussian runs its row pass on RECURSIVE_GAUSSIAN_LANES rows at once and its
+// column pass on strips of RECURSIVE_GAUSSIAN_STRIP_COLUMNS columns.
+constexpr double MIN_RECURSIVE_GAUSSIAN_SIGMA = 0.5;
+constexpr int RECURSIVE_GAUSSIAN_LANES = 8;
+constexpr int RECURSIVE_GAUSSIAN_STRIP_COLUMNS = 256;
+
+namespace imgf
+{
+
+// Bytes are convolved with integer weights and accumulators, floats with float ones.
+template <typename Pixel>
+struct ConvolutionWeight
+{
+	typedef int Type;
+};
+
+template <>
+struct ConvolutionWeight<float>
+{
+	typedef float Type;
+};
+
+// A (2 * Radius + 1)^2 kernel. The weighted sum is divided by 2^shift (rounded for integer
+// weights), optionally replaced by its absolute value, offset by bias and, for bytes, clamped.
+// makeKernel() finds out whether the kernel is the outer product of a column and a row, in
+// which case it is applied as two 1D passes.
+template <int Radius, typename Weight>
+struct ConvolutionKernel
+{
+	static const int SIZE = 2 * Radius + 1;
+
+	Weight weights[SIZE * SIZE];
+	int shift;
+	Weight bias;
+	bool absolute;
+
+	bool separable;
+	Weight columnWeights[SIZE], rowWeights[SIZE];
+	int separableShift;
+};
+
+int greatestCommonDivisor(int a, int b)
+{
+	a = std::abs(a);
+	b = std::abs(b);
+
+	while (b)
+	{
+		const int remainder = a % b;
+
+		a = b;
+		b = remainder;
+	}
+
+	return a;
+}
+
+// Integer kernels are separable when every row is a multiple of one row. The row and the column
+// through the first nonzero weight are reduced by their greatest common divisors, and the two
+// passes are only used when they give exactly the results of the 2D kernel.
+template <int Radius>
+void detectSeparability(ConvolutionKernel<Radius, int> &kernel)
+{
+	const int size = ConvolutionKernel<Radius, int>::SIZE;
+
+	kernel.separable = false;
+
+	int pivot = 0;
+
+	while ((pivot < size * size) && (kernel.weights[pivot] == 0))
+	{
+		++pivot;
+	}
+
+	if (pivot == size * size)
+	{
+		return;
+	}
+
+	const int pivotRow = pivot / size, pivotColumn = pivot % size;
+
+	for (int i = 0; i < size; ++i)
+	{
+		for (int j = 0; j < size; ++j)
+		{
+			if ((int64_t)kernel.weights[i * size + j] * kernel.weights[pivot] != (int64_t)kernel.weights[i * size + pivotColumn] * kernel.weights[pivotRow * size + j])
+			{
+				return;
+			}
+		}
+	}
+
+	int rowDivisor = 0, columnDivisor = 0;
+
+	for (int i = 0; i < size; ++i)
+	{
+		rowDivisor = greatestCommonDivisor(rowDivisor, kernel.weights[pivotRow * size + i]);
+		columnDivisor = greatestCommonDivisor(columnDivisor, kernel.weights[i * size + pivotColumn]);
+	}
+
+	// the reduced outer product times rowDivisor * columnDivisor / pivot is the kernel, the odd
+	// part of that factor goes back into the column weights and the power of two into the shift
+	const int common = greatestCommonDivisor(kernel.weights[pivot], rowDivisor * columnDivisor);
+
+	int numerator = rowDivisor * columnDivisor / common;
+	int denominator = std::abs(kernel.weights[pivot]) / common;
+
+	int shiftChange = 0;
+
+	for (; numerator % 2 == 0; numerator /= 2, --shiftChange);
+
+	for (; denominator % 2 == 0; denominator /= 2, ++shiftChange);
+
+	if (denominator != 1)
+	{
+		return;
+	}
+
+	const int columnFactor = (kernel.weights[pivot] < 0) ? -numerator : numerator;
+
+	if (kernel.shift + shiftChange < 0)
+	{
+		return;
+	}
+
+	for (int i = 0; i < size; ++i)
+	{
+		kernel.rowWeights[i] = kernel.weights[pivotRow * size + i] / rowDivisor;
+		kernel.columnWeights[i] = kernel.weights[i * size + pivotColumn] / columnDivisor * columnFactor;
+	}
+
+	kernel.separableShift = kernel.shift + shiftChange;
+	kernel.separable = true;
+}
+
+template <int Radius>
+void detectSeparability(ConvolutionKernel<Radius, float> &kernel)
+{
+	const int size = ConvolutionKernel<Radius, float>::SIZE;
+
+	kernel.separable = false;
+
+	int pivot = 0;
+
+	for (int i = 1; i < size * size; ++i)
+	{
+		if (std::fabs(kernel.weights[i]) > std::fabs(kernel.weights[pivot]))
+		{
+			pivot = i;
+		}
+	}
+
+	if (kernel.weights[pivot] == 0.0f)
+	{
+		return;
+	}
+
+	const int pivotRow = pivot / size, pivotColumn = pivot % size;
+	const float tolerance = 1e-6f * std::fabs(kernel.weights[pivot]);
+
+	for (int i = 0; i < size; ++i)
+	{
+		for (int j = 0; j < size; ++j)
+		{
+			const float product = kernel.weights[i * size + pivotColumn] * kernel.weights[pivotRow * size + j] / kernel.weights[pivot];
+
+			if (std::fabs(kernel.weights[i * size + j] - product) > tolerance)
+			{
+				return;
+			}
+		}
+	}
+
+	for (int i = 0; i < size; ++i)
+	{
+		kernel.rowWeights[i] = kernel.weights[pivotRow * size + i];
+		kernel.columnWeights[i] = kernel.weights[i * size + pivotColumn] / kernel.weights[pivot];
+	}
+
+	kernel.separableShift = kernel.shift;
+	kernel.separable = true;
+}
+
+template <int Radius, typename Weight>
+ConvolutionKernel<Radius, Weight> makeKernel(const Weight *weights, const int shift, const Weight bias, const bool absolute)
+{
+	ConvolutionKernel<Radius, Weight> kernel;
+
+	std::copy(weights, weights + ConvolutionKernel<Radius, Weight>::SIZE * ConvolutionKernel<Radius, Weight>::SIZE, kernel.weights);
+
+	kernel.shift = shift;
+	kernel.bias = bias;
+	kernel.absolute = absolute;
+
+	detectSeparability(kernel);
+
+	return kernel;
+}
+
+// Sampled Gaussian, integer weights are rounded and the center absorbs the rounding error,
+// so each dimension sums up to exactly 2^GAUSSIAN_WEIGHT_BITS.
+template <int Radius, typename Weight>
+ConvolutionKernel<Radius, Weight> gaussianKernel(const double sigma)
+{
+	const int size = 2 * Radius + 1;
+
+	double samples[size];
+	double total = 0.0;
+
+	for (int i = 0; i < size; ++i)
+	{
+		samples[i] = std::exp(-(double)(i - Radius) * (i - Radius) / (2.0 * sigma * sigma));
+		total += samples[i];
+	}
+
+	Weight line[size];
+
+	if (std::is_integral<Weight>::value)
+	{
+		Weight sum = 0;
+
+		for (int i = 0; i < size; ++i)
+		{
+			line[i] = (Weight)std::floor(samples[i] / total * (1 << GAUSSIAN_WEIGHT_BITS) + 0.5);
+			sum += line[i];
+		}
+
+		line[Radius] += (Weight)(1 << GAUSSIAN_WEIGHT_BITS) - sum;
+	}
+	else
+	{
+		for (int i = 0; i < size; ++i)
+		{
+			line[i] = (Weight)(samples[i] / total);
+		}
+	}
+
+	Weight weights[size * size];
+
+	for (int i = 0; i < size; ++i)
+	{
+		for (int j = 0; j < size; ++j)
+		{
+			weights[i * size + j] = line[i] * line[j];
+		}
+	}
+
+	return makeKernel<Radius, Weight>(weights, std::is_integral<Weight>::value ? 2 * GAUSSIAN_WEIGHT_BITS : 0, 0, false);
+}
+
+// Edge responses are stored as absolute values, which is what binarization and display want.
+template <typename Weight>
+ConvolutionKernel<1, Weight> sobelXKernel()
+{
+	const Weight weights[] = { -1, 0, 1, -2, 0, 2, -1, 0, 1 };
+
+	return makeKernel<1, Weight>(weights, 0, 0, true);
+}
+
+template <typename Weight>
+ConvolutionKernel<1, Weight> sobelYKernel()
+{
+	const Weight weights[] = { -1, -2, -1, 0, 0, 0, 1, 2, 1 };
+
+	return makeKernel<1, Weight>(weights, 0, 0, true);
+}
+
+template <typename Weight>
+ConvolutionKernel<1, Weight> laplacianKernel()
+{
+	const Weight weights[] = { 0, 1, 0, 1, -4, 1, 0, 1, 0 };
+
+	return makeKernel<1, Weight>(weights, 0, 0, true);
+}
+
+template <typename Weight>
+ConvolutionKernel<1, Weight> sharpenKernel()
+{
+	const Weight weights[] = { 0, -1, 0, -1, 5, -1, 0, -1, 0 };
+
+	return makeKernel<1, Weight>(weights, 0, 0, false);
+}
+
+void storeConvolvedRow(const int *sums, const int shift, const int bias, const bool absolute, unsigned char *outputRow, const int width, unsigned char *planar)
+{
+	const int rounding = shift > 0 ? 1 << (shift - 1) : 0;
+
+	for (int x = 0; x < width; ++x)
+	{
+		int value = (sums[x] + rounding) >> shift;
+
+		value = absolute ? std::abs(value) : value;
+
+		planar[x] = (unsigned char)std::min(std::max(value + bias, MIN_RGB_VALUE), MAX_RGB_VALUE);
+	}
+
+	triplicatePixels(planar, outputRow, width);
+}
+
+void storeConvolvedRow(const float *sums, const int shift, const float bias, const bool absolute, float *outputRow, const int width, float * /*planar*/)
+{
+	const float scale = std::ldexp(1.0f, -shift);
+
+	for (int x = 0; x < width; ++x)
+	{
+		const float value = sums[x] * scale;
+
+		outputRow[x] = (absolute ? std::fabs(value) : value) + bias;
+	}
+}
+
+// Convolves the rows [firstRow, lastRow). All loops over the kernel have compile time trip
+// counts and are unrolled, the loops over the pixels are plain multiply-adds on contiguous
+// arrays, which the compiler turns into vector code. Separable kernels keep the row pass
+// results of the last SIZE rows in a ring and run the column pass on them.
+template <int Radius, typename Pixel>
+void convolveRows(const Pixel *input, Pixel *output, const int width, const int height, const ConvolutionKernel<Radius, typename ConvolutionWeight<Pixel>::Type> &kernel, const BorderMode borderMode, const int firstRow, const int lastRow)
+{
+	typedef typename ConvolutionWeight<Pixel>::Type Weight;
+
+	const int size = 2 * Radius + 1;
+	const int paddedWidth = width + 2 * Radius;
+	const int stride = PixelTraits<Pixel>::STRIDE;
+	const BorderMode mode = (borderMode == BORDER_NONE) ? BORDER_REPLICATE : borderMode;
+
+	std::vector<Pixel> padded((size_t)size * paddedWidth), planar(width);
+	std::vector<Weight> passes((size_t)size * width), sums(width);
+
+	auto slot = [&](const int y)
+	{
+		return (size_t)(((y % size) + size) % size);
+	};
+
+	auto loadRow = [&](const int y)
+	{
+		const int source = borderIndex(y, height, mode);
+		Pixel *paddedRow = padded.data() + slot(y) * paddedWidth;
+
+		padRow(source < 0 ? nullptr : input + (size_t)source * width * stride, width, Radius, mode, paddedRow);
+
+		if (kernel.separable)
+		{
+			Weight *pass = passes.data() + slot(y) * width;
+
+			std::fill(pass, pass + width, (Weight)0);
+
+			for (int k = 0; k < size; ++k)
+			{
+				const Weight weight = kernel.rowWeights[k];
+
+				for (int x = 0; x < width; ++x)
+				{
+					pass[x] += weight * (Weight)paddedRow[x + k];
+				}
+			}
+		}
+	};
+
+	for (int y = firstRow - Radius; y < firstRow + Radius; ++y)
+	{
+		loadRow(y);
+	}
+
+	for (int y = firstRow; y < lastRow; ++y)
+	{
+		loadRow(y + Radius);
+
+		std::fill(sums.begin(), sums.end(), (Weight)0);
+
+		if (kernel.separable)
+		{
+			for (int k = 0; k < size; ++k)
+			{
+				const Weight weight = kernel.columnWeights[k];
+				const Weight *pass = passes.data() + slot(y - Radius + k) * width;
+
+				for (int x = 0; x < width; ++x)
+				{
+					sums[x] += weight * pass[x];
+				}
+			}
+		}
+		else
+		{
+			for (int ky = 0; ky < size; ++ky)
+			{
+				const Pixel *paddedRow = padded.data() + slot(y - Radius + ky) * paddedWidth;
+
+				for (int kx = 0; kx < size; ++kx)
+				{
+					const Weight weight = kernel.weights[ky * size + kx];
+
+					if (weight == (Weight)0)
+					{
+						continue;
+					}
+
+					for (int x = 0; x < width; ++x)
+					{
+						sums[x] += weight * (Weight)paddedRow[x + kx];
+					}
+				}
+			}
+		}
+
+		storeConvolvedRow(sums.data(), kernel.separable ? kernel.separableShift : kernel.shift, kernel.bias, kernel.absolute,
+			output + (size_t)y * width * stride, width, planar.data());
+	}
+}
+
+// Convolves a whole image into output, which must not alias input. Byte images are the usual
+// gray RGB buffers, float images are planar. BORDER_NONE is treated as BORDER_REPLICATE.
+template <int Radius, typename Pixel>
+int convolve(const Pixel *input, Pixel *output, const int width, const int height, const ConvolutionKernel<Radius, typename ConvolutionWeight<Pixel>::Type> &kernel, const BorderMode borderMode = BORDER_REPLICATE)
+{
+	if (input == output)
+	{
+		return -1;
+	}
+
+	parallelFor(height, CONVOLUTION_MIN_ROWS_PER_THREAD, [&](const int /*chunk*/, const int firstRow, const int lastRow)
+	{
+		convolveRows<Radius, Pixel>(input, output, width, height, kernel, borderMode, firstRow, lastRow);
+	});
+
+	return 0;
+}
+
+// Gaussian blur of a gray RGB image, the radius is 3 sigma rounded up. Larger sigmas than
+// MAX_GAUSSIAN_RADIUS / 3 are rejected, *data is replaced like in meanFilter().
+int gaussianBlur(unsigned char **data, const int width, const int height, const double sigma, const BorderMode borderMode = BORDER_REPLICATE)
+{
+	const int radius = std::max(1, (int)std::ceil(3.0 * sigma));
+
+	if ((sigma <= 0.0) || (radius > MAX_GAUSSIAN_RADIUS))
+	{
+		return -1;
+	}
+
+	unsigned char *result = acquireImageBuffer(width, height);
+
+	switch (radius)
+	{
+	case 1:
+		convolve<1, unsigned char>(*data, result, width, height, gaussianKernel<1, int>(sigma), borderMode);
+		break;
+	case 2:
+		convolve<2, unsigned char>(*data, result, width, height, gaussianKernel<2, int>(sigma), borderMode);
+		break;
+	case 3:
+		convolve<3, unsigned char>(*data, result, width, height, gaussianKernel<3, int>(sigma), borderMode);
+		break;
+	default:
+		convolve<4, unsigned char>(*data, result, width, height, gaussianKernel<4, int>(sigma), borderMode);
+		break;
+	}
+
+	releaseImageBuffer(*data);
+
+	*data = result;
+
+	return 0;
+}
+
+// Third order recursive filter of van Vliet, Young and Verbeek, run forwards and then backwards:
+// w[n] = gain * x[n] + feedback[0] * w[n - 1] + feedback[1] * w[n - 2] + feedback[2] * w[n - 3]
+struct RecursiveGaussianCoefficients
+{
+	float gain;
+	float feedback[3];
+};
+
+// Variance of the forward-backward filter with the poles of the sigma = 2 design raised to 1 / q.
+double recursiveGaussianVariance(const std::complex<double> &complexPole, const double realPole, const double q)
+{
+	const std::complex<double> pole = std::pow(complexPole, 1.0 / q);
+	const double real = std::pow(realPole, 1.0 / q);
+
+	return 2.0 * (2.0 * pole / ((pole - 1.0) * (pole - 1.0))).real() + 2.0 * real / ((real - 1.0) * (real - 1.0));
+}
+
+RecursiveGaussianCoefficients recursiveGaussianCoefficients(const double sigma)
+{
+	const std::complex<double> complexPole(1.41650, 1.00829);
+	const double realPole = 1.86543;
+
+	// the variance grows with q, so bisect for the q that gives sigma^2
+	double low = 0.1, high = 2.0 * sigma + 2.0;
+
+	for (int i = 0; i < 60; ++i)
+	{
+		const double middle = 0.5 * (low + high);
+
+		(recursiveGaussianVariance(complexPole, realPole, middle) < sigma * sigma ? low : high) = middle;
+	}
+
+	const double q = 0.5 * (low + high);
+	const std::complex<double> inverse = 1.0 / std::pow(complexPole, 1.0 / q);
+	const double realInverse = 1.0 / std::pow(realPole, 1.0 / q);
+
+	// expands (1 - inverse / z) (1 - conj(inverse) / z) (1 - realInverse / z)
+	RecursiveGaussianCoefficients coefficients;
+
+	coefficients.feedback[0] = (float)(2.0 * inverse.real() + realInverse);
+	coefficients.feedback[1] = (float)(-(std::norm(inverse) + 2.0 * realInverse * inverse.real()));
+	coefficients.feedback[2] = (float)(realInverse * std::norm(inverse));
+
+	// a constant signal has to pass unchanged
+	coefficients.gain = 1.0f - (coefficients.feedback[0] + coefficients.feedback[1] + coefficients.feedback[2]);
+
+	return coefficients;
+}
+
+// One step of the recursion on four lanes, from w[n - 1], w[n - 2] and w[n - 3].
+__m128 recursiveGaussianStep(const __m128 value, const __m128 previous1, const __m128 previous2, const __m128 previous3, const RecursiveGaussianCoefficients &coefficients)
+{
+	return _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(coefficients.gain), value), _mm_mul_ps(_mm_set1_ps(coefficients.feedback[0]), previous1)),
+		_mm_add_ps(_mm_mul_ps(_mm_set1_ps(coefficients.feedback[1]), previous2), _mm_mul_ps(_mm_set1_ps(coefficients.feedback[2]), previous3)));
+}
+
+// Filters the rows [firstRow, firstRow + RECURSIVE_GAUSSIAN_LANES) of a gray RGB image into
+// plane. The rows are interleaved in block, so every step of the recursion handles all lanes
+// with two vector operations. Rows past the bottom of the image repeat the last one.
+void recursiveGaussianRowBlock(const unsigned char *data, float *plane, const int width, const int height, const int firstRow, const RecursiveGaussianCoefficients &coefficients, float *block)
+{
+	const int lanes = RECURSIVE_GAUSSIAN_LANES;
+	const int groups = RECURSIVE_GAUSSIAN_LANES / 4;
+
+	for (int lane = 0; lane < lanes; ++lane)
+	{
+		const unsigned char *row = data + indexOf(0, std::min(firstRow + lane, height - 1), width);
+
+		for (int x = 0; x < width; ++x)
+		{
+			block[x * lanes + lane] = row[x * COMPONENT_COUNT];
+		}
+	}
+
+	// the signal is extended by its edge values, where the filter is in its steady state
+	__m128 previous[groups][3];
+
+	for (int group = 0; group < groups; ++group)
+	{
+		previous[group][0] = previous[group][1] = previous[group][2] = _mm_loadu_ps(block + group * 4);
+	}
+
+	for (int x = 0; x < width; ++x)
+	{
+		for (int group = 0; group < groups; ++group)
+		{
+			float *values = block + x * lanes + group * 4;
+
+			const __m128 result = recursiveGaussianStep(_mm_loadu_ps(values), previous[group][0], previous[group][1], previous[group][2], coefficients);
+
+			previous[group][2] = previous[group][1];
+			previous[group][1] = previous[group][0];
+			previous[group][0] = result;
+
+			_mm_storeu_ps(values, result);
+		}
+	}
+
+	for (int group = 0; group < groups; ++group)
+	{
+		previous[group][0] = previous[group][1] = previous[group][2] = _mm_loadu_ps(block + (width - 1) * lanes + group * 4);
+	}
+
+	for (int x = width - 1; x >= 0; --x)
+	{
+		for (int group = 0; group < groups; ++group)
+		{
+			float *values = block + x * lanes + group * 4;
+
+			const __m128 result = recursiveGaussianStep(_mm_loadu_ps(values), previous[group][0], previous[group][1], previous[group][2], coefficients);
+
+			previous[group][2] = previous[group][1];
+			previous[group][1] = previous[group][0];
+			previous[group][0] = result;
+
+			_mm_storeu_ps(values, result);
+		}
+	}
+
+	for (int lane = 0; (lane < lanes) && (firstRow + lane < height); ++lane)
+	{
+		float *planeRow = plane + (size_t)(firstRow + lane) * width;
+
+		for (int x = 0; x < width; ++x)
+		{
+			planeRow[x] = block[x * lanes + lane];
+		}
+	}
+}
+
+// Runs the recursion down the rows of a plane segment, previous points to the rows w[n - 1],
+// w[n - 2] and w[n - 3] and may point to row itself, as every value is read before it is
+// written.
+void recursiveGaussianSegment(float *row, const float *const *previous, const int count, const RecursiveGaussianCoefficients &coefficients)
+{
+	int x = 0;
+
+	for (; x + 4 <= count; x += 4)
+	{
+		_mm_storeu_ps(row + x, recursiveGaussianStep(_mm_loadu_ps(row + x), _mm_loadu_ps(previous[0] + x), _mm_loadu_ps(previous[1] + x), _mm_loadu_ps(previous[2] + x), coefficients));
+	}
+
+	for (; x < count; ++x)
+	{
+		row[x] = coefficients.gain * row[x] + coefficients.feedback[0] * previous[0][x] + coefficients.feedback[1] * previous[1][x] + coefficients.feedback[2] * previous[2][x];
+	}
+}
+
+// Filters the columns [firstColumn, lastColumn) of plane in place, a whole row segment per
+// step, and writes the result back into the gray RGB image.
+void recursiveGaussianColumnStrip(float *plane, unsigned char *data, const int width, const int height, const int firstColumn, const int lastColumn, const RecursiveGaussianCoefficients &coefficients, unsigned char *planar)
+{
+	const int count = lastColumn - firstColumn;
+
+	// the edge rows stand in for the rows outside the image
+	const float *previous[3];
+
+	previous[0] = previous[1] = previous[2] = plane + firstColumn;
+
+	for (int y = 0; y < height; ++y)
+	{
+		float *row = plane + (size_t)y * width + firstColumn;
+
+		recursiveGaussianSegment(row, previous, count, coefficients);
+
+		previous[2] = previous[1];
+		previous[1] = previous[0];
+		previous[0] = row;
+	}
+
+	previous[0] = previous[1] = previous[2] = plane + (size_t)(height - 1) * width + firstColumn;
+
+	for (int y = height - 1; y >= 0; --y)
+	{
+		float *row = plane + (size_t)y * width + firstColumn;
+
+		recursiveGaussianSegment(row, previous, count, coefficients);
+
+		int x = 0;
+
+		for (; x + 4 <= count; x += 4)
+		{
+			const __m128i rounded = _mm_cvtps_epi32(_mm_loadu_ps(row + x));
+			const int bytes = _mm_cvtsi128_si32(_mm_packus_epi16(_mm_packs_epi32(rounded, rounded), rounded));
+
+			memcpy(planar + x, &bytes, sizeof(bytes));
+		}
+
+		for (; x < count; ++x)
+		{
+			planar[x] = (unsigned char)std::min(std::max((int)std::lrint(row[x]), MIN_RGB_VALUE), MAX_RGB_VALUE);
+		}
+
+		triplicatePixels(planar, data + indexOf(firstColumn, y, width), count);
+
+		previous[2] = previous[1];
+		previous[1] = previous[0];
+		previous[0] = row;
+	}
+}
+
+// Gaussian blur of a gray RGB image in place, with the same cost for every sigma. The
+// recursion approximates the Gaussian, borders behave like BORDER_REPLICATE. Sigmas below
+// MIN_RECURSIVE_GAUSSIAN_SIGMA, where the approximation breaks down, are rejected.
+int recursiveGaussianFilter(unsigned char *data, const int width, const int height, const double sigma)
+{
+	if (sigma < MIN_RECURSIVE_GAUSSIAN_SIGMA)
+	{
+		return -1;
+	}
+
+	const RecursiveGaussianCoefficients coefficients = recursiveGaussianCoefficients(sigma);
+	const int blockCount = (height + RECURSIVE_GAUSSIAN_LANES - 1) / RECURSIVE_GAUSSIAN_LANES;
+	const int stripCount = (width + RECURSIVE_GAUSSIAN_STRIP_COLUMNS - 1) / RECURSIVE_GAUSSIAN_STRIP_COLUMNS;
+
+	std::vector<float> plane((size_t)width * height);
+
+	parallelFor(blockCount, 1, [&](const int /*chunk*/, const int firstBlock, const int lastBlock)
+	{
+		std::vector<float> block((size_t)width * RECURSIVE_GAUSSIAN_LANES);
+
+		for (int index = firstBlock; index < lastBlock; ++index)
+		{
+			recursiveGaussianRowBlock(data, plane.data(), width, height, index * RECURSIVE_GAUSSIAN_LANES, coefficients, block.data());
+		}
+	});
+
+	parallelFor(stripCount, 1, [&](const int /*chunk*/, const int firstStrip, const int lastStrip)
+	{
+		std::vector<unsigned char> planar(RECURSIVE_GAUSSIAN_STRIP_COLUMNS);
+
+		for (int index = firstStrip; index < lastStrip; ++index)
+		{
+			const int firstColumn = index * RECURSIVE_GAUSSIAN_STRIP_COLUMNS;
+
+			recursiveGaussianColumnStrip(plane.data(), data, width, height, firstColumn, std::min(width, firstColumn + RECURSIVE_GAUSSIAN_STRIP_COLUMNS), coefficients, planar.data());
+		}
+	});
+
+	return 0;
+}
+
+}
+#endif
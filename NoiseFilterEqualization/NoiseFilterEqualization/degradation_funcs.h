@@ -0,0 +1,769 @@
+#ifndef DEGRADATION_FUNCS_H
+#define DEGRADATION_FUNCS_H
+
+#include "noise_funcs.h"
+
+// Resolution of the tabulated inverse normal CDF used to turn uniform numbers into gaussian ones.
+constexpr int NORMAL_TABLE_BITS = 12;
+constexpr int NORMAL_TABLE_SIZE = 1 << NORMAL_TABLE_BITS;
+
+// Up to this mean shot noise is sampled exactly from the Poisson CDF, above it the normal approximation is used.
+constexpr int POISSON_EXACT_MAX_MEAN = 64;
+
+constexpr int JPEG_BLOCK_SIZE = 8;
+
+constexpr int DEGRADATION_MIN_ROWS_PER_THREAD = 16;
+
+// Streams of the degradation models, continuing the ones in noise_funcs.h.
+enum DegradationStream
+{
+	GAUSSIAN_NOISE_STREAM = 3,
+	SALT_AND_PEPPER_NOISE_STREAM = 4,
+	SPECKLE_NOISE_STREAM = 5,
+	POISSON_NOISE_STREAM = 6,
+	DEGRADATION_PARAMETER_STREAM = 7,
+	PAGE_SEED_STREAM = 8
+};
+
+enum NoiseLayout
+{
+	GRAY_PLANAR,		// one byte per pixel
+	GRAY_TRIPLICATED,	// gray value repeated in R, G and B, one random draw per pixel
+	RGB_INTERLEAVED		// one independent draw per component
+};
+
+// Standard JPEG luminance quantization table (ITU T.81, Annex K).
+constexpr int JPEG_LUMINANCE_QUANTIZATION[JPEG_BLOCK_SIZE * JPEG_BLOCK_SIZE] =
+{
+	16, 11, 10, 16, 24, 40, 51, 61,
+	12, 12, 14, 19, 26, 58, 60, 55,
+	14, 13, 16, 24, 40, 57, 69, 56,
+	14, 17, 22, 29, 51, 87, 80, 62,
+	18, 22, 37, 56, 68, 109, 103, 77,
+	24, 35, 55, 64, 81, 104, 113, 92,
+	49, 64, 78, 87, 103, 121, 120, 101,
+	72, 92, 95, 98, 112, 100, 103, 99
+};
+
+struct Degradation
+{
+	int blurPasses;				// 3x3 binomial blur passes, 0 disables
+	float photonsPerLevel;		// Poisson shot noise, 0 disables
+	float gaussianSigma;		// additive gaussian noise, in gray levels
+	float speckleSigma;			// multiplicative gaussian noise, relative to the pixel value
+	float saltAndPepperPercent;	// share of samples forced to black or white
+	int jpegQuality;			// 1..100 JPEG style block quantization, 0 disables
+};
+
+namespace imgf
+{
+
+int bytesPerPixel(const NoiseLayout layout)
+{
+	return layout == GRAY_PLANAR ? 1 : COMPONENT_COUNT;
+}
+
+int samplesPerPixel(const NoiseLayout layout)
+{
+	return layout == RGB_INTERLEAVED ? COMPONENT_COUNT : 1;
+}
+
+// Acklam's rational approximation of the inverse normal CDF, refined by one Halley step.
+double inverseNormalCdf(const double p)
+{
+	static const double a[] = { -3.969683028665376e+01, 2.209460984245205e+02, -2.759285104469687e+02, 1.383577518672690e+02, -3.066479806614716e+01, 2.506628277459239e+00 };
+	static const double b[] = { -5.447609879822406e+01, 1.615858368580409e+02, -1.556989798598866e+02, 6.680131188771972e+01, -1.328068155288572e+01 };
+	static const double c[] = { -7.784894002430293e-03, -3.223964580411365e-01, -2.400758277161838e+00, -2.549732539343734e+00, 4.374664141464968e+00, 2.938163982698783e+00 };
+	static const double d[] = { 7.784695709041462e-03, 3.224671290700398e-01, 2.445134137142996e+00, 3.754408661907416e+00 };
+
+	const double lowTail = 0.02425;
+
+	double x;
+
+	if (p < lowTail)
+	{
+		const double q = std::sqrt(-2.0 * std::log(p));
+
+		x = (((((c[0] * q + c[1]) * q + c[2]) * q + c[3]) * q + c[4]) * q + c[5]) / ((((d[0] * q + d[1]) * q + d[2]) * q + d[3]) * q + 1.0);
+	}
+	else if (p > 1.0 - lowTail)
+	{
+		const double q = std::sqrt(-2.0 * std::log(1.0 - p));
+
+		x = -(((((c[0] * q + c[1]) * q + c[2]) * q + c[3]) * q + c[4]) * q + c[5]) / ((((d[0] * q + d[1]) * q + d[2]) * q + d[3]) * q + 1.0);
+	}
+	else
+	{
+		const double q = p - 0.5;
+		const double r = q * q;
+
+		x = (((((a[0] * r + a[1]) * r + a[2]) * r + a[3]) * r + a[4]) * r + a[5]) * q / (((((b[0] * r + b[1]) * r + b[2]) * r + b[3]) * r + b[4]) * r + 1.0);
+	}
+
+	const double error = 0.5 * std::erfc(-x / std::sqrt(2.0)) - p;
+	const double u = error * std::sqrt(2.0 * PI) * std::exp(x * x / 2.0);
+
+	return x - u / (1.0 + x * u / 2.0);
+}
+
+// Quantiles at the centers of NORMAL_TABLE_SIZE equal probability bins, plus one entry so the
+// last bin can be interpolated too. The tails are cut at about 3.7 sigma.
+const float *normalTable()
+{
+	static const std::vector<float> table = []()
+	{
+		std::vector<float> result(NORMAL_TABLE_SIZE + 1);
+
+		for (int i = 0; i < NORMAL_TABLE_SIZE; ++i)
+		{
+			result[i] = (float)inverseNormalCdf((i + 0.5) / NORMAL_TABLE_SIZE);
+		}
+
+		result[NORMAL_TABLE_SIZE] = result[NORMAL_TABLE_SIZE - 1];
+
+		return result;
+	}();
+
+	return table.data();
+}
+
+// Standard normal sample from one uniform 32 bit number: the top bits select the bin, the next ones interpolate.
+float normalFromUniform(const uint32_t random)
+{
+	const float *table = normalTable();
+	const uint32_t bin = random >> (32 - NORMAL_TABLE_BITS);
+	const float fraction = (float)((random >> (32 - NORMAL_TABLE_BITS - 16)) & 0xFFFF) / 65536.0f;
+
+	return table[bin] + fraction * (table[bin + 1] - table[bin]);
+}
+
+unsigned char clampToByte(const float value)
+{
+	return (unsigned char)std::min(255.0f, std::max(0.0f, value + 0.5f));
+}
+
+// samples[i] += scale * z, where scale is sigma, or sigma * samples[i] for speckle noise.
+void addGaussianSamples(unsigned char *samples, const uint32_t *random, const int count, const float sigma, const bool multiplicative)
+{
+	for (int i = 0; i < count; ++i)
+	{
+		const float scale = multiplicative ? sigma * samples[i] : sigma;
+
+		samples[i] = clampToByte(samples[i] + scale * normalFromUniform(random[i]));
+	}
+}
+
+IMGF_TARGET_AVX2
+int addGaussianSamplesAvx2(unsigned char *samples, const uint32_t *random, const int count, const float sigma, const bool multiplicative)
+{
+	const float *table = normalTable();
+
+	const __m256 sigmaVector = _mm256_set1_ps(sigma);
+	const __m256 fractionScale = _mm256_set1_ps(1.0f / 65536.0f);
+	const __m256 zero = _mm256_setzero_ps();
+	const __m256 maximum = _mm256_set1_ps((float)MAX_RGB_VALUE);
+	const __m256i fractionMask = _mm256_set1_epi32(0xFFFF);
+
+	int i = 0;
+
+	for (; i + 8 <= count; i += 8)
+	{
+		const __m256i bits = _mm256_loadu_si256((const __m256i *)(random + i));
+		const __m256i bin = _mm256_srli_epi32(bits, 32 - NORMAL_TABLE_BITS);
+		const __m256 fraction = _mm256_mul_ps(_mm256_cvtepi32_ps(
+			_mm256_and_si256(_mm256_srli_epi32(bits, 32 - NORMAL_TABLE_BITS - 16), fractionMask)), fractionScale);
+
+		const __m256 low = _mm256_i32gather_ps(table, bin, 4);
+		const __m256 high = _mm256_i32gather_ps(table + 1, bin, 4);
+		const __m256 normal = _mm256_add_ps(low, _mm256_mul_ps(fraction, _mm256_sub_ps(high, low)));
+
+		const __m256 value = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(samples + i))));
+		const __m256 scale = multiplicative ? _mm256_mul_ps(sigmaVector, value) : sigmaVector;
+		const __m256 noisy = _mm256_min_ps(maximum, _mm256_max_ps(zero, _mm256_add_ps(value, _mm256_mul_ps(scale, normal))));
+
+		// the same +0.5 and truncation as clampToByte, then narrow 8 x int32 to 8 bytes
+		const __m256i rounded = _mm256_cvttps_epi32(_mm256_add_ps(noisy, _mm256_set1_ps(0.5f)));
+		const __m128i words = _mm_packus_epi32(_mm256_castsi256_si128(rounded), _mm256_extracti128_si256(rounded, 1));
+
+		_mm_storel_epi64((__m128i *)(samples + i), _mm_packus_epi16(words, words));
+	}
+
+	return i;
+}
+
+// Samples are 0 when random < threshold / 2, 255 when random < threshold and unchanged otherwise.
+void addSaltAndPepperSamples(unsigned char *samples, const uint32_t *random, const int count, const uint64_t threshold)
+{
+	const bool useAvx2 = cpuFeatures().avx2;
+
+	for (int first = 0; first < count; first += RANDOM_BATCH_SIZE)
+	{
+		const uint32_t *batch = random + first;
+		const uint32_t valid = (count - first >= RANDOM_BATCH_SIZE) ? UINT32_MAX : (1u << (count - first)) - 1;
+
+		const uint32_t hit = valid & (useAvx2 ? belowThresholdMaskAvx2(batch, threshold) : belowThresholdMask(batch, threshold));
+		uint32_t pepper = hit & (useAvx2 ? belowThresholdMaskAvx2(batch, threshold / 2) : belowThresholdMask(batch, threshold / 2));
+		uint32_t salt = hit & ~pepper;
+
+		for (; pepper; pepper &= pepper - 1)
+		{
+			samples[first + lowestSetBit(pepper)] = MIN_RGB_VALUE;
+		}
+
+		for (; salt; salt &= salt - 1)
+		{
+			samples[first + lowestSetBit(salt)] = MAX_RGB_VALUE;
+		}
+	}
+}
+
+// One inverse CDF table per gray level, each entry being the 32 bit threshold of P(X <= k). The
+// tables are stride entries apart, padded with UINT32_MAX, and stride is a power of two larger
+// than every table, so a branchless binary search of log2(stride) steps finds any count. Levels
+// with an empty table use the normal approximation.
+struct PoissonTables
+{
+	int stride, strideBits;
+	std::vector<uint32_t> thresholds;
+	std::vector<int> lengths;
+};
+
+PoissonTables poissonTables(const float photonsPerLevel)
+{
+	std::vector<std::vector<uint32_t>> tables(BUCKET_COUNT);
+
+	size_t longest = 0;
+
+	for (int level = 0; level < BUCKET_COUNT; ++level)
+	{
+		const double mean = level * (double)photonsPerLevel;
+
+		if (mean > POISSON_EXACT_MAX_MEAN)
+		{
+			continue;
+		}
+
+		double probability = std::exp(-mean);
+		double cumulative = probability;
+
+		for (int k = 0; cumulative < 1.0 - 1e-10; ++k)
+		{
+			tables[level].push_back((uint32_t)std::min(4294967295.0, cumulative * 4294967296.0));
+
+			probability *= mean / (k + 1);
+			cumulative += probability;
+		}
+
+		longest = std::max(longest, tables[level].size());
+	}
+
+	PoissonTables result;
+
+	result.strideBits = 0;
+
+	while ((size_t)1 << result.strideBits <= longest)
+	{
+		++result.strideBits;
+	}
+
+	result.stride = 1 << result.strideBits;
+	result.thresholds.assign((size_t)BUCKET_COUNT * result.stride, UINT32_MAX);
+	result.lengths.resize(BUCKET_COUNT);
+
+	for (int level = 0; level < BUCKET_COUNT; ++level)
+	{
+		std::copy(tables[level].begin(), tables[level].end(), result.thresholds.begin() + (size_t)level * result.stride);
+
+		result.lengths[level] = (int)tables[level].size();
+	}
+
+	return result;
+}
+
+void addPoissonSamples(unsigned char *samples, const uint32_t *random, const int count, const float photonsPerLevel, const PoissonTables &tables)
+{
+	for (int i = 0; i < count; ++i)
+	{
+		const uint32_t *table = tables.thresholds.data() + (size_t)samples[i] * tables.stride;
+		const int length = tables.lengths[samples[i]];
+
+		float photons;
+
+		if (length == 0)
+		{
+			const float mean = samples[i] * photonsPerLevel;
+
+			photons = mean + std::sqrt(mean) * normalFromUniform(random[i]);
+		}
+		else
+		{
+			photons = (float)(std::upper_bound(table, table + length, random[i]) - table);
+		}
+
+		samples[i] = clampToByte(photons / photonsPerLevel);
+	}
+}
+
+// The counts of 8 samples at once: each step gathers one threshold per lane and moves the lane
+// forward when it is not above the random number. The unsigned compare is a signed one on values
+// with the top bit flipped. The padding may count past the table for UINT32_MAX, which the
+// final minimum with the table length undoes.
+IMGF_TARGET_AVX2
+int addPoissonSamplesAvx2(unsigned char *samples, const uint32_t *random, const int count, const float photonsPerLevel, const PoissonTables &tables)
+{
+	const int *thresholds = (const int *)tables.thresholds.data();
+	const float *normal = normalTable();
+
+	const __m256i signBit = _mm256_set1_epi32(INT32_MIN);
+	const __m256i fractionMask = _mm256_set1_epi32(0xFFFF);
+	const __m256 fractionScale = _mm256_set1_ps(1.0f / 65536.0f);
+	const __m256 photonsVector = _mm256_set1_ps(photonsPerLevel);
+	const __m256 zero = _mm256_setzero_ps();
+	const __m256 maximum = _mm256_set1_ps((float)MAX_RGB_VALUE);
+
+	int i = 0;
+
+	for (; i + 8 <= count; i += 8)
+	{
+		const __m256i bits = _mm256_loadu_si256((const __m256i *)(random + i));
+		const __m256i level = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(samples + i)));
+		const __m256i length = _mm256_i32gather_epi32(tables.lengths.data(), level, 4);
+		const __m256i base = _mm256_slli_epi32(level, tables.strideBits);
+		const __m256i biasedBits = _mm256_xor_si256(bits, signBit);
+
+		__m256i position = _mm256_setzero_si256();
+
+		for (int step = tables.stride / 2; step > 0; step /= 2)
+		{
+			const __m256i index = _mm256_add_epi32(_mm256_add_epi32(base, position), _mm256_set1_epi32(step - 1));
+			const __m256i threshold = _mm256_xor_si256(_mm256_i32gather_epi32(thresholds, index, 4), signBit);
+			const __m256i isAbove = _mm256_cmpgt_epi32(threshold, biasedBits);
+
+			position = _mm256_add_epi32(position, _mm256_andnot_si256(isAbove, _mm256_set1_epi32(step)));
+		}
+
+		__m256 photons = _mm256_cvtepi32_ps(_mm256_min_epu32(position, length));
+
+		const __m256i isApproximated = _mm256_cmpeq_epi32(length, _mm256_setzero_si256());
+
+		if (!_mm256_testz_si256(isApproximated, isApproximated))
+		{
+			const __m256i bin = _mm256_srli_epi32(bits, 32 - NORMAL_TABLE_BITS);
+			const __m256 fraction = _mm256_mul_ps(_mm256_cvtepi32_ps(
+				_mm256_and_si256(_mm256_srli_epi32(bits, 32 - NORMAL_TABLE_BITS - 16), fractionMask)), fractionScale);
+
+			const __m256 low = _mm256_i32gather_ps(normal, bin, 4);
+			const __m256 high = _mm256_i32gather_ps(normal + 1, bin, 4);
+			const __m256 deviation = _mm256_add_ps(low, _mm256_mul_ps(fraction, _mm256_sub_ps(high, low)));
+
+			const __m256 mean = _mm256_mul_ps(_mm256_cvtepi32_ps(level), photonsVector);
+			const __m256 approximated = _mm256_add_ps(mean, _mm256_mul_ps(_mm256_sqrt_ps(mean), deviation));
+
+			photons = _mm256_blendv_ps(photons, approximated, _mm256_castsi256_ps(isApproximated));
+		}
+
+		// the same +0.5, clamping and truncation as clampToByte, then narrow 8 x int32 to 8 bytes
+		const __m256 value = _mm256_add_ps(_mm256_div_ps(photons, photonsVector), _mm256_set1_ps(0.5f));
+		const __m256i rounded = _mm256_cvttps_epi32(_mm256_min_ps(maximum, _mm256_max_ps(zero, value)));
+		const __m128i words = _mm_packus_epi32(_mm256_castsi256_si128(rounded), _mm256_extracti128_si256(rounded, 1));
+
+		_mm_storel_epi64((__m128i *)(samples + i), _mm_packus_epi16(words, words));
+	}
+
+	return i;
+}
+
+// Runs kernel(samples, random, count) on every row with one random number per sample. For the
+// triplicated layout the kernel sees a planar copy of the R components, which is written back to all three.
+template <typename Kernel>
+void forEachSampleRow(unsigned char *data, const int width, const int height, const NoiseLayout layout, const int stream, const uint64_t seed, Kernel kernel)
+{
+	const int samplesInRow = width * samplesPerPixel(layout);
+	const int batchesInRow = (samplesInRow + RANDOM_BATCH_SIZE - 1) / RANDOM_BATCH_SIZE;
+
+	parallelFor(height, DEGRADATION_MIN_ROWS_PER_THREAD, [&](const int /*chunk*/, const int firstRow, const int lastRow)
+	{
+		std::vector<uint32_t> random((size_t)batchesInRow * RANDOM_BATCH_SIZE);
+		std::vector<unsigned char> planar(layout == GRAY_TRIPLICATED ? width : 0);
+
+		for (int y = firstRow; y < lastRow; ++y)
+		{
+			for (int batch = 0; batch < batchesInRow; ++batch)
+			{
+				randomBatch(seed, stream, y, batch, random.data() + batch * RANDOM_BATCH_SIZE);
+			}
+
+			unsigned char *row = data + (int64_t)y * width * bytesPerPixel(layout);
+
+			if (layout != GRAY_TRIPLICATED)
+			{
+				kernel(row, random.data(), samplesInRow);
+
+				continue;
+			}
+
+			for (int x = 0; x < width; ++x)
+			{
+				planar[x] = row[x * COMPONENT_COUNT + R];
+			}
+
+			kernel(planar.data(), random.data(), width);
+
+			for (int x = 0; x < width; ++x)
+			{
+				memset(row + x * COMPONENT_COUNT, planar[x], COMPONENT_COUNT);
+			}
+		}
+	});
+}
+
+int addGaussianNoise(unsigned char *data, const int width, const int height, const NoiseLayout layout, const float sigma, const uint64_t seed, const bool multiplicative = false)
+{
+	if (sigma < 0.0f)
+	{
+		return -1;
+	}
+
+	const bool useAvx2 = cpuFeatures().avx2;
+
+	forEachSampleRow(data, width, height, layout, multiplicative ? SPECKLE_NOISE_STREAM : GAUSSIAN_NOISE_STREAM, seed,
+		[&](unsigned char *samples, const uint32_t *random, const int count)
+	{
+		const int done = useAvx2 ? addGaussianSamplesAvx2(samples, random, count, sigma, multiplicative) : 0;
+
+		addGaussianSamples(samples + done, random + done, count - done, sigma, multiplicative);
+	});
+
+	return 0;
+}
+
+int addSpeckleNoise(unsigned char *data, const int width, const int height, const NoiseLayout layout, const float sigma, const uint64_t seed)
+{
+	return addGaussianNoise(data, width, height, layout, sigma, seed, true);
+}
+
+int addSaltAndPepperNoise(unsigned char *data, const int width, const int height, const NoiseLayout layout, const float percentage, const uint64_t seed)
+{
+	if ((percentage < 0.0f) || (percentage > 100.0f))
+	{
+		return -1;
+	}
+
+	const uint64_t threshold = (uint64_t)(percentage / 100.0 * 4294967296.0);
+
+	forEachSampleRow(data, width, height, layout, SALT_AND_PEPPER_NOISE_STREAM, seed,
+		[&](unsigned char *samples, const uint32_t *random, const int count)
+	{
+		addSaltAndPepperSamples(samples, random, count, threshold);
+	});
+
+	return 0;
+}
+
+// Shot noise: every level is turned into level * photonsPerLevel expected photons, which are then counted.
+int addPoissonNoise(unsigned char *data, const int width, const int height, const NoiseLayout layout, const float photonsPerLevel, const uint64_t seed)
+{
+	if (photonsPerLevel <= 0.0f)
+	{
+		return -1;
+	}
+
+	const PoissonTables tables = poissonTables(photonsPerLevel);
+	const bool useAvx2 = cpuFeatures().avx2;
+
+	forEachSampleRow(data, width, height, layout, POISSON_NOISE_STREAM, seed,
+		[&](unsigned char *samples, const uint32_t *random, const int count)
+	{
+		const int done = useAvx2 ? addPoissonSamplesAvx2(samples, random, count, photonsPerLevel, tables) : 0;
+
+		addPoissonSamples(samples + done, random + done, count - done, photonsPerLevel, tables);
+	});
+
+	return 0;
+}
+
+// One pass of the separable [1 2 1] / 4 binomial blur with replicated borders, every byte is
+// filtered with its neighbours one pixel away, which keeps triplicated gray images gray.
+int binomialBlur(unsigned char *data, const int width, const int height, const NoiseLayout layout)
+{
+	const int pixelBytes = bytesPerPixel(layout);
+	const int rowBytes = width * pixelBytes;
+
+	std::vector<unsigned char> vertical((size_t)rowBytes * height);
+
+	parallelFor(height, DEGRADATION_MIN_ROWS_PER_THREAD, [&](const int /*chunk*/, const int firstRow, const int lastRow)
+	{
+		for (int y = firstRow; y < lastRow; ++y)
+		{
+			const unsigned char *above = data + (int64_t)std::max(0, y - 1) * rowBytes;
+			const unsigned char *center = data + (int64_t)y * rowBytes;
+			const unsigned char *below = data + (int64_t)std::min(height - 1, y + 1) * rowBytes;
+
+			unsigned char *result = vertical.data() + (int64_t)y * rowBytes;
+
+			for (int i = 0; i < rowBytes; ++i)
+			{
+				result[i] = (unsigned char)((above[i] + 2 * center[i] + below[i] + 2) >> 2);
+			}
+		}
+	});
+
+	parallelFor(height, DEGRADATION_MIN_ROWS_PER_THREAD, [&](const int /*chunk*/, const int firstRow, const int lastRow)
+	{
+		for (int y = firstRow; y < lastRow; ++y)
+		{
+			const unsigned char *source = vertical.data() + (int64_t)y * rowBytes;
+
+			unsigned char *result = data + (int64_t)y * rowBytes;
+
+			for (int i = 0; i < std::min(pixelBytes, rowBytes); ++i)
+			{
+				result[i] = (unsigned char)((3 * source[i] + source[std::min(i + pixelBytes, rowBytes - pixelBytes + i)] + 2) >> 2);
+			}
+
+			for (int i = pixelBytes; i < rowBytes - pixelBytes; ++i)
+			{
+				result[i] = (unsigned char)((source[i - pixelBytes] + 2 * source[i] + source[i + pixelBytes] + 2) >> 2);
+			}
+
+			for (int i = std::max(pixelBytes, rowBytes - pixelBytes); i < rowBytes; ++i)
+			{
+				result[i] = (unsigned char)((source[i - pixelBytes] + 3 * source[i] + 2) >> 2);
+			}
+		}
+	});
+
+	return 0;
+}
+
+// Quantization table of the given quality, scaled the same way as libjpeg does.
+void jpegQuantizationTable(const int quality, float *table)
+{
+	const int clampedQuality = std::min(100, std::max(1, quality));
+	const int scale = clampedQuality < 50 ? 5000 / clampedQuality : 200 - 2 * clampedQuality;
+
+	for (int i = 0; i < JPEG_BLOCK_SIZE * JPEG_BLOCK_SIZE; ++i)
+	{
+		table[i] = (float)std::min(255, std::max(1, (JPEG_LUMINANCE_QUANTIZATION[i] * scale + 50) / 100));
+	}
+}
+
+// Orthonormal 8 point DCT-II basis, basis[k * 8 + n], followed by its transpose.
+const float *dctBasis()
+{
+	static const std::vector<float> basis = []()
+	{
+		const int size = JPEG_BLOCK_SIZE * JPEG_BLOCK_SIZE;
+
+		std::vector<float> result(2 * size);
+
+		for (int k = 0; k < JPEG_BLOCK_SIZE; ++k)
+		{
+			for (int n = 0; n < JPEG_BLOCK_SIZE; ++n)
+			{
+				const double norm = k == 0 ? std::sqrt(1.0 / JPEG_BLOCK_SIZE) : std::sqrt(2.0 / JPEG_BLOCK_SIZE);
+				const float value = (float)(norm * std::cos(PI * (2 * n + 1) * k / (2.0 * JPEG_BLOCK_SIZE)));
+
+				result[k * JPEG_BLOCK_SIZE + n] = value;
+				result[size + n * JPEG_BLOCK_SIZE + k] = value;
+			}
+		}
+
+		return result;
+	}();
+
+	return basis.data();
+}
+
+// output = matrix * input * matrix^T, the forward DCT with the basis, the inverse with its transpose.
+void transformBlock(const float *input, float *output, const float *matrix)
+{
+	float temporary[JPEG_BLOCK_SIZE * JPEG_BLOCK_SIZE];
+
+	for (int row = 0; row < JPEG_BLOCK_SIZE; ++row)
+	{
+		for (int k = 0; k < JPEG_BLOCK_SIZE; ++k)
+		{
+			float sum = 0.0f;
+
+			for (int n = 0; n < JPEG_BLOCK_SIZE; ++n)
+			{
+				sum += input[row * JPEG_BLOCK_SIZE + n] * matrix[k * JPEG_BLOCK_SIZE + n];
+			}
+
+			temporary[k * JPEG_BLOCK_SIZE + row] = sum;
+		}
+	}
+
+	// temporary holds the row transform transposed, so the column pass reads it row by row as well
+	for (int row = 0; row < JPEG_BLOCK_SIZE; ++row)
+	{
+		for (int k = 0; k < JPEG_BLOCK_SIZE; ++k)
+		{
+			float sum = 0.0f;
+
+			for (int n = 0; n < JPEG_BLOCK_SIZE; ++n)
+			{
+				sum += temporary[row * JPEG_BLOCK_SIZE + n] * matrix[k * JPEG_BLOCK_SIZE + n];
+			}
+
+			output[k * JPEG_BLOCK_SIZE + row] = sum;
+		}
+	}
+}
+
+// JPEG style degradation without the entropy coding: every component is cut into 8x8 blocks,
+// transformed, quantized with the table of the given quality and transformed back.
+int jpegArtifacts(unsigned char *data, const int width, const int height, const NoiseLayout layout, const int quality)
+{
+	if ((quality < 1) || (quality > 100))
+	{
+		return -1;
+	}
+
+	float quantization[JPEG_BLOCK_SIZE * JPEG_BLOCK_SIZE];
+
+	jpegQuantizationTable(quality, quantization);
+
+	const int pixelBytes = bytesPerPixel(layout);
+	const int components = samplesPerPixel(layout);
+	const int blockRows = (height + JPEG_BLOCK_SIZE - 1) / JPEG_BLOCK_SIZE;
+
+	const float *forward = dctBasis();
+	const float *inverse = forward + JPEG_BLOCK_SIZE * JPEG_BLOCK_SIZE;
+
+	float reciprocal[JPEG_BLOCK_SIZE * JPEG_BLOCK_SIZE];
+
+	for (int i = 0; i < JPEG_BLOCK_SIZE * JPEG_BLOCK_SIZE; ++i)
+	{
+		reciprocal[i] = 1.0f / quantization[i];
+	}
+
+	parallelFor(blockRows, 1, [&](const int /*chunk*/, const int firstBlockRow, const int lastBlockRow)
+	{
+		float block[JPEG_BLOCK_SIZE * JPEG_BLOCK_SIZE], coefficients[JPEG_BLOCK_SIZE * JPEG_BLOCK_SIZE];
+
+		for (int blockRow = firstBlockRow; blockRow < lastBlockRow; ++blockRow)
+		{
+			const int top = blockRow * JPEG_BLOCK_SIZE;
+			const int blockHeight = std::min(JPEG_BLOCK_SIZE, height - top);
+
+			for (int left = 0; left < width; left += JPEG_BLOCK_SIZE)
+			{
+				const int blockWidth = std::min(JPEG_BLOCK_SIZE, width - left);
+
+				for (int component = 0; component < components; ++component)
+				{
+					// partial blocks at the right and bottom edge are padded by replication
+					for (int y = 0; y < JPEG_BLOCK_SIZE; ++y)
+					{
+						const unsigned char *row = data + ((int64_t)(top + std::min(y, blockHeight - 1)) * width + left) * pixelBytes + component;
+
+						for (int x = 0; x < JPEG_BLOCK_SIZE; ++x)
+						{
+							block[y * JPEG_BLOCK_SIZE + x] = row[std::min(x, blockWidth - 1) * pixelBytes] - 128.0f;
+						}
+					}
+
+					transformBlock(block, coefficients, forward);
+
+					for (int i = 0; i < JPEG_BLOCK_SIZE * JPEG_BLOCK_SIZE; ++i)
+					{
+						coefficients[i] = std::floor(coefficients[i] * reciprocal[i] + 0.5f) * quantization[i];
+					}
+
+					transformBlock(coefficients, block, inverse);
+
+					for (int y = 0; y < blockHeight; ++y)
+					{
+						unsigned char *row = data + ((int64_t)(top + y) * width + left) * pixelBytes;
+
+						for (int x = 0; x < blockWidth; ++x)
+						{
+							const unsigned char value = clampToByte(block[y * JPEG_BLOCK_SIZE + x] + 128.0f);
+
+							if (layout == GRAY_TRIPLICATED)
+							{
+								memset(row + x * pixelBytes, value, COMPONENT_COUNT);
+							}
+							else
+							{
+								row[x * pixelBytes + component] = value;
+							}
+						}
+					}
+				}
+			}
+		}
+	});
+
+	return 0;
+}
+
+// Applies the whole chain in the order a scan degrades: optics, sensor, transport and storage.
+int degradeImage(unsigned char *data, const int width, const int height, const NoiseLayout layout, const Degradation &degradation, const uint64_t seed)
+{
+	for (int pass = 0; pass < degradation.blurPasses; ++pass)
+	{
+		binomialBlur(data, width, height, layout);
+	}
+
+	if (degradation.photonsPerLevel > 0.0f)
+	{
+		addPoissonNoise(data, width, height, layout, degradation.photonsPerLevel, seed);
+	}
+
+	if (degradation.gaussianSigma > 0.0f)
+	{
+		addGaussianNoise(data, width, height, layout, degradation.gaussianSigma, seed);
+	}
+
+	if (degradation.speckleSigma > 0.0f)
+	{
+		addSpeckleNoise(data, width, height, layout, degradation.speckleSigma, seed);
+	}
+
+	if (degradation.saltAndPepperPercent > 0.0f)
+	{
+		addSaltAndPepperNoise(data, width, height, layout, degradation.saltAndPepperPercent, seed);
+	}
+
+	if (degradation.jpegQuality > 0)
+	{
+		jpegArtifacts(data, width, height, layout, degradation.jpegQuality);
+	}
+
+	return 0;
+}
+
+// Parameters of page pageIndex of a corpus, drawn from the seed, so a whole corpus is regenerable
+// from (seed, page count) and every page can be produced independently of the others.
+Degradation randomDegradation(const uint64_t seed, const int pageIndex)
+{
+	RandomSequence random(seed, DEGRADATION_PARAMETER_STREAM, pageIndex);
+
+	Degradation degradation;
+
+	degradation.blurPasses = (int)random.nextBelow(3);
+	degradation.photonsPerLevel = random.nextBelow(2) ? (float)(0.5 + 4.0 * random.nextUnit()) : 0.0f;
+	degradation.gaussianSigma = (float)(12.0 * random.nextUnit());
+	degradation.speckleSigma = random.nextBelow(2) ? (float)(0.15 * random.nextUnit()) : 0.0f;
+	degradation.saltAndPepperPercent = random.nextBelow(2) ? (float)(2.0 * random.nextUnit()) : 0.0f;
+	degradation.jpegQuality = random.nextBelow(2) ? 10 + (int)random.nextBelow(81) : 0;
+
+	return degradation;
+}
+
+// Noise seed of page pageIndex, drawn from (seed, pageIndex) like its parameters, so neighbouring
+// seeds do not share pages the way seed + pageIndex would.
+uint64_t pageNoiseSeed(const uint64_t seed, const int pageIndex)
+{
+	RandomSequence random(seed, PAGE_SEED_STREAM, pageIndex);
+
+	const uint64_t high = random.next();
+
+	return (high << 32) | random.next();
+}
+
+}
+#endif
@@ -0,0 +1,504 @@
+#ifndef EDGE_PRESERVING_FUNCS_H
+#define EDGE_PRESERVING_FUNCS_H
+
+#include "image_funcs.h"
+
+constexpr int EDGE_PRESERVING_MIN_ROWS_PER_THREAD = 32;
+
+// Column passes run on strips this wide, so their running sums stay cached.
+constexpr int BOX_FILTER_STRIP_COLUMNS = 256;
+
+// A grid cell spans sigma pixels, finer grids would outgrow the image many times over.
+constexpr double MIN_BILATERAL_SPATIAL_SIGMA = 4.0;
+constexpr double MIN_BILATERAL_RANGE_SIGMA = 1.0;
+
+// Non-local means works on bands of this many rows, which bounds the integral images.
+constexpr int NLM_BAND_ROWS = 64;
+constexpr int NLM_MIN_ROWS_PER_THREAD = 16;
+
+namespace imgf
+{
+
+// Bilateral grid of Chen, Paris and Durand. Cells are spatialSigma pixels wide and rangeSigma
+// gray levels deep, with one empty cell around the occupied ones. Every cell holds the sum of
+// the values splatted into it and their count.
+struct BilateralGrid
+{
+	int width, height, depth;
+	std::vector<float> cells;
+
+	BilateralGrid(const int width, const int height, const int depth)
+		: width(width), height(height), depth(depth), cells((size_t)width * height * depth * 2, 0.0f)
+	{
+	}
+
+	float *cell(const int x, const int y, const int z)
+	{
+		return cells.data() + ((((size_t)y * width + x) * depth) + z) * 2;
+	}
+};
+
+// Blurs the grid with [1 2 1] / 4 along one axis (0: depth, 1: width, 2: height), cells past
+// the grid count as empty. Every thread writes its own grid rows.
+void blurBilateralGrid(const BilateralGrid &input, BilateralGrid &output, const int axis)
+{
+	const size_t steps[3] = { 2, (size_t)input.depth * 2, (size_t)input.width * input.depth * 2 };
+	const int sizes[3] = { input.depth, input.width, input.height };
+	const size_t step = steps[axis];
+
+	parallelFor(input.height, 1, [&](const int /*chunk*/, const int firstRow, const int lastRow)
+	{
+		for (int y = firstRow; y < lastRow; ++y)
+		{
+			for (int x = 0; x < input.width; ++x)
+			{
+				for (int z = 0; z < input.depth; ++z)
+				{
+					const int coordinates[3] = { z, x, y };
+					const int position = coordinates[axis];
+					const size_t index = ((((size_t)y * input.width + x) * input.depth) + z) * 2;
+
+					for (int channel = 0; channel < 2; ++channel)
+					{
+						const float before = (position > 0) ? input.cells[index - step + channel] : 0.0f;
+						const float after = (position < sizes[axis] - 1) ? input.cells[index + step + channel] : 0.0f;
+
+						output.cells[index + channel] = 0.25f * before + 0.5f * input.cells[index + channel] + 0.25f * after;
+					}
+				}
+			}
+		}
+	});
+}
+
+// Edge-preserving smoothing of a gray RGB image in place, approximating a bilateral filter
+// with the given spatial and range sigmas. The pixels are splatted into a bilateral grid, the
+// grid is blurred and the result is read back by trilinear interpolation, so the cost is
+// linear in the pixel count whatever the sigmas. Sigmas below MIN_BILATERAL_SPATIAL_SIGMA and
+// MIN_BILATERAL_RANGE_SIGMA are rejected.
+int bilateralGridFilter(unsigned char *data, const int width, const int height, const double spatialSigma, const double rangeSigma)
+{
+	if ((spatialSigma < MIN_BILATERAL_SPATIAL_SIGMA) || (rangeSigma < MIN_BILATERAL_RANGE_SIGMA))
+	{
+		return -1;
+	}
+
+	const int gridWidth = (int)((width - 1) / spatialSigma + 0.5) + 3;
+	const int gridHeight = (int)((height - 1) / spatialSigma + 0.5) + 3;
+	const int gridDepth = (int)(MAX_RGB_VALUE / rangeSigma + 0.5) + 3;
+
+	BilateralGrid grid(gridWidth, gridHeight, gridDepth), blurred(gridWidth, gridHeight, gridDepth);
+
+	// grid coordinates of every column and gray level, so that no pixel has to divide
+	std::vector<float> columnPositions(width), levelPositions(BUCKET_COUNT);
+
+	for (int x = 0; x < width; ++x)
+	{
+		columnPositions[x] = (float)(x / spatialSigma) + 1.0f;
+	}
+
+	for (int level = 0; level < BUCKET_COUNT; ++level)
+	{
+		levelPositions[level] = (float)(level / rangeSigma) + 1.0f;
+	}
+
+	// image rows that splat into grid row y, a thread owns whole grid rows so no cell is shared
+	std::vector<int> firstRowOfCell(gridHeight + 1, height);
+
+	for (int y = height - 1; y >= 0; --y)
+	{
+		firstRowOfCell[(int)(y / spatialSigma + 0.5) + 1] = y;
+	}
+
+	for (int y = gridHeight - 1; y > 0; --y)
+	{
+		firstRowOfCell[y - 1] = std::min(firstRowOfCell[y - 1], firstRowOfCell[y]);
+	}
+
+	parallelFor(gridHeight - 2, 1, [&](const int /*chunk*/, const int firstCell, const int lastCell)
+	{
+		for (int y = firstRowOfCell[firstCell + 1]; y < firstRowOfCell[lastCell + 1]; ++y)
+		{
+			const int gridY = (int)(y / spatialSigma + 0.5) + 1;
+
+			for (int x = 0; x < width; ++x)
+			{
+				const unsigned char value = data[indexOf(x, y, width)];
+				float *cell = grid.cell((int)(columnPositions[x] + 0.5f), gridY, (int)(levelPositions[value] + 0.5f));
+
+				cell[0] += value;
+				cell[1] += 1.0f;
+			}
+		}
+	});
+
+	blurBilateralGrid(grid, blurred, 0);
+	blurBilateralGrid(blurred, grid, 1);
+	blurBilateralGrid(grid, blurred, 2);
+
+	// the slice interpolates the two grid rows around an image row once, every pixel then
+	// only mixes the four cells around its column and gray level
+	std::vector<int> columnCells(width), levelCells(BUCKET_COUNT);
+	std::vector<float> columnFractions(width), levelFractions(BUCKET_COUNT);
+
+	for (int x = 0; x < width; ++x)
+	{
+		columnCells[x] = std::min((int)columnPositions[x], gridWidth - 2);
+		columnFractions[x] = columnPositions[x] - columnCells[x];
+	}
+
+	for (int level = 0; level < BUCKET_COUNT; ++level)
+	{
+		levelCells[level] = std::min((int)levelPositions[level], gridDepth - 2);
+		levelFractions[level] = levelPositions[level] - levelCells[level];
+	}
+
+	parallelFor(height, EDGE_PRESERVING_MIN_ROWS_PER_THREAD, [&](const int /*chunk*/, const int firstRow, const int lastRow)
+	{
+		std::vector<unsigned char> planar(width);
+		std::vector<float> slab((size_t)gridWidth * gridDepth * 2);
+
+		for (int y = firstRow; y < lastRow; ++y)
+		{
+			const float gridY = (float)(y / spatialSigma) + 1.0f;
+			const int cellY = std::min((int)gridY, gridHeight - 2);
+			const float fractionY = gridY - cellY;
+			const float *upper = blurred.cell(0, cellY, 0);
+			const float *lower = blurred.cell(0, cellY + 1, 0);
+
+			for (size_t i = 0; i < slab.size(); ++i)
+			{
+				slab[i] = upper[i] + fractionY * (lower[i] - upper[i]);
+			}
+
+			for (int x = 0; x < width; ++x)
+			{
+				const unsigned char value = data[indexOf(x, y, width)];
+				const float fractionX = columnFractions[x], fractionZ = levelFractions[value];
+				const float *left = slab.data() + ((size_t)columnCells[x] * gridDepth + levelCells[value]) * 2;
+				const float *right = left + (size_t)gridDepth * 2;
+
+				const float sum = (1.0f - fractionX) * ((1.0f - fractionZ) * left[0] + fractionZ * left[2]) + fractionX * ((1.0f - fractionZ) * right[0] + fractionZ * right[2]);
+				const float count = (1.0f - fractionX) * ((1.0f - fractionZ) * left[1] + fractionZ * left[3]) + fractionX * ((1.0f - fractionZ) * right[1] + fractionZ * right[3]);
+
+				planar[x] = (count > 0.0f) ? (unsigned char)std::min(std::max(sum / count + 0.5f, (float)MIN_RGB_VALUE), (float)MAX_RGB_VALUE) : value;
+			}
+
+			triplicatePixels(planar.data(), data + indexOf(0, y, width), width);
+		}
+	});
+
+	return 0;
+}
+
+// Float planes come from the buffer pool as well, so later pages reuse the memory instead of
+// faulting in fresh pages.
+float *acquirePlane(const int width, const int height)
+{
+	return (float *)BufferPool::shared().acquire((size_t)width * height * sizeof(float));
+}
+
+void releasePlane(float *plane)
+{
+	BufferPool::shared().release((unsigned char *)plane);
+}
+
+// Mean of the (2 * radius + 1)^2 window around every pixel of a planar float image, windows
+// are cut at the image border and divided by the pixels they keep. Sums run in double, so
+// the running sums do not drift on large images. input and output may alias.
+void boxMeanPlanar(const float *input, float *output, const int width, const int height, const int radius)
+{
+	float *rows = acquirePlane(width, height);
+
+	parallelFor(height, EDGE_PRESERVING_MIN_ROWS_PER_THREAD, [&](const int /*chunk*/, const int firstRow, const int lastRow)
+	{
+		std::vector<double> prefix(width + 1);
+
+		for (int y = firstRow; y < lastRow; ++y)
+		{
+			const float *inputRow = input + (size_t)y * width;
+			float *rowSums = rows + (size_t)y * width;
+
+			prefix[0] = 0.0;
+
+			for (int x = 0; x < width; ++x)
+			{
+				prefix[x + 1] = prefix[x] + inputRow[x];
+			}
+
+			// only the windows cut by the border have a different size
+			const double scale = 1.0 / (2 * radius + 1);
+
+			for (int x = 0; x < width; ++x)
+			{
+				const int first = std::max(0, x - radius), last = std::min(width, x + radius + 1);
+
+				rowSums[x] = (float)((prefix[last] - prefix[first]) * ((last - first == 2 * radius + 1) ? scale : 1.0 / (last - first)));
+			}
+		}
+	});
+
+	const int stripCount = (width + BOX_FILTER_STRIP_COLUMNS - 1) / BOX_FILTER_STRIP_COLUMNS;
+
+	parallelFor(stripCount, 1, [&](const int /*chunk*/, const int firstStrip, const int lastStrip)
+	{
+		std::vector<double> sums(BOX_FILTER_STRIP_COLUMNS);
+
+		for (int strip = firstStrip; strip < lastStrip; ++strip)
+		{
+			const int firstColumn = strip * BOX_FILTER_STRIP_COLUMNS;
+			const int count = std::min(BOX_FILTER_STRIP_COLUMNS, width - firstColumn);
+
+			std::fill(sums.begin(), sums.end(), 0.0);
+
+			for (int y = 0; y < std::min(height, radius); ++y)
+			{
+				const float *row = rows + (size_t)y * width + firstColumn;
+
+				for (int x = 0; x < count; ++x)
+				{
+					sums[x] += row[x];
+				}
+			}
+
+			// sums holds the rows [y - radius, y + radius] that exist
+			for (int y = 0; y < height; ++y)
+			{
+				const double scale = 1.0 / (std::min(height, y + radius + 1) - std::max(0, y - radius));
+
+				float *outputRow = output + (size_t)y * width + firstColumn;
+
+				if (y + radius < height)
+				{
+					const float *entering = rows + (size_t)(y + radius) * width + firstColumn;
+
+					for (int x = 0; x < count; ++x)
+					{
+						sums[x] += entering[x];
+					}
+				}
+
+				if (y - radius - 1 >= 0)
+				{
+					const float *leaving = rows + (size_t)(y - radius - 1) * width + firstColumn;
+
+					for (int x = 0; x < count; ++x)
+					{
+						sums[x] -= leaving[x];
+					}
+				}
+
+				for (int x = 0; x < count; ++x)
+				{
+					outputRow[x] = (float)(sums[x] * scale);
+				}
+			}
+		}
+	});
+
+	releasePlane(rows);
+}
+
+// Self-guided filter of He, Sun and Tang on a gray RGB image in place. Every window fits the
+// output as a * input + b, which keeps edges, where the window variance is well above
+// epsilon (in squared gray levels), and flattens the rest. Built from box means, so the cost
+// does not depend on the radius.
+int guidedFilter(unsigned char *data, const int width, const int height, const int radius, const double epsilon)
+{
+	if ((radius < 1) || (epsilon <= 0.0))
+	{
+		return -1;
+	}
+
+	float *guide = acquirePlane(width, height);
+	float *mean = acquirePlane(width, height);
+	float *squares = acquirePlane(width, height);
+
+	parallelFor(height, EDGE_PRESERVING_MIN_ROWS_PER_THREAD, [&](const int /*chunk*/, const int firstRow, const int lastRow)
+	{
+		for (size_t i = (size_t)firstRow * width; i < (size_t)lastRow * width; ++i)
+		{
+			guide[i] = data[i * COMPONENT_COUNT];
+			squares[i] = guide[i] * guide[i];
+		}
+	});
+
+	boxMeanPlanar(guide, mean, width, height, radius);
+	boxMeanPlanar(squares, squares, width, height, radius);
+
+	// a goes into squares, b into mean
+	parallelFor(height, EDGE_PRESERVING_MIN_ROWS_PER_THREAD, [&](const int /*chunk*/, const int firstRow, const int lastRow)
+	{
+		for (size_t i = (size_t)firstRow * width; i < (size_t)lastRow * width; ++i)
+		{
+			const float variance = std::max(0.0f, squares[i] - mean[i] * mean[i]);
+			const float a = variance / (variance + (float)epsilon);
+
+			squares[i] = a;
+			mean[i] = mean[i] - a * mean[i];
+		}
+	});
+
+	boxMeanPlanar(squares, squares, width, height, radius);
+	boxMeanPlanar(mean, mean, width, height, radius);
+
+	parallelFor(height, EDGE_PRESERVING_MIN_ROWS_PER_THREAD, [&](const int /*chunk*/, const int firstRow, const int lastRow)
+	{
+		std::vector<unsigned char> planar(width);
+
+		for (int y = firstRow; y < lastRow; ++y)
+		{
+			for (int x = 0; x < width; ++x)
+			{
+				const size_t i = (size_t)y * width + x;
+
+				planar[x] = (unsigned char)std::min(std::max(squares[i] * guide[i] + mean[i] + 0.5f, (float)MIN_RGB_VALUE), (float)MAX_RGB_VALUE);
+			}
+
+			triplicatePixels(planar.data(), data + indexOf(0, y, width), width);
+		}
+	});
+
+	releasePlane(guide);
+	releasePlane(mean);
+	releasePlane(squares);
+
+	return 0;
+}
+
+// Replicates the border of a planar gray image by border pixels on every side.
+std::vector<unsigned char> padPlanar(const unsigned char *gray, const int width, const int height, const int border)
+{
+	const int paddedWidth = width + 2 * border;
+
+	std::vector<unsigned char> padded((size_t)paddedWidth * (height + 2 * border));
+
+	for (int y = 0; y < height + 2 * border; ++y)
+	{
+		const unsigned char *row = gray + (size_t)std::min(std::max(y - border, 0), height - 1) * width;
+		unsigned char *paddedRow = padded.data() + (size_t)y * paddedWidth;
+
+		memset(paddedRow, row[0], border);
+		memcpy(paddedRow + border, row, width);
+		memset(paddedRow + border + width, row[width - 1], border);
+	}
+
+	return padded;
+}
+
+// Non-local means of the rows [firstRow, lastRow), see nonLocalMeans(). padded is the image
+// padded by searchRadius + patchRadius pixels.
+void nonLocalMeansBand(const unsigned char *padded, const int width, const int firstRow, const int lastRow, const int searchRadius, const int patchRadius, const float *weightTable, unsigned char *data)
+{
+	const int border = searchRadius + patchRadius;
+	const int paddedWidth = width + 2 * border;
+	const int bandRows = lastRow - firstRow;
+	const int integralWidth = width + 2 * patchRadius + 1;
+	const int integralRows = bandRows + 2 * patchRadius + 1;
+	const int patchSize = 2 * patchRadius + 1;
+	const float inverseArea = 1.0f / (patchSize * patchSize);
+
+	std::vector<float> sums((size_t)bandRows * width, 0.0f), weights((size_t)bandRows * width, 0.0f);
+	std::vector<uint32_t> integral((size_t)integralRows * integralWidth, 0);
+	std::vector<unsigned char> planar(width);
+
+	for (int dy = -searchRadius; dy <= searchRadius; ++dy)
+	{
+		for (int dx = -searchRadius; dx <= searchRadius; ++dx)
+		{
+			// integral image of the squared differences to the shifted image over the band and
+			// the patch halo, summed modulo 2^32, which still gives exact patch sums
+			for (int row = 1; row < integralRows; ++row)
+			{
+				const int y = firstRow - patchRadius + row - 1 + border;
+				const unsigned char *pixels = padded + (size_t)y * paddedWidth + searchRadius;
+				const unsigned char *shifted = padded + (size_t)(y + dy) * paddedWidth + searchRadius + dx;
+				const uint32_t *above = integral.data() + (size_t)(row - 1) * integralWidth;
+
+				uint32_t *sumRow = integral.data() + (size_t)row * integralWidth;
+				uint32_t running = 0;
+
+				for (int column = 1; column < integralWidth; ++column)
+				{
+					const int difference = pixels[column - 1] - shifted[column - 1];
+
+					running += difference * difference;
+					sumRow[column] = above[column] + running;
+				}
+			}
+
+			for (int row = 0; row < bandRows; ++row)
+			{
+				const uint32_t *top = integral.data() + (size_t)row * integralWidth;
+				const uint32_t *bottom = top + (size_t)patchSize * integralWidth;
+				const unsigned char *shifted = padded + (size_t)(firstRow + row + border + dy) * paddedWidth + border + dx;
+
+				float *rowSums = sums.data() + (size_t)row * width;
+				float *rowWeights = weights.data() + (size_t)row * width;
+
+				for (int x = 0; x < width; ++x)
+				{
+					const uint32_t distance = bottom[x + patchSize] - bottom[x] - top[x + patchSize] + top[x];
+					const float weight = weightTable[(int)(distance * inverseArea)];
+
+					rowSums[x] += weight * shifted[x];
+					rowWeights[x] += weight;
+				}
+			}
+		}
+	}
+
+	for (int row = 0; row < bandRows; ++row)
+	{
+		for (int x = 0; x < width; ++x)
+		{
+			const size_t i = (size_t)row * width + x;
+
+			planar[x] = (unsigned char)std::min(sums[i] / weights[i] + 0.5f, (float)MAX_RGB_VALUE);
+		}
+
+		triplicatePixels(planar.data(), data + indexOf(0, firstRow + row, width), width);
+	}
+}
+
+// Non-local means denoising of a gray RGB image in place (Buades, Coll and Morel). Every pixel
+// becomes the weighted mean of the pixels in its (2 * searchRadius + 1)^2 search window,
+// weighted by exp(-d / strength^2), d being the mean squared difference of the patches of
+// (2 * patchRadius + 1)^2 pixels around the two. Following Darbon et al. the patch distances of
+// one search offset come from an integral image of the squared differences between the image
+// and its shifted copy, so they cost the same for every patch size. Bands of rows run in
+// parallel, borders are replicated.
+int nonLocalMeans(unsigned char *data, const int width, const int height, const int searchRadius, const int patchRadius, const double strength)
+{
+	if ((searchRadius < 1) || (patchRadius < 0) || (strength <= 0.0))
+	{
+		return -1;
+	}
+
+	std::vector<unsigned char> gray((size_t)width * height);
+
+	convertToGrayscalePlanar(data, gray.data(), width, height);
+
+	const std::vector<unsigned char> padded = padPlanar(gray.data(), width, height, searchRadius + patchRadius);
+
+	// mean squared patch differences are at most 255^2
+	std::vector<float> weightTable(MAX_RGB_VALUE * MAX_RGB_VALUE + 1);
+
+	for (size_t distance = 0; distance < weightTable.size(); ++distance)
+	{
+		weightTable[distance] = (float)std::exp(-(double)distance / (strength * strength));
+	}
+
+	parallelFor(height, NLM_MIN_ROWS_PER_THREAD, [&](const int /*chunk*/, const int firstRow, const int lastRow)
+	{
+		for (int bandFirst = firstRow; bandFirst < lastRow; bandFirst += NLM_BAND_ROWS)
+		{
+			nonLocalMeansBand(padded.data(), width, bandFirst, std::min(lastRow, bandFirst + NLM_BAND_ROWS), searchRadius, patchRadius, weightTable.data(), data);
+		}
+	});
+
+	return 0;
+}
+
+}
+#endif
@@ -0,0 +1,207 @@
+#ifndef FILTER_SEARCH_FUNCS_H
+#define FILTER_SEARCH_FUNCS_H
+
+#include "image_funcs.h"
+#include "quality_funcs.h"
+
+constexpr int FILTER_SEARCH_MIN_ROWS_PER_THREAD = 32;
+
+enum FilterType
+{
+	FILTER_MEAN,
+	FILTER_MEDIAN
+};
+
+namespace imgf
+{
+
+struct FilterCandidate
+{
+	FilterType type;
+	int windowSize;
+	double meanSquaredError;
+};
+
+// Integral image of a gray image padded by radius pixels on every side according to the border
+// mode, so the sum of any window up to 2 * radius + 1 pixels wide is four lookups. The sums
+// wrap around modulo 2^32, which leaves the window sums, all below 2^32, exact.
+struct PaddedIntegralImage
+{
+	int width, height, radius, stride;
+	std::vector<uint32_t> sums;
+
+	PaddedIntegralImage(const unsigned char *data, const int width, const int height, const int radius, const BorderMode borderMode)
+		: width(width), height(height), radius(radius), stride(width + 2 * radius + 1), sums((size_t)(height + 2 * radius + 1) * (width + 2 * radius + 1), 0)
+	{
+		const BorderMode mode = (borderMode == BORDER_NONE) ? BORDER_REPLICATE : borderMode;
+
+		std::vector<unsigned char> padded(width + 2 * radius);
+
+		for (int y = -radius; y < height + radius; ++y)
+		{
+			const int source = borderIndex(y, height, mode);
+
+			padRow(source < 0 ? nullptr : data + indexOf(0, source, width), width, radius, mode, padded.data());
+
+			const uint32_t *above = sums.data() + (size_t)(y + radius) * stride;
+			uint32_t *row = sums.data() + (size_t)(y + radius + 1) * stride;
+
+			uint32_t rowSum = 0;
+
+			for (int x = 0; x < width + 2 * radius; ++x)
+			{
+				rowSum += padded[x];
+
+				row[x + 1] = above[x + 1] + rowSum;
+			}
+		}
+	}
+
+	// Sum of the (2 * windowRadius + 1)^2 window around (x, y).
+	uint32_t windowSum(const int x, const int y, const int windowRadius) const
+	{
+		const uint32_t *top = sums.data() + (size_t)(y + radius - windowRadius) * stride + (x + radius - windowRadius);
+		const uint32_t *bottom = top + (size_t)(2 * windowRadius + 1) * stride;
+		const int size = 2 * windowRadius + 1;
+
+		return bottom[size] - bottom[0] - top[size] + top[0];
+	}
+};
+
+bool isBinaryImage(const unsigned char *data, const int width, const int height)
+{
+	uint64_t histogram[BUCKET_COUNT];
+
+	computeHistogram(data, width, height, COMPONENT_COUNT, histogram);
+
+	return histogram[MIN_RGB_VALUE] + histogram[MAX_RGB_VALUE] == (uint64_t)width * height;
+}
+
+// Scores the mean and median filters of every odd window size up to maxWindowSize by the mean
+// squared error of the filtered noisy image against reference, and returns the candidates
+// sorted best first. Every mean filter is read from one shared integral image. On a binary
+// image the median is a majority vote, so the median filters are read from it as well; other
+// images are median filtered candidate by candidate. Row bands run in parallel, each scoring
+// all candidates, so a band reads the shared integral rows once for all window sizes.
+std::vector<FilterCandidate> searchFilterParameters(const unsigned char *reference, const unsigned char *noisy, const int width, const int height, const int maxWindowSize, const BorderMode borderMode)
+{
+	std::vector<FilterCandidate> candidates;
+
+	for (int windowSize = 3; windowSize <= maxWindowSize; windowSize += 2)
+	{
+		candidates.push_back({ FILTER_MEAN, windowSize, 0.0 });
+		candidates.push_back({ FILTER_MEDIAN, windowSize, 0.0 });
+	}
+
+	if (candidates.empty())
+	{
+		return candidates;
+	}
+
+	const bool isBinary = isBinaryImage(noisy, width, height);
+	const PaddedIntegralImage integral(noisy, width, height, maxWindowSize / 2, borderMode);
+	const int candidateCount = (int)candidates.size();
+
+	std::vector<uint64_t> partials((size_t)chunkCountFor(height, FILTER_SEARCH_MIN_ROWS_PER_THREAD) * candidateCount, 0);
+
+	parallelFor(height, FILTER_SEARCH_MIN_ROWS_PER_THREAD, [&](const int chunk, const int firstRow, const int lastRow)
+	{
+		uint64_t *errors = partials.data() + (size_t)chunk * candidateCount;
+
+		for (int y = firstRow; y < lastRow; ++y)
+		{
+			const unsigned char *referenceRow = reference + indexOf(0, y, width);
+			const unsigned char *noisyRow = noisy + indexOf(0, y, width);
+
+			for (int candidate = 0; candidate < candidateCount; ++candidate)
+			{
+				const FilterCandidate &filter = candidates[candidate];
+
+				if ((filter.type == FILTER_MEDIAN) && !isBinary)
+				{
+					continue;
+				}
+
+				const int windowRadius = filter.windowSize / 2;
+				const int area = filter.windowSize * filter.windowSize;
+				const int centerIndex = std::min(area / 2 + 1, area - 1);
+
+				// BORDER_NONE keeps the pixels the window does not fit around, see restoreUnfilteredBorder()
+				const bool isRowKept = (borderMode == BORDER_NONE) && ((y < windowRadius) || (y >= height - windowRadius) || (width <= 2 * windowRadius));
+				const int keptColumns = (borderMode == BORDER_NONE) ? windowRadius : 0;
+
+				uint64_t error = 0;
+
+				for (int x = 0; x < width; ++x)
+				{
+					int value = noisyRow[x * COMPONENT_COUNT];
+
+					if (!isRowKept && (x >= keptColumns) && (x < width - keptColumns))
+					{
+						const uint32_t sum = integral.windowSum(x, y, windowRadius);
+
+						if (filter.type == FILTER_MEAN)
+						{
+							value = (int)(sum / area);
+						}
+						else
+						{
+							// the sorted window starts with its zeros
+							const int zeroCount = area - (int)(sum / MAX_RGB_VALUE);
+
+							value = centerIndex < zeroCount ? MIN_RGB_VALUE : MAX_RGB_VALUE;
+						}
+					}
+
+					const int difference = value - referenceRow[x * COMPONENT_COUNT];
+
+					error += difference * difference;
+				}
+
+				errors[candidate] += error;
+			}
+		}
+	});
+
+	const double pixelCount = (double)width * height;
+
+	unsigned char *filtered = isBinary ? nullptr : acquireImageBuffer(width, height);
+
+	for (int candidate = 0; candidate < candidateCount; ++candidate)
+	{
+		FilterCandidate &filter = candidates[candidate];
+
+		if ((filter.type == FILTER_MEDIAN) && !isBinary)
+		{
+			medianFilterTo(noisy, filtered, width, height, filter.windowSize, borderMode);
+
+			filter.meanSquaredError = meanSquaredError(reference, filtered, width, height);
+
+			continue;
+		}
+
+		uint64_t error = 0;
+
+		for (size_t chunk = 0; chunk < partials.size() / candidateCount; ++chunk)
+		{
+			error += partials[chunk * candidateCount + candidate];
+		}
+
+		filter.meanSquaredError = (double)error / pixelCount;
+	}
+
+	if (filtered)
+	{
+		releaseImageBuffer(filtered);
+	}
+
+	std::stable_sort(candidates.begin(), candidates.end(), [](const FilterCandidate &a, const FilterCandidate &b)
+	{
+		return a.meanSquaredError < b.meanSquaredError;
+	});
+
+	return candidates;
+}
+
+}
+#endif
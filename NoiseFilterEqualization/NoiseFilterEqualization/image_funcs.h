@@ -4,6 +4,21 @@
 #include <random>
 #include <cstdint>
 #include <algorithm>
+#include <cmath>
+#include <vector>
+#include <thread>
+#include <mutex>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define IMGF_TARGET_SSSE3
+#define IMGF_TARGET_AVX2
+#else
+#include <cpuid.h>
+#include <x86intrin.h>
+#define IMGF_TARGET_SSSE3 __attribute__((target("ssse3")))
+#define IMGF_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
 
 enum Component
 {
@@ -12,6 +27,23 @@ enum Component
 	B = 2
 };
 
+enum LocalThresholdMethod
+{
+	NIBLACK,
+	SAUVOLA
+};
+
+// How filters extend the image beyond its edges. BORDER_NONE leaves the pixels whose window
+// would reach outside unfiltered.
+enum BorderMode
+{
+	BORDER_NONE,
+	BORDER_REPLICATE,
+	BORDER_REFLECT,
+	BORDER_CONSTANT,
+	BORDER_WRAP
+};
+
 constexpr int COMPONENT_COUNT = 3;
 constexpr int BUCKET_COUNT = 256;
 
@@ -19,229 +51,2003 @@ constexpr float R_WEIGHT = 0.3f;
 constexpr float G_WEIGHT = 0.59f;
 constexpr float B_WEIGHT = 0.11f;
 
+// 8.8 fixed-point versions of the weights above, they add up to exactly 256, so gray stays gray
+constexpr int GRAYSCALE_FIXED_SHIFT = 8;
+constexpr int GRAYSCALE_FIXED_ROUNDING = 1 << (GRAYSCALE_FIXED_SHIFT - 1);
+constexpr int R_FIXED_WEIGHT = (int)(R_WEIGHT * (1 << GRAYSCALE_FIXED_SHIFT) + 0.5f);
+constexpr int G_FIXED_WEIGHT = (int)(G_WEIGHT * (1 << GRAYSCALE_FIXED_SHIFT) + 0.5f);
+constexpr int B_FIXED_WEIGHT = (int)(B_WEIGHT * (1 << GRAYSCALE_FIXED_SHIFT) + 0.5f);
+
+constexpr double PI = 3.14159265358979323846;
+
 constexpr int MIN_RGB_VALUE = 0;
 constexpr int MAX_RGB_VALUE = 255;
 
+constexpr int LOCAL_THRESHOLD_WINDOW_SIZE = 31;
+constexpr float NIBLACK_K = -0.2f;
+constexpr float SAUVOLA_K = 0.34f;
+constexpr double SAUVOLA_DYNAMIC_RANGE = 128.0;
+
+// Up to this many pixels count^2 * 255^2 / 4, the largest count^2 times the variance of a
+// window, is below 2^64.
+constexpr uint64_t EXACT_VARIANCE_MAX_COUNT = (uint64_t)1 << 25;
+
 namespace imgf
 {
 
-int indexOf(const int x, const int y, const int width)
+struct CpuFeatures
 {
-	return y * width * COMPONENT_COUNT + x * COMPONENT_COUNT;
+	bool ssse3;
+	bool avx2;
+};
+
+void cpuid(int registers[4], const int leaf, const int subleaf)
+{
+#if defined(_MSC_VER)
+	__cpuidex(registers, leaf, subleaf);
+#else
+	__cpuid_count(leaf, subleaf, registers[0], registers[1], registers[2], registers[3]);
+#endif
 }
 
-bool isGrayscale(const unsigned char *data)
+uint64_t extendedControlRegister()
 {
-	return data[0] == data[1] == data[2];
+#if defined(_MSC_VER)
+	return _xgetbv(0);
+#else
+	uint32_t low, high;
+
+	__asm__ volatile ("xgetbv" : "=a"(low), "=d"(high) : "c"(0));
+
+	return ((uint64_t)high << 32) | low;
+#endif
 }
 
-void convertToGrayscale(unsigned char *data, const int width, const int height)
+CpuFeatures detectCpuFeatures()
 {
-	for (int y = 0; y < height; ++y)
+	CpuFeatures features = { false, false };
+
+	int registers[4];
+
+	cpuid(registers, 0, 0);
+
+	const int maxLeaf = registers[0];
+
+	if (maxLeaf < 1)
 	{
-		for (int x = 0; x < width; ++x)
-		{
-			const int position = indexOf(x, y, width);
-			const int grayValue = R_WEIGHT * data[position + R]
-				+ G_WEIGHT * data[position + G]
-				+ B_WEIGHT * data[position + B];
+		return features;
+	}
 
-			memset(data + position, grayValue, COMPONENT_COUNT);
-		}
+	cpuid(registers, 1, 0);
+
+	features.ssse3 = (registers[2] & (1 << 9)) != 0;
+
+	const bool osSavesYmm = ((registers[2] & (1 << 27)) != 0) && ((extendedControlRegister() & 0x6) == 0x6);
+
+	if (osSavesYmm && (maxLeaf >= 7))
+	{
+		cpuid(registers, 7, 0);
+
+		features.avx2 = (registers[1] & (1 << 5)) != 0;
 	}
+
+	return features;
 }
 
-void convertToBinary(unsigned char *data, const int width, const int height, const int threshold)
+int workerCount()
 {
-	if ((threshold < MIN_RGB_VALUE) || (threshold > MAX_RGB_VALUE))
+	const int hardwareThreads = (int)std::thread::hardware_concurrency();
+
+	return hardwareThreads > 0 ? hardwareThreads : 1;
+}
+
+// Number of chunks parallelFor() will use, so callers can size per-chunk scratch space beforehand.
+int chunkCountFor(const int count, const int minChunkSize)
+{
+	const int maxChunks = std::max(1, count / std::max(1, minChunkSize));
+
+	return std::max(1, std::min(workerCount(), maxChunks));
+}
+
+// Splits [0, count) into chunkCountFor() contiguous chunks and calls
+// function(chunkIndex, begin, end) for each of them on its own thread.
+template <typename Function>
+int parallelFor(const int count, const int minChunkSize, Function function)
+{
+	const int chunkCount = chunkCountFor(count, minChunkSize);
+
+	if (chunkCount == 1)
 	{
-		return;
+		function(0, 0, count);
+
+		return 1;
 	}
 
-	for (int y = 0; y < height; ++y)
+	std::vector<std::thread> threads;
+
+	for (int chunk = 0; chunk < chunkCount; ++chunk)
 	{
-		for (int x = 0; x < width; ++x)
-		{
-			const int newValue = data[indexOf(x, y, width) + R] < threshold ? 0 : 255;
+		const int begin = (int)((int64_t)count * chunk / chunkCount);
+		const int end = (int)((int64_t)count * (chunk + 1) / chunkCount);
 
-			memset(data + indexOf(x, y, width), newValue, COMPONENT_COUNT);
-		}
+		threads.emplace_back(function, chunk, begin, end);
+	}
+
+	for (std::thread &thread : threads)
+	{
+		thread.join();
+	}
+
+	return chunkCount;
+}
+
+const CpuFeatures &cpuFeatures()
+{
+	static const CpuFeatures features = detectCpuFeatures();
+
+	return features;
+}
+
+int lowestSetBit(const uint32_t mask)
+{
+#if defined(_MSC_VER)
+	unsigned long index;
+
+	_BitScanForward(&index, mask);
+
+	return (int)index;
+#else
+	return __builtin_ctz(mask);
+#endif
+}
+
+int lowestSetBit(const uint64_t mask)
+{
+#if defined(_MSC_VER)
+	unsigned long index;
+
+	if (_BitScanForward(&index, (unsigned long)mask))
+	{
+		return (int)index;
 	}
+
+	_BitScanForward(&index, (unsigned long)(mask >> 32));
+
+	return (int)index + 32;
+#else
+	return __builtin_ctzll(mask);
+#endif
+}
+
+int indexOf(const int x, const int y, const int width)
+{
+	return y * width * COMPONENT_COUNT + x * COMPONENT_COUNT;
+}
+
+bool isGrayPixel(const unsigned char *pixel)
+{
+	return (pixel[R] == pixel[G]) && (pixel[G] == pixel[B]);
 }
 
-int meanFilter(unsigned char **data, const int width, const int height, const int windowSize)
+// Comparing the buffer against itself shifted by one byte yields R==G and G==B in the
+// first two bytes of every pixel, the third byte compares B to the next pixel's R and is ignored.
+uint32_t grayscaleCompareMask(const int byteOffset, const int byteCount)
 {
-	if (!(windowSize % 2))
+	uint32_t mask = 0;
+
+	for (int i = 0; i < byteCount; ++i)
 	{
-		return -1;
+		if (((byteOffset + i) % COMPONENT_COUNT) != B)
+		{
+			mask |= 1u << i;
+		}
 	}
 
-	const int dataSize = height * width * COMPONENT_COUNT;
+	return mask;
+}
 
-	unsigned char *result = new unsigned char[dataSize];
+// Returns the number of leading pixels verified to be gray, or -1 when a colored pixel was found.
+IMGF_TARGET_AVX2
+int64_t scanGrayPixelsAvx2(const unsigned char *data, const int64_t byteCount)
+{
+	const uint32_t masks[3] = { grayscaleCompareMask(0, 32), grayscaleCompareMask(32, 32), grayscaleCompareMask(64, 32) };
 
-	const int borderSize = windowSize / 2;
+	int64_t i = 0;
+
+	// strictly less, the shifted load reads one byte past the block
+	for (; i + 96 < byteCount; i += 96)
+	{
+		for (int block = 0; block < 3; ++block)
+		{
+			const unsigned char *position = data + i + block * 32;
+
+			const __m256i equal = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)position),
+				_mm256_loadu_si256((const __m256i *)(position + 1)));
 
-	memcpy_s(result, dataSize, *data, dataSize);
+			if (((uint32_t)_mm256_movemask_epi8(equal) & masks[block]) != masks[block])
+			{
+				return -1;
+			}
+		}
+	}
+
+	return i / COMPONENT_COUNT;
+}
+
+int64_t scanGrayPixelsSse2(const unsigned char *data, const int64_t byteCount)
+{
+	const uint32_t masks[3] = { grayscaleCompareMask(0, 16), grayscaleCompareMask(16, 16), grayscaleCompareMask(32, 16) };
 
-	for (int y = borderSize; y < (height - borderSize); ++y)
+	int64_t i = 0;
+
+	for (; i + 48 < byteCount; i += 48)
 	{
-		for (int x = borderSize; x < (width - borderSize); ++x)
+		for (int block = 0; block < 3; ++block)
 		{
-			int sum = 0;
+			const unsigned char *position = data + i + block * 16;
+
+			const __m128i equal = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)position),
+				_mm_loadu_si128((const __m128i *)(position + 1)));
 
-			for (int windowY = -borderSize; windowY <= borderSize; ++windowY)
+			if (((uint32_t)_mm_movemask_epi8(equal) & masks[block]) != masks[block])
 			{
-				for (int windowX = -borderSize; windowX <= borderSize; ++windowX)
-				{
-					sum += (*data)[indexOf(x + windowX, y + windowY, width)];
-				}
+				return -1;
 			}
+		}
+	}
+
+	return i / COMPONENT_COUNT;
+}
 
-			const int newValue = sum / (windowSize * windowSize);
-			const int centerPosition = indexOf(x, y, width);
+// Checks R == G == B over the whole image and stops at the first colored pixel.
+bool isGrayscale(const unsigned char *data, const int width, const int height)
+{
+	const int64_t pixelCount = (int64_t)width * height;
+
+	const int64_t verified = cpuFeatures().avx2
+		? scanGrayPixelsAvx2(data, pixelCount * COMPONENT_COUNT)
+		: scanGrayPixelsSse2(data, pixelCount * COMPONENT_COUNT);
+
+	if (verified < 0)
+	{
+		return false;
+	}
 
-			memset(result + centerPosition, newValue, COMPONENT_COUNT);
+	for (int64_t i = verified; i < pixelCount; ++i)
+	{
+		if (!isGrayPixel(data + i * COMPONENT_COUNT))
+		{
+			return false;
 		}
 	}
 
-	delete *data;
+	return true;
+}
+
+unsigned char grayValueOf(const unsigned char *pixel)
+{
+	return (R_FIXED_WEIGHT * pixel[R]
+		+ G_FIXED_WEIGHT * pixel[G]
+		+ B_FIXED_WEIGHT * pixel[B]
+		+ GRAYSCALE_FIXED_ROUNDING) >> GRAYSCALE_FIXED_SHIFT;
+}
 
-	*data = result;
+// Splits 16 packed RGB pixels (48 bytes) into one register per component.
+IMGF_TARGET_SSSE3
+void deinterleaveRgb(const unsigned char *pixels, __m128i *r, __m128i *g, __m128i *b)
+{
+	const __m128i first = _mm_loadu_si128((const __m128i *)pixels);
+	const __m128i second = _mm_loadu_si128((const __m128i *)(pixels + 16));
+	const __m128i third = _mm_loadu_si128((const __m128i *)(pixels + 32));
+
+	*r = _mm_or_si128(_mm_or_si128(
+		_mm_shuffle_epi8(first, _mm_setr_epi8(0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1)),
+		_mm_shuffle_epi8(second, _mm_setr_epi8(-1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14, -1, -1, -1, -1, -1))),
+		_mm_shuffle_epi8(third, _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 1, 4, 7, 10, 13)));
+
+	*g = _mm_or_si128(_mm_or_si128(
+		_mm_shuffle_epi8(first, _mm_setr_epi8(1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1)),
+		_mm_shuffle_epi8(second, _mm_setr_epi8(-1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1))),
+		_mm_shuffle_epi8(third, _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14)));
+
+	*b = _mm_or_si128(_mm_or_si128(
+		_mm_shuffle_epi8(first, _mm_setr_epi8(2, 5, 8, 11, 14, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1)),
+		_mm_shuffle_epi8(second, _mm_setr_epi8(-1, -1, -1, -1, -1, 1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1))),
+		_mm_shuffle_epi8(third, _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15)));
+}
 
-	return 0;
+// Merges one register per component into 16 packed RGB pixels (48 bytes), see deinterleaveRgb().
+IMGF_TARGET_SSSE3
+void interleaveRgb(unsigned char *pixels, const __m128i r, const __m128i g, const __m128i b)
+{
+	_mm_storeu_si128((__m128i *)pixels, _mm_or_si128(_mm_or_si128(
+		_mm_shuffle_epi8(r, _mm_setr_epi8(0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1, -1, 5)),
+		_mm_shuffle_epi8(g, _mm_setr_epi8(-1, 0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1, -1))),
+		_mm_shuffle_epi8(b, _mm_setr_epi8(-1, -1, 0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1))));
+
+	_mm_storeu_si128((__m128i *)(pixels + 16), _mm_or_si128(_mm_or_si128(
+		_mm_shuffle_epi8(r, _mm_setr_epi8(-1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1, 10, -1)),
+		_mm_shuffle_epi8(g, _mm_setr_epi8(5, -1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1, 10))),
+		_mm_shuffle_epi8(b, _mm_setr_epi8(-1, 5, -1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1))));
+
+	_mm_storeu_si128((__m128i *)(pixels + 32), _mm_or_si128(_mm_or_si128(
+		_mm_shuffle_epi8(r, _mm_setr_epi8(-1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15, -1, -1)),
+		_mm_shuffle_epi8(g, _mm_setr_epi8(-1, -1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15, -1))),
+		_mm_shuffle_epi8(b, _mm_setr_epi8(10, -1, -1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15))));
 }
 
-int medianFilter(unsigned char **data, const int width, const int height, const int windowSize)
+// Writes every byte of value three times, producing 16 gray RGB pixels (48 bytes).
+IMGF_TARGET_SSSE3
+void storeTriplicated(unsigned char *pixels, const __m128i value)
 {
-	if (!(windowSize % 2))
+	_mm_storeu_si128((__m128i *)pixels,
+		_mm_shuffle_epi8(value, _mm_setr_epi8(0, 0, 0, 1, 1, 1, 2, 2, 2, 3, 3, 3, 4, 4, 4, 5)));
+	_mm_storeu_si128((__m128i *)(pixels + 16),
+		_mm_shuffle_epi8(value, _mm_setr_epi8(5, 5, 6, 6, 6, 7, 7, 7, 8, 8, 8, 9, 9, 9, 10, 10)));
+	_mm_storeu_si128((__m128i *)(pixels + 32),
+		_mm_shuffle_epi8(value, _mm_setr_epi8(10, 11, 11, 11, 12, 12, 12, 13, 13, 13, 14, 14, 14, 15, 15, 15)));
+}
+
+IMGF_TARGET_SSSE3
+__m128i weightedGray(const __m128i r, const __m128i g, const __m128i b)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i rWeight = _mm_set1_epi16(R_FIXED_WEIGHT);
+	const __m128i gWeight = _mm_set1_epi16(G_FIXED_WEIGHT);
+	const __m128i bWeight = _mm_set1_epi16(B_FIXED_WEIGHT);
+	const __m128i rounding = _mm_set1_epi16(GRAYSCALE_FIXED_ROUNDING);
+
+	// 255 * 256 + 128 still fits into an unsigned 16 bit lane
+	__m128i low = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(r, zero), rWeight), rounding);
+	low = _mm_add_epi16(low, _mm_mullo_epi16(_mm_unpacklo_epi8(g, zero), gWeight));
+	low = _mm_add_epi16(low, _mm_mullo_epi16(_mm_unpacklo_epi8(b, zero), bWeight));
+
+	__m128i high = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(r, zero), rWeight), rounding);
+	high = _mm_add_epi16(high, _mm_mullo_epi16(_mm_unpackhi_epi8(g, zero), gWeight));
+	high = _mm_add_epi16(high, _mm_mullo_epi16(_mm_unpackhi_epi8(b, zero), bWeight));
+
+	return _mm_packus_epi16(_mm_srli_epi16(low, GRAYSCALE_FIXED_SHIFT), _mm_srli_epi16(high, GRAYSCALE_FIXED_SHIFT));
+}
+
+IMGF_TARGET_SSSE3
+int convertPixelsToGrayscaleSsse3(const unsigned char *rgb, unsigned char *gray, const int count, const bool triplicate)
+{
+	int i = 0;
+
+	for (; i + 16 <= count; i += 16)
 	{
-		return -1;
-	}
+		__m128i r, g, b;
 
-	std::vector<int> window(windowSize * windowSize);
+		deinterleaveRgb(rgb + i * COMPONENT_COUNT, &r, &g, &b);
 
-	const int dataSize = height * width * COMPONENT_COUNT;
+		const __m128i value = weightedGray(r, g, b);
 
-	unsigned char *result = new unsigned char[dataSize];
+		if (triplicate)
+		{
+			storeTriplicated(gray + i * COMPONENT_COUNT, value);
+		}
+		else
+		{
+			_mm_storeu_si128((__m128i *)(gray + i), value);
+		}
+	}
 
-	const int borderSize = windowSize / 2;
+	return i;
+}
 
-	memcpy_s(result, dataSize, *data, dataSize);
+IMGF_TARGET_AVX2
+int convertPixelsToGrayscaleAvx2(const unsigned char *rgb, unsigned char *gray, const int count, const bool triplicate)
+{
+	const __m256i rWeight = _mm256_set1_epi16(R_FIXED_WEIGHT);
+	const __m256i gWeight = _mm256_set1_epi16(G_FIXED_WEIGHT);
+	const __m256i bWeight = _mm256_set1_epi16(B_FIXED_WEIGHT);
+	const __m256i rounding = _mm256_set1_epi16(GRAYSCALE_FIXED_ROUNDING);
+
+	int i = 0;
 
-	for (int y = borderSize; y < (height - borderSize); ++y)
+	for (; i + 32 <= count; i += 32)
 	{
-		for (int x = borderSize; x < (width - borderSize); ++x)
+		__m128i r[2], g[2], b[2];
+
+		// pshufb does not cross 128 bit lanes, so the 96 input bytes are split in two halves
+		deinterleaveRgb(rgb + i * COMPONENT_COUNT, &r[0], &g[0], &b[0]);
+		deinterleaveRgb(rgb + (i + 16) * COMPONENT_COUNT, &r[1], &g[1], &b[1]);
+
+		__m256i sum[2];
+
+		for (int half = 0; half < 2; ++half)
 		{
-			int windowIndex = 0;
+			sum[half] = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_cvtepu8_epi16(r[half]), rWeight), rounding);
+			sum[half] = _mm256_add_epi16(sum[half], _mm256_mullo_epi16(_mm256_cvtepu8_epi16(g[half]), gWeight));
+			sum[half] = _mm256_add_epi16(sum[half], _mm256_mullo_epi16(_mm256_cvtepu8_epi16(b[half]), bWeight));
+			sum[half] = _mm256_srli_epi16(sum[half], GRAYSCALE_FIXED_SHIFT);
+		}
 
-			for (int windowY = -borderSize; windowY <= borderSize; ++windowY)
-			{
-				for (int windowX = -borderSize; windowX <= borderSize; ++windowX)
-				{
-					window[windowIndex++] = (*data)[indexOf(x + windowX, y + windowY, width)];
-				}
-			}
+		// packus works per lane, the permute restores pixel order
+		const __m256i value = _mm256_permute4x64_epi64(_mm256_packus_epi16(sum[0], sum[1]), 0xD8);
+
+		if (triplicate)
+		{
+			storeTriplicated(gray + i * COMPONENT_COUNT, _mm256_castsi256_si128(value));
+			storeTriplicated(gray + (i + 16) * COMPONENT_COUNT, _mm256_extracti128_si256(value, 1));
+		}
+		else
+		{
+			_mm256_storeu_si256((__m256i *)(gray + i), value);
+		}
+	}
 
-			const int centerIndex = (window.size() / 2) + 1;
+	return i;
+}
+
+// Converts count packed RGB pixels. The output is either one byte per pixel (planar)
+// or the gray value repeated for all three components (triplicated), which may alias the input.
+void convertPixelsToGrayscale(const unsigned char *rgb, unsigned char *gray, const int count, const bool triplicate)
+{
+	int i = 0;
 
-			std::nth_element(window.begin(), window.begin() + centerIndex, window.end());
+	if (cpuFeatures().avx2)
+	{
+		i = convertPixelsToGrayscaleAvx2(rgb, gray, count, triplicate);
+	}
+	else if (cpuFeatures().ssse3)
+	{
+		i = convertPixelsToGrayscaleSsse3(rgb, gray, count, triplicate);
+	}
 
-			const int newValue = window[centerIndex];
-			const int centerPosition = indexOf(x, y, width);
+	for (; i < count; ++i)
+	{
+		const unsigned char value = grayValueOf(rgb + i * COMPONENT_COUNT);
 
-			memset(result + centerPosition, newValue, COMPONENT_COUNT);
+		if (triplicate)
+		{
+			memset(gray + i * COMPONENT_COUNT, value, COMPONENT_COUNT);
+		}
+		else
+		{
+			gray[i] = value;
 		}
 	}
+}
 
-	delete *data;
+IMGF_TARGET_SSSE3
+int triplicatePixelsSsse3(const unsigned char *gray, unsigned char *rgb, const int count)
+{
+	int i = 0;
 
-	*data = result;
+	for (; i + 16 <= count; i += 16)
+	{
+		storeTriplicated(rgb + i * COMPONENT_COUNT, _mm_loadu_si128((const __m128i *)(gray + i)));
+	}
 
-	return 0;
+	return i;
 }
 
-int additiveBinaryNoise(unsigned char *data, const int width, const int height, const int percentage)
+// Writes count planar gray values as gray RGB pixels.
+void triplicatePixels(const unsigned char *gray, unsigned char *rgb, const int count)
 {
-	std::random_device randomDevice;
-	std::mt19937 generator(randomDevice());
-	std::uniform_int_distribution<> distribution(0, 99);
+	int i = cpuFeatures().ssse3 ? triplicatePixelsSsse3(gray, rgb, count) : 0;
 
-	int changedCount = 0;
+	for (; i < count; ++i)
+	{
+		memset(rgb + i * COMPONENT_COUNT, gray[i], COMPONENT_COUNT);
+	}
+}
 
-	for (int y = 0; y < height; ++y)
+IMGF_TARGET_SSSE3
+int splitChannelsSsse3(const unsigned char *rgb, unsigned char *r, unsigned char *g, unsigned char *b, const int count)
+{
+	int i = 0;
+
+	for (; i + 16 <= count; i += 16)
 	{
-		for (int x = 0; x < width; ++x)
-		{
-			if (distribution(generator) < percentage)
-			{
-				const int newValue = (data[indexOf(x, y, width) + R] == MIN_RGB_VALUE) ? MAX_RGB_VALUE : MIN_RGB_VALUE;
+		__m128i red, green, blue;
 
-				memset(data + indexOf(x, y, width), newValue, COMPONENT_COUNT);
+		deinterleaveRgb(rgb + i * COMPONENT_COUNT, &red, &green, &blue);
 
-				changedCount++;
-			}
-		}
+		_mm_storeu_si128((__m128i *)(r + i), red);
+		_mm_storeu_si128((__m128i *)(g + i), green);
+		_mm_storeu_si128((__m128i *)(b + i), blue);
 	}
 
-	printf("Actual noise is %f%%.\n", 100.f * ((float)changedCount) / ((float)(width * height)));
+	return i;
+}
 
-	return 0;
+// Copies the components of count packed RGB pixels into three channel planes.
+void splitChannels(const unsigned char *rgb, unsigned char *r, unsigned char *g, unsigned char *b, const int count)
+{
+	int i = cpuFeatures().ssse3 ? splitChannelsSsse3(rgb, r, g, b, count) : 0;
+
+	for (; i < count; ++i)
+	{
+		r[i] = rgb[i * COMPONENT_COUNT + R];
+		g[i] = rgb[i * COMPONENT_COUNT + G];
+		b[i] = rgb[i * COMPONENT_COUNT + B];
+	}
 }
 
-int makeHistogram(unsigned char *data, const int width, const int height, uint64_t **histogram)
+IMGF_TARGET_SSSE3
+int mergeChannelsSsse3(const unsigned char *r, const unsigned char *g, const unsigned char *b, unsigned char *rgb, const int count)
 {
-	uint64_t *result = new uint64_t[BUCKET_COUNT];
+	int i = 0;
+
+	for (; i + 16 <= count; i += 16)
+	{
+		interleaveRgb(rgb + i * COMPONENT_COUNT, _mm_loadu_si128((const __m128i *)(r + i)),
+			_mm_loadu_si128((const __m128i *)(g + i)), _mm_loadu_si128((const __m128i *)(b + i)));
+	}
 
-	memset(result, 0, BUCKET_COUNT * sizeof(uint64_t));
+	return i;
+}
 
-	for (int y = 0; y < height; ++y)
+// Inverse of splitChannels().
+void mergeChannels(const unsigned char *r, const unsigned char *g, const unsigned char *b, unsigned char *rgb, const int count)
+{
+	int i = cpuFeatures().ssse3 ? mergeChannelsSsse3(r, g, b, rgb, count) : 0;
+
+	for (; i < count; ++i)
 	{
-		for (int x = 0; x < width; ++x)
-		{
-			result[data[indexOf(x, y, width)]] += 1;
-		}
+		rgb[i * COMPONENT_COUNT + R] = r[i];
+		rgb[i * COMPONENT_COUNT + G] = g[i];
+		rgb[i * COMPONENT_COUNT + B] = b[i];
 	}
+}
 
-	*histogram = result;
+void convertToGrayscale(unsigned char *data, const int width, const int height)
+{
+	convertPixelsToGrayscale(data, data, width * height, true);
+}
 
-	return 0;
+void convertToGrayscalePlanar(const unsigned char *data, unsigned char *gray, const int width, const int height)
+{
+	convertPixelsToGrayscale(data, gray, width * height, false);
 }
 
-int histogramEqualization(unsigned char *data, const int width, const int height)
+constexpr size_t BUFFER_ALIGNMENT = 64;
+constexpr size_t BUFFER_MIN_CLASS_SIZE = 4096;
+constexpr int BUFFER_CLASS_STEPS = 4;
+constexpr int BUFFER_POOL_MAX_FREE_PER_CLASS = 4;
+
+// Stored right before every pooled buffer, inside the alignment padding.
+struct BufferHeader
+{
+	unsigned char *allocation;
+	int sizeClass;
+};
+
+// Reuses large image buffers across filter stages and pages. Sizes are rounded up to a size
+// class, BUFFER_CLASS_STEPS classes per doubling, so an image size that comes back finds its
+// buffer again while no more than a fifth of a buffer is wasted. Buffers are aligned to
+// BUFFER_ALIGNMENT for the vector loops and must be given back with release().
+struct BufferPool
 {
-	uint64_t *histogram = nullptr;
+	std::mutex mutex;
+	std::vector<std::vector<unsigned char *>> freeBuffers;
+
+	~BufferPool()
+	{
+		for (const std::vector<unsigned char *> &buffers : freeBuffers)
+		{
+			for (unsigned char *buffer : buffers)
+			{
+				delete[] headerOf(buffer).allocation;
+			}
+		}
+	}
+
+	static BufferHeader headerOf(const unsigned char *buffer)
+	{
+		BufferHeader header;
 
-	makeHistogram(data, width, height, &histogram);
+		memcpy(&header, buffer - sizeof(BufferHeader), sizeof(BufferHeader));
 
-	float *cumulativeHistogram = new float[BUCKET_COUNT];
+		return header;
+	}
 
-	for (int i = 0; i < BUCKET_COUNT; ++i)
+	static size_t classSize(const int sizeClass)
+	{
+		return (BUFFER_MIN_CLASS_SIZE * (BUFFER_CLASS_STEPS + sizeClass % BUFFER_CLASS_STEPS) / BUFFER_CLASS_STEPS) << (sizeClass / BUFFER_CLASS_STEPS);
+	}
+
+	static int sizeClassOf(const size_t size)
 	{
-		cumulativeHistogram[i] = (float)histogram[i] / (float)(width * height);
+		int sizeClass = 0;
 
-		if (i > 0)
+		while (classSize(sizeClass) < size)
 		{
-			cumulativeHistogram[i] += cumulativeHistogram[i - 1];
+			++sizeClass;
 		}
+
+		return sizeClass;
 	}
 
-	for (int y = 0; y < height; ++y)
+	unsigned char *acquire(const size_t size)
 	{
-		for (int x = 0; x < width; ++x)
+		const int sizeClass = sizeClassOf(size);
+
 		{
-			const int newValue = std::floor((float)(BUCKET_COUNT - 1) * cumulativeHistogram[data[indexOf(x, y, width)]]);
+			std::lock_guard<std::mutex> lock(mutex);
+
+			if ((sizeClass < (int)freeBuffers.size()) && !freeBuffers[sizeClass].empty())
+			{
+				unsigned char *buffer = freeBuffers[sizeClass].back();
 
-			memset(data + indexOf(x, y, width), newValue, COMPONENT_COUNT);
+				freeBuffers[sizeClass].pop_back();
+
+				return buffer;
+			}
 		}
-	}
 
-	delete cumulativeHistogram;
+		unsigned char *allocation = new unsigned char[classSize(sizeClass) + sizeof(BufferHeader) + BUFFER_ALIGNMENT];
 
-	delete histogram;
+		const uintptr_t unaligned = (uintptr_t)(allocation + sizeof(BufferHeader));
+		unsigned char *buffer = allocation + sizeof(BufferHeader) + (BUFFER_ALIGNMENT - unaligned % BUFFER_ALIGNMENT) % BUFFER_ALIGNMENT;
 
-	return 0;
+		const BufferHeader header = { allocation, sizeClass };
 
+		memcpy(buffer - sizeof(BufferHeader), &header, sizeof(BufferHeader));
+
+		return buffer;
+	}
+
+	void release(unsigned char *buffer)
+	{
+		if (buffer == nullptr)
+		{
+			return;
+		}
+
+		const BufferHeader header = headerOf(buffer);
+
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+
+			if ((int)freeBuffers.size() <= header.sizeClass)
+			{
+				freeBuffers.resize(header.sizeClass + 1);
+			}
+
+			if ((int)freeBuffers[header.sizeClass].size() < BUFFER_POOL_MAX_FREE_PER_CLASS)
+			{
+				freeBuffers[header.sizeClass].push_back(buffer);
+
+				return;
+			}
+		}
+
+		delete[] header.allocation;
+	}
+
+	static BufferPool &shared()
+	{
+		static BufferPool pool;
+
+		return pool;
+	}
+};
+
+// Image buffers for the functions that replace the caller's image, like meanFilter().
+unsigned char *acquireImageBuffer(const int width, const int height)
+{
+	return BufferPool::shared().acquire((size_t)width * height * COMPONENT_COUNT);
+}
+
+void releaseImageBuffer(unsigned char *data)
+{
+	BufferPool::shared().release(data);
+}
+
+constexpr int FILTER_MIN_ROWS_PER_THREAD = 16;
+
+// Maps a coordinate outside [0, size) back into it, or returns -1 for the constant border.
+int borderIndex(const int index, const int size, const BorderMode mode)
+{
+	if ((index >= 0) && (index < size))
+	{
+		return index;
+	}
+
+	if (mode == BORDER_CONSTANT)
+	{
+		return -1;
+	}
+	else if (mode == BORDER_WRAP)
+	{
+		return ((index % size) + size) % size;
+	}
+	else if ((mode == BORDER_REFLECT) && (size > 1))
+	{
+		// mirrored at the edge pixels, which are not repeated: cba|abc|cba reads as cb|abc|ba
+		const int period = 2 * (size - 1);
+		const int folded = ((index % period) + period) % period;
+
+		return folded < size ? folded : period - folded;
+	}
+
+	return std::min(std::max(index, 0), size - 1);
+}
+
+// Layout of the buffers imgf works on: gray bytes repeated in R, G and B, planar 16 bit gray
+// samples, or planar floats on the 8 bit scale. Sum holds a window of pixels. BORDER_VALUE
+// fills BORDER_CONSTANT, it is paper white, so it does not darken the edges of a page.
+template <typename Pixel>
+struct PixelTraits;
+
+template <>
+struct PixelTraits<unsigned char>
+{
+	static const int STRIDE = COMPONENT_COUNT;
+	static const int BORDER_VALUE = MAX_RGB_VALUE;
+	typedef int Sum;
+};
+
+template <>
+struct PixelTraits<uint16_t>
+{
+	static const int STRIDE = 1;
+	static const int BORDER_VALUE = UINT16_MAX;
+	typedef int64_t Sum;
+};
+
+template <>
+struct PixelTraits<float>
+{
+	static const int STRIDE = 1;
+	static const int BORDER_VALUE = MAX_RGB_VALUE;
+	typedef double Sum;
+};
+
+// Copies the gray values of inputRow into padded[borderSize, borderSize + width) and fills the
+// borderSize pixels on both sides by the border mode. A null inputRow is a constant row.
+// Stride is the distance of two pixels in inputRow, 1 for a single channel plane.
+template <typename Pixel, int Stride = PixelTraits<Pixel>::STRIDE>
+void padRow(const Pixel *inputRow, const int width, const int borderSize, const BorderMode mode, Pixel *padded)
+{
+	const Pixel constant = (Pixel)PixelTraits<Pixel>::BORDER_VALUE;
+
+	if (inputRow == nullptr)
+	{
+		std::fill(padded, padded + width + 2 * borderSize, constant);
+
+		return;
+	}
+
+	for (int x = 0; x < width; ++x)
+	{
+		padded[borderSize + x] = inputRow[x * Stride];
+	}
+
+	for (int x = 1; x <= borderSize; ++x)
+	{
+		const int left = borderIndex(-x, width, mode);
+		const int right = borderIndex(width - 1 + x, width, mode);
+
+		padded[borderSize - x] = left < 0 ? constant : padded[borderSize + left];
+		padded[borderSize + width - 1 + x] = right < 0 ? constant : padded[borderSize + right];
+	}
+}
+
+// The windowSize padded rows around the current one, each built once as the window moves down,
+// so the filter loops read the whole neighbourhood of every pixel without bounds checks.
+template <typename Pixel, int Stride = PixelTraits<Pixel>::STRIDE>
+struct PaddedWindow
+{
+	const Pixel *input;
+	int inputFirstRow, width, height, windowSize, borderSize, paddedWidth;
+	BorderMode mode;
+	std::vector<Pixel> rows;
+
+	PaddedWindow(const Pixel *input, const int inputFirstRow, const int width, const int height, const int windowSize, const BorderMode mode)
+		: input(input), inputFirstRow(inputFirstRow), width(width), height(height), windowSize(windowSize),
+		borderSize(windowSize / 2), paddedWidth(width + 2 * (windowSize / 2)), mode(mode), rows((size_t)windowSize * (width + 2 * (windowSize / 2)))
+	{
+	}
+
+	// rows of the window are kept in a ring, image row y lives in slot y mod windowSize
+	Pixel *row(const int y)
+	{
+		return rows.data() + (size_t)(((y % windowSize) + windowSize) % windowSize) * paddedWidth;
+	}
+
+	void load(const int y)
+	{
+		const int source = borderIndex(y, height, mode == BORDER_NONE ? BORDER_REPLICATE : mode);
+
+		padRow<Pixel, Stride>(source < 0 ? nullptr : input + (size_t)(source - inputFirstRow) * width * Stride, width, borderSize, mode == BORDER_NONE ? BORDER_REPLICATE : mode, row(y));
+	}
+};
+
+// BORDER_NONE keeps the input value of the pixels closer than windowSize / 2 to the border.
+template <typename Pixel, int Stride = PixelTraits<Pixel>::STRIDE>
+void restoreUnfilteredBorder(const Pixel *inputRow, Pixel *outputRow, const int width, const int height, const int windowSize, const int y)
+{
+	const int borderSize = windowSize / 2;
+
+	if ((y < borderSize) || (y >= (height - borderSize)) || (width <= 2 * borderSize))
+	{
+		memcpy(outputRow, inputRow, width * Stride * sizeof(Pixel));
+
+		return;
+	}
+
+	memcpy(outputRow, inputRow, borderSize * Stride * sizeof(Pixel));
+	memcpy(outputRow + (width - borderSize) * Stride, inputRow + (width - borderSize) * Stride, borderSize * Stride * sizeof(Pixel));
+}
+
+// Filters the rows [firstRow, lastRow) into output, which points to row firstRow. input points
+// to row inputFirstRow and has to hold every row the windows reach, so the rows can come from
+// the whole image or from a strip buffer; with BORDER_WRAP the rows at the opposite edge are
+// reached as well. Sums are kept per column of the window and updated by one row per step,
+// the window then slides along the row adding one column sum and dropping another. Bytes are
+// written to all three components; with Stride 1 the rows are a single channel plane.
+template <typename Pixel, int Stride = PixelTraits<Pixel>::STRIDE>
+void meanFilterRows(const Pixel *input, const int inputFirstRow, Pixel *output, const int width, const int height, const int windowSize, const int firstRow, const int lastRow, const BorderMode borderMode)
+{
+	const int borderSize = windowSize / 2;
+	const int area = windowSize * windowSize;
+
+	PaddedWindow<Pixel, Stride> window(input, inputFirstRow, width, height, windowSize, borderMode);
+
+	typedef typename PixelTraits<Pixel>::Sum Sum;
+
+	// one zero column past the padding lets the last slide step run like all the others
+	std::vector<Sum> columnSums(window.paddedWidth + 1, 0);
+
+	for (int windowY = -borderSize; windowY <= borderSize; ++windowY)
+	{
+		window.load(firstRow + windowY);
+
+		const Pixel *padded = window.row(firstRow + windowY);
+
+		for (int x = 0; x < window.paddedWidth; ++x)
+		{
+			columnSums[x] += padded[x];
+		}
+	}
+
+	for (int y = firstRow; y < lastRow; ++y)
+	{
+		if (y > firstRow)
+		{
+			// the slot of the row leaving the window is the one the entering row goes to
+			const Pixel *leaving = window.row(y - borderSize - 1);
+
+			for (int x = 0; x < window.paddedWidth; ++x)
+			{
+				columnSums[x] -= leaving[x];
+			}
+
+			window.load(y + borderSize);
+
+			const Pixel *entering = window.row(y + borderSize);
+
+			for (int x = 0; x < window.paddedWidth; ++x)
+			{
+				columnSums[x] += entering[x];
+			}
+		}
+
+		Pixel *outputRow = output + (size_t)(y - firstRow) * width * Stride;
+
+		Sum sum = 0;
+
+		for (int x = 0; x < windowSize; ++x)
+		{
+			sum += columnSums[x];
+		}
+
+		for (int x = 0; x < width; ++x)
+		{
+			std::fill(outputRow + x * Stride, outputRow + (x + 1) * Stride, (Pixel)(sum / area));
+
+			sum += columnSums[x + windowSize] - columnSums[x];
+		}
+
+		if (borderMode == BORDER_NONE)
+		{
+			restoreUnfilteredBorder<Pixel, Stride>(input + (size_t)(y - inputFirstRow) * width * Stride, outputRow, width, height, windowSize, y);
+		}
+	}
+}
+
+template <typename Pixel, int Stride = PixelTraits<Pixel>::STRIDE>
+void medianFilterRows(const Pixel *input, const int inputFirstRow, Pixel *output, const int width, const int height, const int windowSize, const int firstRow, const int lastRow, const BorderMode borderMode)
+{
+	const int borderSize = windowSize / 2;
+
+	PaddedWindow<Pixel, Stride> window(input, inputFirstRow, width, height, windowSize, borderMode);
+
+	std::vector<Pixel> values(windowSize * windowSize);
+	std::vector<const Pixel *> rows(windowSize);
+
+	const int centerIndex = std::min((int)(values.size() / 2) + 1, (int)values.size() - 1);
+
+	for (int windowY = -borderSize; windowY < borderSize; ++windowY)
+	{
+		window.load(firstRow + windowY);
+	}
+
+	for (int y = firstRow; y < lastRow; ++y)
+	{
+		window.load(y + borderSize);
+
+		for (int windowY = 0; windowY < windowSize; ++windowY)
+		{
+			rows[windowY] = window.row(y - borderSize + windowY);
+		}
+
+		Pixel *outputRow = output + (size_t)(y - firstRow) * width * Stride;
+
+		for (int x = 0; x < width; ++x)
+		{
+			int valueIndex = 0;
+
+			for (int windowY = 0; windowY < windowSize; ++windowY)
+			{
+				for (int windowX = 0; windowX < windowSize; ++windowX)
+				{
+					values[valueIndex++] = rows[windowY][x + windowX];
+				}
+			}
+
+			std::nth_element(values.begin(), values.begin() + centerIndex, values.end());
+
+			std::fill(outputRow + x * Stride, outputRow + (x + 1) * Stride, values[centerIndex]);
+		}
+
+		if (borderMode == BORDER_NONE)
+		{
+			restoreUnfilteredBorder<Pixel, Stride>(input + (size_t)(y - inputFirstRow) * width * Stride, outputRow, width, height, windowSize, y);
+		}
+	}
+}
+
+// Filters input into output, which must not alias it.
+template <typename Pixel>
+int meanFilterTo(const Pixel *input, Pixel *output, const int width, const int height, const int windowSize, const BorderMode borderMode = BORDER_REPLICATE)
+{
+	if (!(windowSize % 2) || (windowSize < 1) || (input == output))
+	{
+		return -1;
+	}
+
+	parallelFor(height, FILTER_MIN_ROWS_PER_THREAD, [&](const int /*chunk*/, const int firstRow, const int lastRow)
+	{
+		meanFilterRows(input, 0, output + (size_t)firstRow * width * PixelTraits<Pixel>::STRIDE, width, height, windowSize, firstRow, lastRow, borderMode);
+	});
+
+	return 0;
+}
+
+template <typename Pixel>
+int medianFilterTo(const Pixel *input, Pixel *output, const int width, const int height, const int windowSize, const BorderMode borderMode = BORDER_REPLICATE)
+{
+	if (!(windowSize % 2) || (windowSize < 1) || (input == output))
+	{
+		return -1;
+	}
+
+	parallelFor(height, FILTER_MIN_ROWS_PER_THREAD, [&](const int /*chunk*/, const int firstRow, const int lastRow)
+	{
+		medianFilterRows(input, 0, output + (size_t)firstRow * width * PixelTraits<Pixel>::STRIDE, width, height, windowSize, firstRow, lastRow, borderMode);
+	});
+
+	return 0;
+}
+
+// *data has to come from acquireImageBuffer(), it is released and replaced by the filtered image.
+int meanFilter(unsigned char **data, const int width, const int height, const int windowSize, const BorderMode borderMode = BORDER_REPLICATE)
+{
+	if (!(windowSize % 2) || (windowSize < 1))
+	{
+		return -1;
+	}
+
+	unsigned char *result = acquireImageBuffer(width, height);
+
+	meanFilterTo(*data, result, width, height, windowSize, borderMode);
+
+	releaseImageBuffer(*data);
+
+	*data = result;
+
+	return 0;
+}
+
+// *data has to come from acquireImageBuffer(), it is released and replaced by the filtered image.
+int medianFilter(unsigned char **data, const int width, const int height, const int windowSize, const BorderMode borderMode = BORDER_REPLICATE)
+{
+	if (!(windowSize % 2) || (windowSize < 1))
+	{
+		return -1;
+	}
+
+	unsigned char *result = acquireImageBuffer(width, height);
+
+	medianFilterTo(*data, result, width, height, windowSize, borderMode);
+
+	releaseImageBuffer(*data);
+
+	*data = result;
+
+	return 0;
+}
+
+// Filters R, G and B separately, so colour images keep their colour. The image is split into
+// three channel planes once, then every band filters its rows of the planes and merges them
+// back into data, so the work is three gray filters plus two passes over the image.
+int filterColorChannels(unsigned char *data, const int width, const int height, const int windowSize, const bool isMedian, const BorderMode borderMode)
+{
+	if (!(windowSize % 2) || (windowSize < 1))
+	{
+		return -1;
+	}
+
+	const size_t planeSize = (size_t)width * height;
+
+	// an image buffer holds exactly three planes
+	unsigned char *planes = acquireImageBuffer(width, height);
+	unsigned char *filtered = acquireImageBuffer(width, height);
+
+	parallelFor(height, FILTER_MIN_ROWS_PER_THREAD, [&](const int /*chunk*/, const int firstRow, const int lastRow)
+	{
+		const size_t offset = (size_t)firstRow * width;
+
+		splitChannels(data + offset * COMPONENT_COUNT, planes + offset, planes + planeSize + offset, planes + 2 * planeSize + offset, (lastRow - firstRow) * width);
+	});
+
+	parallelFor(height, FILTER_MIN_ROWS_PER_THREAD, [&](const int /*chunk*/, const int firstRow, const int lastRow)
+	{
+		const size_t offset = (size_t)firstRow * width;
+
+		for (int component = 0; component < COMPONENT_COUNT; ++component)
+		{
+			const unsigned char *plane = planes + component * planeSize;
+			unsigned char *output = filtered + component * planeSize + offset;
+
+			if (isMedian)
+			{
+				medianFilterRows<unsigned char, 1>(plane, 0, output, width, height, windowSize, firstRow, lastRow, borderMode);
+			}
+			else
+			{
+				meanFilterRows<unsigned char, 1>(plane, 0, output, width, height, windowSize, firstRow, lastRow, borderMode);
+			}
+		}
+
+		mergeChannels(filtered + offset, filtered + planeSize + offset, filtered + 2 * planeSize + offset, data + offset * COMPONENT_COUNT, (lastRow - firstRow) * width);
+	});
+
+	releaseImageBuffer(filtered);
+	releaseImageBuffer(planes);
+
+	return 0;
+}
+
+int meanFilterColor(unsigned char *data, const int width, const int height, const int windowSize, const BorderMode borderMode = BORDER_REPLICATE)
+{
+	return filterColorChannels(data, width, height, windowSize, false, borderMode);
+}
+
+int medianFilterColor(unsigned char *data, const int width, const int height, const int windowSize, const BorderMode borderMode = BORDER_REPLICATE)
+{
+	return filterColorChannels(data, width, height, windowSize, true, borderMode);
+}
+
+int additiveBinaryNoise(unsigned char *data, const int width, const int height, const int percentage)
+{
+	std::random_device randomDevice;
+	std::mt19937 generator(randomDevice());
+	std::uniform_int_distribution<> distribution(0, 99);
+
+	int changedCount = 0;
+
+	for (int y = 0; y < height; ++y)
+	{
+		for (int x = 0; x < width; ++x)
+		{
+			if (distribution(generator) < percentage)
+			{
+				const int newValue = (data[indexOf(x, y, width) + R] == MIN_RGB_VALUE) ? MAX_RGB_VALUE : MIN_RGB_VALUE;
+
+				memset(data + indexOf(x, y, width), newValue, COMPONENT_COUNT);
+
+				changedCount++;
+			}
+		}
+	}
+
+	printf("Actual noise is %f%%.\n", 100.f * ((float)changedCount) / ((float)(width * height)));
+
+	return 0;
+}
+
+constexpr int HISTOGRAM_LANES = 4;
+constexpr int HISTOGRAM_MIN_ROWS_PER_THREAD = 64;
+
+// Adds every stride-th byte of data to histogram. Consecutive pixels go to different
+// sub-histograms, so runs of the same value (e.g. binarized text) do not serialize on
+// the store-to-load dependency of a single counter.
+void accumulateHistogram(const unsigned char *data, const int64_t pixelCount, const int stride, uint64_t *histogram)
+{
+	uint32_t lanes[HISTOGRAM_LANES][BUCKET_COUNT];
+
+	memset(lanes, 0, sizeof(lanes));
+
+	int64_t i = 0;
+
+	// a 32 bit lane counter cannot overflow before it is flushed
+	while (i < pixelCount)
+	{
+		const int64_t batchEnd = std::min(pixelCount, i + ((int64_t)UINT32_MAX / HISTOGRAM_LANES) * HISTOGRAM_LANES);
+
+		for (; i + HISTOGRAM_LANES <= batchEnd; i += HISTOGRAM_LANES)
+		{
+			const unsigned char *pixel = data + i * stride;
+
+			lanes[0][pixel[0]] += 1;
+			lanes[1][pixel[stride]] += 1;
+			lanes[2][pixel[2 * stride]] += 1;
+			lanes[3][pixel[3 * stride]] += 1;
+		}
+
+		for (; i < batchEnd; ++i)
+		{
+			lanes[0][data[i * stride]] += 1;
+		}
+
+		for (int bucket = 0; bucket < BUCKET_COUNT; ++bucket)
+		{
+			histogram[bucket] += (uint64_t)lanes[0][bucket] + lanes[1][bucket] + lanes[2][bucket] + lanes[3][bucket];
+		}
+
+		memset(lanes, 0, sizeof(lanes));
+	}
+}
+
+// Row bands are counted into private histograms on separate threads, then summed in band order.
+void computeHistogram(const unsigned char *data, const int width, const int height, const int stride, uint64_t *histogram)
+{
+	const int chunkCount = chunkCountFor(height, HISTOGRAM_MIN_ROWS_PER_THREAD);
+
+	std::vector<uint64_t> partials((size_t)chunkCount * BUCKET_COUNT, 0);
+
+	parallelFor(height, HISTOGRAM_MIN_ROWS_PER_THREAD, [&](const int chunk, const int firstRow, const int lastRow)
+	{
+		accumulateHistogram(data + (int64_t)firstRow * width * stride, (int64_t)(lastRow - firstRow) * width, stride,
+			partials.data() + (size_t)chunk * BUCKET_COUNT);
+	});
+
+	memset(histogram, 0, BUCKET_COUNT * sizeof(uint64_t));
+
+	for (int chunk = 0; chunk < chunkCount; ++chunk)
+	{
+		for (int bucket = 0; bucket < BUCKET_COUNT; ++bucket)
+		{
+			histogram[bucket] += partials[(size_t)chunk * BUCKET_COUNT + bucket];
+		}
+	}
+}
+
+constexpr int WIDE_BUCKET_COUNT = 65536;
+
+// Adds every stride-th sample of data to a histogram of WIDE_BUCKET_COUNT buckets. Samples are
+// counted into 32 bit counters, which keeps the table at 256 KB, so it stays in L2 where the
+// 64 bit histogram would not; the counters are flushed before they could overflow.
+void accumulateHistogram(const uint16_t *data, const int64_t pixelCount, const int stride, uint64_t *histogram)
+{
+	std::vector<uint32_t> counts(WIDE_BUCKET_COUNT, 0);
+
+	int64_t i = 0;
+
+	while (i < pixelCount)
+	{
+		const int64_t batchEnd = std::min(pixelCount, i + (int64_t)UINT32_MAX);
+
+		for (; i < batchEnd; ++i)
+		{
+			++counts[data[i * stride]];
+		}
+
+		for (int bucket = 0; bucket < WIDE_BUCKET_COUNT; ++bucket)
+		{
+			histogram[bucket] += counts[bucket];
+		}
+
+		std::fill(counts.begin(), counts.end(), 0);
+	}
+}
+
+// 16 bit variant of computeHistogram(), histogram has WIDE_BUCKET_COUNT buckets.
+void computeHistogram(const uint16_t *data, const int width, const int height, const int stride, uint64_t *histogram)
+{
+	const int chunkCount = chunkCountFor(height, HISTOGRAM_MIN_ROWS_PER_THREAD);
+
+	std::vector<uint64_t> partials((size_t)chunkCount * WIDE_BUCKET_COUNT, 0);
+
+	parallelFor(height, HISTOGRAM_MIN_ROWS_PER_THREAD, [&](const int chunk, const int firstRow, const int lastRow)
+	{
+		accumulateHistogram(data + (int64_t)firstRow * width * stride, (int64_t)(lastRow - firstRow) * width, stride,
+			partials.data() + (size_t)chunk * WIDE_BUCKET_COUNT);
+	});
+
+	memset(histogram, 0, WIDE_BUCKET_COUNT * sizeof(uint64_t));
+
+	for (int chunk = 0; chunk < chunkCount; ++chunk)
+	{
+		for (int bucket = 0; bucket < WIDE_BUCKET_COUNT; ++bucket)
+		{
+			histogram[bucket] += partials[(size_t)chunk * WIDE_BUCKET_COUNT + bucket];
+		}
+	}
+}
+
+int makeHistogram(unsigned char *data, const int width, const int height, uint64_t **histogram)
+{
+	uint64_t *result = new uint64_t[BUCKET_COUNT];
+
+	computeHistogram(data, width, height, COMPONENT_COUNT, result);
+
+	*histogram = result;
+
+	return 0;
+}
+
+constexpr int REMAP_MIN_ROWS_PER_THREAD = 64;
+
+// A 256 entry table as 16 pshufb tables of 16 entries, indexed by the high nibble.
+IMGF_TARGET_SSSE3
+__m128i lookupSsse3(const __m128i *tables, const __m128i indices)
+{
+	const __m128i nibbleMask = _mm_set1_epi8(0x0F);
+	const __m128i low = _mm_and_si128(indices, nibbleMask);
+	const __m128i high = _mm_and_si128(_mm_srli_epi16(indices, 4), nibbleMask);
+
+	__m128i result = _mm_setzero_si128();
+
+	for (int table = 0; table < 16; ++table)
+	{
+		const __m128i selected = _mm_cmpeq_epi8(high, _mm_set1_epi8((char)table));
+
+		result = _mm_or_si128(result, _mm_and_si128(_mm_shuffle_epi8(tables[table], low), selected));
+	}
+
+	return result;
+}
+
+IMGF_TARGET_AVX2
+__m256i lookupAvx2(const __m256i *tables, const __m256i indices)
+{
+	const __m256i nibbleMask = _mm256_set1_epi8(0x0F);
+	const __m256i low = _mm256_and_si256(indices, nibbleMask);
+	const __m256i high = _mm256_and_si256(_mm256_srli_epi16(indices, 4), nibbleMask);
+
+	__m256i result = _mm256_setzero_si256();
+
+	for (int table = 0; table < 16; ++table)
+	{
+		const __m256i selected = _mm256_cmpeq_epi8(high, _mm256_set1_epi8((char)table));
+
+		result = _mm256_or_si256(result, _mm256_and_si256(_mm256_shuffle_epi8(tables[table], low), selected));
+	}
+
+	return result;
+}
+
+// Gathers the R components of 16 packed RGB pixels.
+IMGF_TARGET_SSSE3
+__m128i loadRedComponents(const unsigned char *pixels)
+{
+	__m128i r, g, b;
+
+	deinterleaveRgb(pixels, &r, &g, &b);
+
+	return r;
+}
+
+IMGF_TARGET_SSSE3
+int remapPixelsSsse3(unsigned char *data, const int count, const unsigned char *lookupTable)
+{
+	__m128i tables[16];
+
+	for (int table = 0; table < 16; ++table)
+	{
+		tables[table] = _mm_loadu_si128((const __m128i *)(lookupTable + table * 16));
+	}
+
+	int i = 0;
+
+	for (; i + 16 <= count; i += 16)
+	{
+		unsigned char *pixels = data + i * COMPONENT_COUNT;
+
+		storeTriplicated(pixels, lookupSsse3(tables, loadRedComponents(pixels)));
+	}
+
+	return i;
+}
+
+IMGF_TARGET_AVX2
+int remapPixelsAvx2(unsigned char *data, const int count, const unsigned char *lookupTable)
+{
+	__m256i tables[16];
+
+	for (int table = 0; table < 16; ++table)
+	{
+		tables[table] = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)(lookupTable + table * 16)));
+	}
+
+	int i = 0;
+
+	for (; i + 32 <= count; i += 32)
+	{
+		unsigned char *pixels = data + i * COMPONENT_COUNT;
+
+		const __m256i indices = _mm256_inserti128_si256(_mm256_castsi128_si256(loadRedComponents(pixels)),
+			loadRedComponents(pixels + 16 * COMPONENT_COUNT), 1);
+
+		const __m256i values = lookupAvx2(tables, indices);
+
+		storeTriplicated(pixels, _mm256_castsi256_si128(values));
+		storeTriplicated(pixels + 16 * COMPONENT_COUNT, _mm256_extracti128_si256(values, 1));
+	}
+
+	return i;
+}
+
+// Replaces every pixel by lookupTable[R], written to all three components.
+void remapPixels(unsigned char *data, const int count, const unsigned char *lookupTable)
+{
+	int i = 0;
+
+	if (cpuFeatures().avx2)
+	{
+		i = remapPixelsAvx2(data, count, lookupTable);
+	}
+	else if (cpuFeatures().ssse3)
+	{
+		i = remapPixelsSsse3(data, count, lookupTable);
+	}
+
+	for (; i < count; ++i)
+	{
+		memset(data + i * COMPONENT_COUNT, lookupTable[data[i * COMPONENT_COUNT + R]], COMPONENT_COUNT);
+	}
+}
+
+IMGF_TARGET_SSSE3
+int remapColorPixelsSsse3(unsigned char *data, const int count, const unsigned char *lookupTables)
+{
+	__m128i tables[COMPONENT_COUNT][16];
+
+	for (int component = 0; component < COMPONENT_COUNT; ++component)
+	{
+		for (int table = 0; table < 16; ++table)
+		{
+			tables[component][table] = _mm_loadu_si128((const __m128i *)(lookupTables + component * BUCKET_COUNT + table * 16));
+		}
+	}
+
+	int i = 0;
+
+	for (; i + 16 <= count; i += 16)
+	{
+		unsigned char *pixels = data + i * COMPONENT_COUNT;
+
+		__m128i r, g, b;
+
+		deinterleaveRgb(pixels, &r, &g, &b);
+		interleaveRgb(pixels, lookupSsse3(tables[R], r), lookupSsse3(tables[G], g), lookupSsse3(tables[B], b));
+	}
+
+	return i;
+}
+
+// Replaces every component by its entry of the table of that component, lookupTables holds
+// the R, G and B tables one after the other.
+void remapColorPixels(unsigned char *data, const int count, const unsigned char *lookupTables)
+{
+	int i = cpuFeatures().ssse3 ? remapColorPixelsSsse3(data, count, lookupTables) : 0;
+
+	for (; i < count; ++i)
+	{
+		for (int component = 0; component < COMPONENT_COUNT; ++component)
+		{
+			data[i * COMPONENT_COUNT + component] = lookupTables[component * BUCKET_COUNT + data[i * COMPONENT_COUNT + component]];
+		}
+	}
+}
+
+void applyLookupTable(unsigned char *data, const int width, const int height, const unsigned char *lookupTable)
+{
+	parallelFor(height, REMAP_MIN_ROWS_PER_THREAD, [&](const int /*chunk*/, const int firstRow, const int lastRow)
+	{
+		remapPixels(data + indexOf(0, firstRow, width), (lastRow - firstRow) * width, lookupTable);
+	});
+}
+
+// Uses the same float accumulation as the per-pixel version did, so the table holds the exact same values.
+void makeEqualizationLookupTable(const uint64_t *histogram, const int64_t pixelCount, unsigned char *lookupTable)
+{
+	float cumulativeHistogram = 0.0f;
+
+	for (int i = 0; i < BUCKET_COUNT; ++i)
+	{
+		cumulativeHistogram += (float)histogram[i] / (float)pixelCount;
+
+		lookupTable[i] = (unsigned char)(int)std::floor((float)(BUCKET_COUNT - 1) * cumulativeHistogram);
+	}
+}
+
+int histogramEqualization(unsigned char *data, const int width, const int height)
+{
+	uint64_t histogram[BUCKET_COUNT];
+
+	computeHistogram(data, width, height, COMPONENT_COUNT, histogram);
+
+	unsigned char lookupTable[BUCKET_COUNT];
+
+	makeEqualizationLookupTable(histogram, (int64_t)width * height, lookupTable);
+
+	applyLookupTable(data, width, height, lookupTable);
+
+	return 0;
+}
+
+// 16 bit variant, computed with integers: a float sum over 65536 buckets would drift.
+void makeEqualizationLookupTable(const uint64_t *histogram, const int64_t pixelCount, uint16_t *lookupTable)
+{
+	uint64_t count = 0;
+
+	for (int i = 0; i < WIDE_BUCKET_COUNT; ++i)
+	{
+		count += histogram[i];
+
+		lookupTable[i] = (uint16_t)(count * (WIDE_BUCKET_COUNT - 1) / (uint64_t)pixelCount);
+	}
+}
+
+void applyLookupTable(uint16_t *data, const int width, const int height, const uint16_t *lookupTable)
+{
+	parallelFor(height, REMAP_MIN_ROWS_PER_THREAD, [&](const int /*chunk*/, const int firstRow, const int lastRow)
+	{
+		uint16_t *rows = data + (size_t)firstRow * width;
+
+		for (size_t i = 0; i < (size_t)(lastRow - firstRow) * width; ++i)
+		{
+			rows[i] = lookupTable[rows[i]];
+		}
+	});
+}
+
+// Equalizes a planar 16 bit gray image.
+int histogramEqualization(uint16_t *data, const int width, const int height)
+{
+	std::vector<uint64_t> histogram(WIDE_BUCKET_COUNT);
+
+	computeHistogram(data, width, height, 1, histogram.data());
+
+	std::vector<uint16_t> lookupTable(WIDE_BUCKET_COUNT);
+
+	makeEqualizationLookupTable(histogram.data(), (int64_t)width * height, lookupTable.data());
+
+	applyLookupTable(data, width, height, lookupTable.data());
+
+	return 0;
+}
+
+// Equalizes R, G and B separately.
+int colorHistogramEqualization(unsigned char *data, const int width, const int height)
+{
+	unsigned char lookupTables[COMPONENT_COUNT * BUCKET_COUNT];
+
+	for (int component = 0; component < COMPONENT_COUNT; ++component)
+	{
+		uint64_t histogram[BUCKET_COUNT];
+
+		computeHistogram(data + component, width, height, COMPONENT_COUNT, histogram);
+
+		makeEqualizationLookupTable(histogram, (int64_t)width * height, lookupTables + component * BUCKET_COUNT);
+	}
+
+	parallelFor(height, REMAP_MIN_ROWS_PER_THREAD, [&](const int /*chunk*/, const int firstRow, const int lastRow)
+	{
+		remapColorPixels(data + indexOf(0, firstRow, width), (lastRow - firstRow) * width, lookupTables);
+	});
+
+	return 0;
+}
+
+// Cumulative distribution of a reference image. It is computed once, after that matching an
+// image to it costs a histogram, a 256 entry table and a remap.
+struct HistogramReference
+{
+	double cumulative[BUCKET_COUNT];
+
+	HistogramReference(const uint64_t *histogram, const int64_t pixelCount)
+	{
+		uint64_t count = 0;
+
+		for (int i = 0; i < BUCKET_COUNT; ++i)
+		{
+			count += histogram[i];
+
+			cumulative[i] = (double)count / (double)pixelCount;
+		}
+	}
+};
+
+HistogramReference makeHistogramReference(const unsigned char *data, const int width, const int height)
+{
+	uint64_t histogram[BUCKET_COUNT];
+
+	computeHistogram(data, width, height, COMPONENT_COUNT, histogram);
+
+	return HistogramReference(histogram, (int64_t)width * height);
+}
+
+// Maps every level to the lowest reference level whose cumulative share reaches the share of
+// the level. Both distributions grow with the level, so one walk over the reference is enough.
+void makeMatchingLookupTable(const uint64_t *histogram, const int64_t pixelCount, const HistogramReference &reference, unsigned char *lookupTable)
+{
+	uint64_t count = 0;
+	int level = 0;
+
+	for (int i = 0; i < BUCKET_COUNT; ++i)
+	{
+		count += histogram[i];
+
+		const double share = (double)count / (double)pixelCount;
+
+		while ((level < BUCKET_COUNT - 1) && (reference.cumulative[level] < share))
+		{
+			++level;
+		}
+
+		lookupTable[i] = (unsigned char)level;
+	}
+}
+
+// Gives the gray image in data the distribution of the reference.
+int histogramMatching(unsigned char *data, const int width, const int height, const HistogramReference &reference)
+{
+	uint64_t histogram[BUCKET_COUNT];
+
+	computeHistogram(data, width, height, COMPONENT_COUNT, histogram);
+
+	unsigned char lookupTable[BUCKET_COUNT];
+
+	makeMatchingLookupTable(histogram, (int64_t)width * height, reference, lookupTable);
+
+	applyLookupTable(data, width, height, lookupTable);
+
+	return 0;
+}
+
+
+constexpr int FUSED_BLOCK_PIXELS = 4096;
+constexpr int MAX_OTSU_THRESHOLDS = 8;
+
+// Converts to grayscale and counts the gray values in the same sweep. Every block is
+// histogrammed right after its conversion, while it is still in the L1 cache.
+void convertToGrayscaleWithHistogram(unsigned char *data, const int width, const int height, uint64_t *histogram)
+{
+	const int chunkCount = chunkCountFor(height, HISTOGRAM_MIN_ROWS_PER_THREAD);
+
+	std::vector<uint64_t> partials((size_t)chunkCount * BUCKET_COUNT, 0);
+
+	parallelFor(height, HISTOGRAM_MIN_ROWS_PER_THREAD, [&](const int chunk, const int firstRow, const int lastRow)
+	{
+		unsigned char *band = data + indexOf(0, firstRow, width);
+		const int64_t pixelCount = (int64_t)(lastRow - firstRow) * width;
+
+		for (int64_t i = 0; i < pixelCount; i += FUSED_BLOCK_PIXELS)
+		{
+			const int count = (int)std::min<int64_t>(FUSED_BLOCK_PIXELS, pixelCount - i);
+
+			convertPixelsToGrayscale(band + i * COMPONENT_COUNT, band + i * COMPONENT_COUNT, count, true);
+			accumulateHistogram(band + i * COMPONENT_COUNT, count, COMPONENT_COUNT, partials.data() + (size_t)chunk * BUCKET_COUNT);
+		}
+	});
+
+	memset(histogram, 0, BUCKET_COUNT * sizeof(uint64_t));
+
+	for (int chunk = 0; chunk < chunkCount; ++chunk)
+	{
+		for (int bucket = 0; bucket < BUCKET_COUNT; ++bucket)
+		{
+			histogram[bucket] += partials[(size_t)chunk * BUCKET_COUNT + bucket];
+		}
+	}
+}
+
+// Otsu's method: the threshold maximizing the between-class variance. Values below
+// the returned threshold belong to the dark class, like in convertToBinary(). Empty
+// buckets make a range of thresholds equally good, the middle of the range is taken.
+int otsuThreshold(const uint64_t *histogram)
+{
+	double totalCount = 0.0, totalSum = 0.0;
+
+	for (int i = 0; i < BUCKET_COUNT; ++i)
+	{
+		totalCount += (double)histogram[i];
+		totalSum += (double)i * histogram[i];
+	}
+
+	double darkCount = 0.0, darkSum = 0.0;
+	double bestVariance = -1.0;
+	int firstBest = MIN_RGB_VALUE + 1, lastBest = MIN_RGB_VALUE + 1;
+
+	for (int i = 0; i < BUCKET_COUNT - 1; ++i)
+	{
+		darkCount += (double)histogram[i];
+		darkSum += (double)i * histogram[i];
+
+		const double lightCount = totalCount - darkCount;
+
+		if ((darkCount == 0.0) || (lightCount == 0.0))
+		{
+			continue;
+		}
+
+		const double meanDifference = darkSum / darkCount - (totalSum - darkSum) / lightCount;
+		const double variance = darkCount * lightCount * meanDifference * meanDifference;
+
+		if (variance > bestVariance)
+		{
+			bestVariance = variance;
+			firstBest = lastBest = i + 1;
+		}
+		else if ((variance == bestVariance) && (lastBest == i))
+		{
+			lastBest = i + 1;
+		}
+	}
+
+	return (firstBest + lastBest + 1) / 2;
+}
+
+// Multi-level Otsu: splits the histogram into thresholdCount + 1 classes maximizing the
+// between-class variance, by dynamic programming over the class boundaries. thresholds
+// receives the ascending lower bounds of the classes after the first one.
+int multiLevelOtsuThresholds(const uint64_t *histogram, const int thresholdCount, int *thresholds)
+{
+	if ((thresholdCount < 1) || (thresholdCount > MAX_OTSU_THRESHOLDS))
+	{
+		return -1;
+	}
+
+	// prefix sums over [0, i), the variance of a class is maximized through sum^2 / count
+	std::vector<double> counts(BUCKET_COUNT + 1, 0.0), sums(BUCKET_COUNT + 1, 0.0);
+
+	for (int i = 0; i < BUCKET_COUNT; ++i)
+	{
+		counts[i + 1] = counts[i] + (double)histogram[i];
+		sums[i + 1] = sums[i] + (double)i * histogram[i];
+	}
+
+	auto classScore = [&](const int begin, const int end)
+	{
+		const double count = counts[end] - counts[begin];
+		const double sum = sums[end] - sums[begin];
+
+		return count > 0.0 ? sum * sum / count : 0.0;
+	};
+
+	const int classCount = thresholdCount + 1;
+
+	// best[c][end]: best score of c + 1 classes covering [0, end), start[c][end]: where the last one begins
+	std::vector<double> best((size_t)classCount * (BUCKET_COUNT + 1), -1.0);
+	std::vector<int> start((size_t)classCount * (BUCKET_COUNT + 1), 0);
+
+	for (int end = 1; end <= BUCKET_COUNT; ++end)
+	{
+		best[end] = classScore(0, end);
+	}
+
+	for (int c = 1; c < classCount; ++c)
+	{
+		for (int end = c + 1; end <= BUCKET_COUNT; ++end)
+		{
+			for (int begin = c; begin < end; ++begin)
+			{
+				const double score = best[(size_t)(c - 1) * (BUCKET_COUNT + 1) + begin] + classScore(begin, end);
+
+				if (score > best[(size_t)c * (BUCKET_COUNT + 1) + end])
+				{
+					best[(size_t)c * (BUCKET_COUNT + 1) + end] = score;
+					start[(size_t)c * (BUCKET_COUNT + 1) + end] = begin;
+				}
+			}
+		}
+	}
+
+	int end = BUCKET_COUNT;
+
+	for (int c = classCount - 1; c > 0; --c)
+	{
+		end = start[(size_t)c * (BUCKET_COUNT + 1) + end];
+		thresholds[c - 1] = end;
+	}
+
+	return 0;
+}
+
+void makeBinaryLookupTable(const int threshold, unsigned char *lookupTable)
+{
+	for (int i = 0; i < BUCKET_COUNT; ++i)
+	{
+		lookupTable[i] = i < threshold ? MIN_RGB_VALUE : MAX_RGB_VALUE;
+	}
+}
+
+void convertToBinary(unsigned char *data, const int width, const int height, const int threshold)
+{
+	if ((threshold < MIN_RGB_VALUE) || (threshold > MAX_RGB_VALUE))
+	{
+		return;
+	}
+
+	unsigned char lookupTable[BUCKET_COUNT];
+
+	makeBinaryLookupTable(threshold, lookupTable);
+
+	applyLookupTable(data, width, height, lookupTable);
+}
+
+constexpr int LOCAL_THRESHOLD_MIN_ROWS_PER_THREAD = 32;
+
+// Appends the next row to a pair of integral rows: sums[x] = previousSums[x] + row[0] + ... + row[x - 1].
+void accumulateIntegralRow(const unsigned char *row, const int width, const uint64_t *previousSums, const uint64_t *previousSquares, uint64_t *sums, uint64_t *squares)
+{
+	uint32_t rowSum = 0;
+	uint64_t rowSquares = 0;
+
+	sums[0] = 0;
+	squares[0] = 0;
+
+	for (int x = 0; x < width; ++x)
+	{
+		rowSum += row[x];
+		rowSquares += (uint32_t)row[x] * row[x];
+
+		sums[x + 1] = previousSums[x + 1] + rowSum;
+		squares[x + 1] = previousSquares[x + 1] + rowSquares;
+	}
+}
+
+// Local thresholding by Niblack (mean + k * deviation) or Sauvola (mean * (1 + k * (deviation / R - 1)))
+// over a windowSize x windowSize neighbourhood, clipped at the image border. Window sums come from
+// 64 bit integral images of the values and their squares, so the cost per pixel does not depend on
+// the window size. Every row band keeps only the last windowSize + 1 integral rows, relative to
+// the first row its windows touch.
+int adaptiveBinarization(unsigned char *data, const int width, const int height, const LocalThresholdMethod method, const int windowSize, const float k)
+{
+	if (!(windowSize % 2) || (windowSize < 3))
+	{
+		return -1;
+	}
+
+	const int radius = windowSize / 2;
+	const int ringSize = windowSize + 1;
+	const int integralWidth = width + 1;
+
+	// the bands overwrite their rows while the neighbouring bands still read them, so the windows use a copy
+	std::vector<unsigned char> gray((size_t)width * height);
+
+	parallelFor(height, REMAP_MIN_ROWS_PER_THREAD, [&](const int /*chunk*/, const int firstRow, const int lastRow)
+	{
+		convertPixelsToGrayscale(data + indexOf(0, firstRow, width), gray.data() + (size_t)firstRow * width, (lastRow - firstRow) * width, false);
+	});
+
+	parallelFor(height, LOCAL_THRESHOLD_MIN_ROWS_PER_THREAD, [&](const int /*chunk*/, const int firstRow, const int lastRow)
+	{
+		const int originRow = std::max(0, firstRow - radius);
+
+		std::vector<uint64_t> sums((size_t)ringSize * integralWidth, 0), squares((size_t)ringSize * integralWidth, 0);
+
+		// integral row j covers the image rows [originRow, j)
+		auto integralRow = [&](std::vector<uint64_t> &ring, const int row)
+		{
+			return ring.data() + (size_t)((row - originRow) % ringSize) * integralWidth;
+		};
+
+		int builtRow = originRow;
+
+		for (int y = firstRow; y < lastRow; ++y)
+		{
+			const int top = std::max(0, y - radius);
+			const int bottom = std::min(height, y + radius + 1);
+
+			for (; builtRow < bottom; ++builtRow)
+			{
+				accumulateIntegralRow(gray.data() + (size_t)builtRow * width, width,
+					integralRow(sums, builtRow), integralRow(squares, builtRow), integralRow(sums, builtRow + 1), integralRow(squares, builtRow + 1));
+			}
+
+			const uint64_t *topSums = integralRow(sums, top), *bottomSums = integralRow(sums, bottom);
+			const uint64_t *topSquares = integralRow(squares, top), *bottomSquares = integralRow(squares, bottom);
+
+			const unsigned char *grayRow = gray.data() + (size_t)y * width;
+			unsigned char *row = data + indexOf(0, y, width);
+
+			for (int x = 0; x < width; ++x)
+			{
+				const int left = std::max(0, x - radius);
+				const int right = std::min(width, x + radius + 1);
+
+				const uint64_t count = (uint64_t)(bottom - top) * (right - left);
+				const uint64_t sum = bottomSums[right] - bottomSums[left] - topSums[right] + topSums[left];
+				const uint64_t squareSum = bottomSquares[right] - bottomSquares[left] - topSquares[right] + topSquares[left];
+
+				// count * squareSum - sum * sum is count^2 times the variance. The unsigned products wrap
+				// around, but the difference is exact up to EXACT_VARIANCE_MAX_COUNT pixels, larger
+				// windows compute it in doubles.
+				const double scaledVariance = (count <= EXACT_VARIANCE_MAX_COUNT) ?
+					(double)(count * squareSum - sum * sum) :
+					std::max(0.0, (double)count * squareSum - (double)sum * sum);
+				const double mean = (double)sum / count;
+				const double deviation = std::sqrt(scaledVariance) / count;
+
+				const double threshold = (method == SAUVOLA) ?
+					mean * (1.0 + k * (deviation / SAUVOLA_DYNAMIC_RANGE - 1.0)) :
+					mean + k * deviation;
+
+				const unsigned char value = grayRow[x] < threshold ? MIN_RGB_VALUE : MAX_RGB_VALUE;
+
+				row[x * COMPONENT_COUNT + R] = value;
+				row[x * COMPONENT_COUNT + G] = value;
+				row[x * COMPONENT_COUNT + B] = value;
+			}
+		}
+	});
+
+	return 0;
+}
+
+constexpr int CLAHE_MIN_TILE_SIZE = 8;
+
+// Clips the histogram at clipLimit and spreads the clipped counts evenly over all buckets.
+void clipHistogram(uint64_t *histogram, const uint64_t clipLimit)
+{
+	uint64_t excess = 0;
+
+	for (int i = 0; i < BUCKET_COUNT; ++i)
+	{
+		if (histogram[i] > clipLimit)
+		{
+			excess += histogram[i] - clipLimit;
+			histogram[i] = clipLimit;
+		}
+	}
+
+	const uint64_t increment = excess / BUCKET_COUNT;
+	const uint64_t remainder = excess % BUCKET_COUNT;
+
+	for (int i = 0; i < BUCKET_COUNT; ++i)
+	{
+		histogram[i] += increment + ((uint64_t)i < remainder ? 1 : 0);
+	}
+}
+
+// Contrast limited adaptive histogram equalization. Every tile gets its own clipped
+// equalization table, pixels are mapped by bilinear interpolation between the tables
+// of the four nearest tile centers. clipLimit is a multiple of the average bucket
+// count of a tile, values <= 1 disable clipping.
+int adaptiveHistogramEqualization(unsigned char *data, const int width, const int height, const int tilesX, const int tilesY, const float clipLimit)
+{
+	if ((tilesX < 1) || (tilesY < 1) || (width / tilesX < CLAHE_MIN_TILE_SIZE) || (height / tilesY < CLAHE_MIN_TILE_SIZE))
+	{
+		return -1;
+	}
+
+	const int tileCount = tilesX * tilesY;
+
+	std::vector<int> tileLeft(tilesX + 1), tileTop(tilesY + 1);
+
+	for (int i = 0; i <= tilesX; ++i)
+	{
+		tileLeft[i] = (int)((int64_t)width * i / tilesX);
+	}
+
+	for (int i = 0; i <= tilesY; ++i)
+	{
+		tileTop[i] = (int)((int64_t)height * i / tilesY);
+	}
+
+	std::vector<unsigned char> lookupTables((size_t)tileCount * BUCKET_COUNT);
+
+	// every tile row is counted once, row by row, with the interleaved histogram kernel
+	parallelFor(tileCount, 1, [&](const int /*chunk*/, const int firstTile, const int lastTile)
+	{
+		uint64_t histogram[BUCKET_COUNT];
+
+		for (int tile = firstTile; tile < lastTile; ++tile)
+		{
+			const int tileX = tile % tilesX;
+			const int tileY = tile / tilesX;
+			const int tileWidth = tileLeft[tileX + 1] - tileLeft[tileX];
+			const int64_t tilePixels = (int64_t)tileWidth * (tileTop[tileY + 1] - tileTop[tileY]);
+
+			memset(histogram, 0, sizeof(histogram));
+
+			for (int y = tileTop[tileY]; y < tileTop[tileY + 1]; ++y)
+			{
+				accumulateHistogram(data + indexOf(tileLeft[tileX], y, width), tileWidth, COMPONENT_COUNT, histogram);
+			}
+
+			if (clipLimit > 1.0f)
+			{
+				clipHistogram(histogram, std::max<uint64_t>(1, (uint64_t)(clipLimit * tilePixels / BUCKET_COUNT)));
+			}
+
+			unsigned char *lookupTable = lookupTables.data() + (size_t)tile * BUCKET_COUNT;
+
+			uint64_t cumulative = 0;
+
+			for (int i = 0; i < BUCKET_COUNT; ++i)
+			{
+				cumulative += histogram[i];
+
+				lookupTable[i] = (unsigned char)((cumulative * MAX_RGB_VALUE) / tilePixels);
+			}
+		}
+	});
+
+	// per column interpolation parameters, shared by every row
+	std::vector<int> leftTile(width), rightTile(width);
+	std::vector<float> rightWeight(width);
+
+	for (int x = 0, tile = 0; x < width; ++x)
+	{
+		while ((tile < tilesX - 1) && (2 * x + 1 >= tileLeft[tile + 1] + tileLeft[tile + 2]))
+		{
+			++tile;
+		}
+
+		const float center = 0.5f * (tileLeft[tile] + tileLeft[tile + 1]);
+		const float nextCenter = (tile < tilesX - 1) ? 0.5f * (tileLeft[tile + 1] + tileLeft[tile + 2]) : center;
+
+		leftTile[x] = tile;
+		rightTile[x] = (tile < tilesX - 1) ? tile + 1 : tile;
+		rightWeight[x] = (nextCenter > center) ? std::min(1.0f, std::max(0.0f, (x + 0.5f - center) / (nextCenter - center))) : 0.0f;
+	}
+
+	parallelFor(height, REMAP_MIN_ROWS_PER_THREAD, [&](const int /*chunk*/, const int firstRow, const int lastRow)
+	{
+		int tile = 0;
+
+		for (int y = firstRow; y < lastRow; ++y)
+		{
+			while ((tile < tilesY - 1) && (2 * y + 1 >= tileTop[tile + 1] + tileTop[tile + 2]))
+			{
+				++tile;
+			}
+
+			const float center = 0.5f * (tileTop[tile] + tileTop[tile + 1]);
+			const float nextCenter = (tile < tilesY - 1) ? 0.5f * (tileTop[tile + 1] + tileTop[tile + 2]) : center;
+			const float bottomWeight = (nextCenter > center) ? std::min(1.0f, std::max(0.0f, (y + 0.5f - center) / (nextCenter - center))) : 0.0f;
+
+			const unsigned char *topTables = lookupTables.data() + (size_t)tile * tilesX * BUCKET_COUNT;
+			const unsigned char *bottomTables = lookupTables.data() + (size_t)std::min(tile + 1, tilesY - 1) * tilesX * BUCKET_COUNT;
+
+			unsigned char *row = data + indexOf(0, y, width);
+
+			for (int x = 0; x < width; ++x)
+			{
+				const int value = row[x * COMPONENT_COUNT];
+				const int left = leftTile[x] * BUCKET_COUNT + value;
+				const int right = rightTile[x] * BUCKET_COUNT + value;
+
+				const float top = topTables[left] + rightWeight[x] * (topTables[right] - topTables[left]);
+				const float bottom = bottomTables[left] + rightWeight[x] * (bottomTables[right] - bottomTables[left]);
+
+				memset(row + x * COMPONENT_COUNT, (int)(top + bottomWeight * (bottom - top) + 0.5f), COMPONENT_COUNT);
+			}
+		}
+	});
+
+	return 0;
 }
 
 }
@@ -0,0 +1,442 @@
+#ifndef NOISE_FUNCS_H
+#define NOISE_FUNCS_H
+
+#include "image_funcs.h"
+
+// Philox4x32-10 constants (Salmon et al., "Parallel random numbers: as easy as 1, 2, 3")
+constexpr uint32_t PHILOX_M0 = 0xD2511F53;
+constexpr uint32_t PHILOX_M1 = 0xCD9E8D57;
+constexpr uint32_t PHILOX_W0 = 0x9E3779B9;
+constexpr uint32_t PHILOX_W1 = 0xBB67AE85;
+constexpr int PHILOX_ROUNDS = 10;
+
+// One batch is 8 Philox blocks of 4 outputs, 8 being the AVX2 lane count.
+constexpr int RANDOM_BATCH_LANES = 8;
+constexpr int RANDOM_BATCH_SIZE = 4 * RANDOM_BATCH_LANES;
+
+constexpr int NOISE_MIN_ROWS_PER_THREAD = 32;
+
+// Every generator draws from its own stream, so changing one never shifts another's numbers.
+enum NoiseStream
+{
+	BINARY_NOISE_STREAM = 0,
+	GEOMETRIC_NOISE_STREAM = 1,
+	EXACT_NOISE_STREAM = 2
+};
+
+enum NoiseSampling
+{
+	EXPECTED_PERCENTAGE,
+	EXACT_PERCENTAGE
+};
+
+// Below this expected percentage skipping between toggled pixels beats testing every pixel.
+constexpr int GEOMETRIC_SAMPLING_MAX_PERCENTAGE = 10;
+
+namespace imgf
+{
+
+void philox4x32(const uint32_t counter[4], const uint32_t key[2], uint32_t result[4])
+{
+	uint32_t c0 = counter[0], c1 = counter[1], c2 = counter[2], c3 = counter[3];
+	uint32_t k0 = key[0], k1 = key[1];
+
+	for (int round = 0; round < PHILOX_ROUNDS; ++round)
+	{
+		const uint64_t product0 = (uint64_t)PHILOX_M0 * c0;
+		const uint64_t product1 = (uint64_t)PHILOX_M1 * c2;
+
+		c0 = (uint32_t)(product1 >> 32) ^ c1 ^ k0;
+		c1 = (uint32_t)product1;
+		c2 = (uint32_t)(product0 >> 32) ^ c3 ^ k1;
+		c3 = (uint32_t)product0;
+
+		k0 += PHILOX_W0;
+		k1 += PHILOX_W1;
+	}
+
+	result[0] = c0;
+	result[1] = c1;
+	result[2] = c2;
+	result[3] = c3;
+}
+
+IMGF_TARGET_AVX2
+void multiplyHighLowAvx2(const __m256i a, const __m256i multiplier, __m256i *low, __m256i *high)
+{
+	// mul_epu32 only multiplies the even 32 bit lanes, the odd ones are shifted down for a second pass
+	const __m256i even = _mm256_mul_epu32(a, multiplier);
+	const __m256i odd = _mm256_mul_epu32(_mm256_srli_epi64(a, 32), multiplier);
+
+	*low = _mm256_blend_epi32(even, _mm256_slli_epi64(odd, 32), 0xAA);
+	*high = _mm256_blend_epi32(_mm256_srli_epi64(even, 32), odd, 0xAA);
+}
+
+// Eight independent Philox blocks, one per lane, counters and results in structure of arrays form.
+IMGF_TARGET_AVX2
+void philox4x32Avx2(__m256i counter[4], const uint32_t key[2])
+{
+	const __m256i m0 = _mm256_set1_epi32((int)PHILOX_M0);
+	const __m256i m1 = _mm256_set1_epi32((int)PHILOX_M1);
+
+	uint32_t k0 = key[0], k1 = key[1];
+
+	for (int round = 0; round < PHILOX_ROUNDS; ++round)
+	{
+		__m256i low0, high0, low1, high1;
+
+		multiplyHighLowAvx2(counter[0], m0, &low0, &high0);
+		multiplyHighLowAvx2(counter[2], m1, &low1, &high1);
+
+		counter[0] = _mm256_xor_si256(_mm256_xor_si256(high1, counter[1]), _mm256_set1_epi32((int)k0));
+		counter[1] = low1;
+		counter[2] = _mm256_xor_si256(_mm256_xor_si256(high0, counter[3]), _mm256_set1_epi32((int)k1));
+		counter[3] = low0;
+
+		k0 += PHILOX_W0;
+		k1 += PHILOX_W1;
+	}
+}
+
+IMGF_TARGET_AVX2
+void randomBatchAvx2(const uint32_t key[2], const int stream, const int row, const int batch, uint32_t *result)
+{
+	__m256i counter[4] =
+	{
+		_mm256_add_epi32(_mm256_set1_epi32(batch * RANDOM_BATCH_LANES), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7)),
+		_mm256_set1_epi32(row),
+		_mm256_set1_epi32(stream),
+		_mm256_setzero_si256()
+	};
+
+	philox4x32Avx2(counter, key);
+
+	for (int k = 0; k < 4; ++k)
+	{
+		_mm256_storeu_si256((__m256i *)(result + k * RANDOM_BATCH_LANES), counter[k]);
+	}
+}
+
+// Fills result with the RANDOM_BATCH_SIZE numbers of one batch. A batch is addressed by
+// (seed, stream, row, batch index within the row), so any pixel's numbers can be produced
+// independently of all others, whatever the thread count or the instruction set.
+// Output k of the block in lane j lands at result[k * RANDOM_BATCH_LANES + j].
+void randomBatch(const uint64_t seed, const int stream, const int row, const int batch, uint32_t *result)
+{
+	const uint32_t key[2] = { (uint32_t)seed, (uint32_t)(seed >> 32) };
+
+	if (cpuFeatures().avx2)
+	{
+		randomBatchAvx2(key, stream, row, batch, result);
+
+		return;
+	}
+
+	for (int lane = 0; lane < RANDOM_BATCH_LANES; ++lane)
+	{
+		const uint32_t counter[4] = { (uint32_t)(batch * RANDOM_BATCH_LANES + lane), (uint32_t)row, (uint32_t)stream, 0 };
+
+		uint32_t block[4];
+
+		philox4x32(counter, key, block);
+
+		for (int k = 0; k < 4; ++k)
+		{
+			result[k * RANDOM_BATCH_LANES + lane] = block[k];
+		}
+	}
+}
+
+// Bit i is set when random[i] < threshold, the comparison is done on 8 lanes at once where available.
+uint32_t belowThresholdMask(const uint32_t *random, const uint64_t threshold)
+{
+	if (threshold > UINT32_MAX)
+	{
+		return UINT32_MAX;
+	}
+
+	uint32_t mask = 0;
+
+	for (int i = 0; i < RANDOM_BATCH_SIZE; ++i)
+	{
+		mask |= (uint32_t)(random[i] < threshold) << i;
+	}
+
+	return mask;
+}
+
+IMGF_TARGET_AVX2
+uint32_t belowThresholdMaskAvx2(const uint32_t *random, const uint64_t threshold)
+{
+	if (threshold > UINT32_MAX)
+	{
+		return UINT32_MAX;
+	}
+
+	// there is no unsigned compare, flipping the sign bit maps unsigned order onto signed order
+	const __m256i signBit = _mm256_set1_epi32(INT32_MIN);
+	const __m256i limit = _mm256_xor_si256(_mm256_set1_epi32((int)(uint32_t)threshold), signBit);
+
+	uint32_t mask = 0;
+
+	for (int k = 0; k < 4; ++k)
+	{
+		const __m256i value = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(random + k * RANDOM_BATCH_LANES)), signBit);
+		const __m256i below = _mm256_cmpgt_epi32(limit, value);
+
+		mask |= (uint32_t)_mm256_movemask_ps(_mm256_castsi256_ps(below)) << (k * RANDOM_BATCH_LANES);
+	}
+
+	return mask;
+}
+
+// Sequential reader over the numbers of one (seed, stream, row), for samplers that consume
+// a data dependent amount of them.
+struct RandomSequence
+{
+	uint64_t seed;
+	int stream, row, batch, position;
+	uint32_t buffer[RANDOM_BATCH_SIZE];
+
+	RandomSequence(const uint64_t seed, const int stream, const int row)
+		: seed(seed), stream(stream), row(row), batch(0), position(RANDOM_BATCH_SIZE)
+	{
+	}
+
+	uint32_t next()
+	{
+		if (position == RANDOM_BATCH_SIZE)
+		{
+			randomBatch(seed, stream, row, batch++, buffer);
+
+			position = 0;
+		}
+
+		return buffer[position++];
+	}
+
+	// uniform in (0, 1]
+	double nextUnit()
+	{
+		return (next() + 1.0) / 4294967296.0;
+	}
+
+	// uniform in [0, bound)
+	uint32_t nextBelow(const uint32_t bound)
+	{
+		return (uint32_t)(((uint64_t)next() * bound) >> 32);
+	}
+};
+
+void toggleBinaryPixel(unsigned char *pixel)
+{
+	memset(pixel, (pixel[R] == MIN_RGB_VALUE) ? MAX_RGB_VALUE : MIN_RGB_VALUE, COMPONENT_COUNT);
+}
+
+// Draws one number per pixel, 32 pixels are decided by a single vector compare.
+// rows points to row firstRow, the rows are addressed by their index in the whole image.
+int64_t denseBinaryNoiseRows(unsigned char *rows, const int width, const int firstRow, const int lastRow, const int percentage, const uint64_t seed)
+{
+	const uint64_t threshold = ((uint64_t)std::max(0, percentage) << 32) / 100;
+	const int batchesPerRow = (width + RANDOM_BATCH_SIZE - 1) / RANDOM_BATCH_SIZE;
+	const bool useAvx2 = cpuFeatures().avx2;
+
+	uint32_t random[RANDOM_BATCH_SIZE];
+	int64_t changed = 0;
+
+	for (int y = firstRow; y < lastRow; ++y)
+	{
+		unsigned char *row = rows + indexOf(0, y - firstRow, width);
+
+		for (int batch = 0; batch < batchesPerRow; ++batch)
+		{
+			randomBatch(seed, BINARY_NOISE_STREAM, y, batch, random);
+
+			const int firstColumn = batch * RANDOM_BATCH_SIZE;
+			const int columnCount = std::min(RANDOM_BATCH_SIZE, width - firstColumn);
+
+			uint32_t mask = useAvx2 ? belowThresholdMaskAvx2(random, threshold) : belowThresholdMask(random, threshold);
+
+			if (columnCount < RANDOM_BATCH_SIZE)
+			{
+				mask &= (1u << columnCount) - 1;
+			}
+
+			while (mask)
+			{
+				toggleBinaryPixel(row + (firstColumn + lowestSetBit(mask)) * COMPONENT_COUNT);
+
+				mask &= mask - 1;
+
+				++changed;
+			}
+		}
+	}
+
+	return changed;
+}
+
+// Jumps from one toggled pixel to the next: the gap between two successes of independent
+// trials with probability p is geometric, so each toggled pixel costs one random number.
+// Rows are independent sequences, so they still run in parallel.
+int64_t geometricBinaryNoiseRows(unsigned char *rows, const int width, const int firstRow, const int lastRow, const int percentage, const uint64_t seed)
+{
+	const double inverseLogMiss = 1.0 / std::log1p(-percentage / 100.0);
+
+	int64_t changed = 0;
+
+	for (int y = firstRow; y < lastRow; ++y)
+	{
+		unsigned char *row = rows + indexOf(0, y - firstRow, width);
+
+		RandomSequence random(seed, GEOMETRIC_NOISE_STREAM, y);
+
+		double x = std::floor(std::log(random.nextUnit()) * inverseLogMiss);
+
+		while (x < width)
+		{
+			toggleBinaryPixel(row + (int)x * COMPONENT_COUNT);
+
+			++changed;
+
+			x += 1.0 + std::floor(std::log(random.nextUnit()) * inverseLogMiss);
+		}
+	}
+
+	return changed;
+}
+
+// Selects exactly round(percentage% of the pixels) with Floyd's algorithm, which draws one
+// random number per selected pixel. The result is a bitmap of one bit per pixel.
+std::vector<uint64_t> selectExactNoisePixels(const int width, const int height, const int percentage, const uint64_t seed)
+{
+	const int64_t pixelCount = (int64_t)width * height;
+	const int64_t selectedCount = (pixelCount * std::min(100, std::max(0, percentage)) + 50) / 100;
+
+	std::vector<uint64_t> selected((size_t)((pixelCount + 63) / 64), 0);
+
+	RandomSequence random(seed, EXACT_NOISE_STREAM, 0);
+
+	for (int64_t candidate = pixelCount - selectedCount; candidate < pixelCount; ++candidate)
+	{
+		int64_t pixel = random.nextBelow((uint32_t)candidate + 1);
+
+		if (selected[pixel / 64] & (1ull << (pixel % 64)))
+		{
+			pixel = candidate;
+		}
+
+		selected[pixel / 64] |= 1ull << (pixel % 64);
+	}
+
+	return selected;
+}
+
+// Walks the bitmap a word at a time, so the cost is one test per 64 pixels plus one step per
+// toggled pixel. The first and last word may hold pixels of the neighbouring row ranges.
+int64_t toggleSelectedPixelRows(unsigned char *rows, const int width, const int firstRow, const int lastRow, const std::vector<uint64_t> &selected)
+{
+	const int64_t firstPixel = (int64_t)firstRow * width;
+	const int64_t endPixel = (int64_t)lastRow * width;
+
+	int64_t changed = 0;
+
+	for (int64_t wordStart = firstPixel - firstPixel % 64; wordStart < endPixel; wordStart += 64)
+	{
+		uint64_t word = selected[wordStart / 64];
+
+		if (word == 0)
+		{
+			continue;
+		}
+
+		if (wordStart < firstPixel)
+		{
+			word &= ~0ull << (firstPixel - wordStart);
+		}
+
+		if (endPixel - wordStart < 64)
+		{
+			word &= (1ull << (endPixel - wordStart)) - 1;
+		}
+
+		while (word)
+		{
+			toggleBinaryPixel(rows + (wordStart + lowestSetBit(word) - firstPixel) * COMPONENT_COUNT);
+
+			word &= word - 1;
+
+			++changed;
+		}
+	}
+
+	return changed;
+}
+
+// Everything a row range needs to add the binary noise on its own, which lets the noise run
+// per row band or as a stage of a fused pipeline. The exact mode selects its pixels up front.
+struct BinaryNoise
+{
+	int percentage;
+	uint64_t seed;
+	NoiseSampling sampling;
+	std::vector<uint64_t> selected;
+
+	BinaryNoise(const int width, const int height, const int percentage, const uint64_t seed, const NoiseSampling sampling)
+		: percentage(percentage), seed(seed), sampling(sampling)
+	{
+		if ((percentage > 0) && (sampling == EXACT_PERCENTAGE))
+		{
+			selected = selectExactNoisePixels(width, height, percentage, seed);
+		}
+	}
+
+	int64_t applyToRows(unsigned char *rows, const int width, const int firstRow, const int lastRow) const
+	{
+		if (percentage <= 0)
+		{
+			return 0;
+		}
+		else if (sampling == EXACT_PERCENTAGE)
+		{
+			return toggleSelectedPixelRows(rows, width, firstRow, lastRow, selected);
+		}
+		else if (percentage <= GEOMETRIC_SAMPLING_MAX_PERCENTAGE)
+		{
+			return geometricBinaryNoiseRows(rows, width, firstRow, lastRow, percentage, seed);
+		}
+		else
+		{
+			return denseBinaryNoiseRows(rows, width, firstRow, lastRow, percentage, seed);
+		}
+	}
+};
+
+// Counter based, reproducible variant of additiveBinaryNoise: the same seed toggles the same
+// pixels on every run, on any machine and with any number of threads. Low expected
+// percentages are sampled by geometric skipping, so their cost follows the number of
+// toggled pixels instead of the image size.
+int additiveBinaryNoise(unsigned char *data, const int width, const int height, const int percentage, const uint64_t seed, const NoiseSampling sampling = EXPECTED_PERCENTAGE)
+{
+	const BinaryNoise noise(width, height, percentage, seed, sampling);
+
+	std::vector<int64_t> changedCounts(chunkCountFor(height, NOISE_MIN_ROWS_PER_THREAD), 0);
+
+	parallelFor(height, NOISE_MIN_ROWS_PER_THREAD, [&](const int chunk, const int firstRow, const int lastRow)
+	{
+		changedCounts[chunk] = noise.applyToRows(data + indexOf(0, firstRow, width), width, firstRow, lastRow);
+	});
+
+	int64_t changedCount = 0;
+
+	for (const int64_t count : changedCounts)
+	{
+		changedCount += count;
+	}
+
+	printf("Actual noise is %f%%.\n", 100.f * ((float)changedCount) / ((float)width * height));
+
+	return 0;
+}
+}
+#endif
@@ -0,0 +1,170 @@
+#ifndef PIPELINE_FUNCS_H
+#define PIPELINE_FUNCS_H
+
+#include <functional>
+#include <atomic>
+
+#include "image_funcs.h"
+#include "noise_funcs.h"
+
+// Strips are sized so that a strip and its halo stay in the L2 cache between the stages.
+constexpr int PIPELINE_STRIP_BYTES = 256 * 1024;
+constexpr int PIPELINE_MIN_STRIP_ROWS = 4;
+constexpr int PIPELINE_MIN_ROWS_PER_THREAD = 64;
+
+namespace imgf
+{
+
+// Transforms the rows [firstRow, lastRow) in place, rows points to row firstRow. Rows next to
+// a band border are computed by both bands, isHalo is set for the copy that is not kept.
+typedef std::function<void(unsigned char *rows, const int width, const int firstRow, const int lastRow, const bool isHalo)> PointOperation;
+
+// Writes the rows [firstRow, lastRow) into output, see meanFilterRows() for the arguments. Only
+// rows up to the pipeline radius away exist in input, so BORDER_WRAP filters cannot run here.
+typedef std::function<void(const unsigned char *input, const int inputFirstRow, unsigned char *output, const int width, const int height, const int firstRow, const int lastRow)> NeighbourhoodOperation;
+
+// Point operations followed by at most one neighbourhood operation reaching radius rows
+// above and below the filtered one.
+struct Pipeline
+{
+	std::vector<PointOperation> pointOperations;
+	NeighbourhoodOperation neighbourhoodOperation;
+	int radius = 0;
+};
+
+PointOperation grayscaleOperation()
+{
+	return [](unsigned char *rows, const int width, const int firstRow, const int lastRow, const bool /*isHalo*/)
+	{
+		convertPixelsToGrayscale(rows, rows, (lastRow - firstRow) * width, true);
+	};
+}
+
+PointOperation binaryOperation(const int threshold)
+{
+	std::vector<unsigned char> lookupTable(BUCKET_COUNT);
+
+	makeBinaryLookupTable(threshold, lookupTable.data());
+
+	return [lookupTable](unsigned char *rows, const int width, const int firstRow, const int lastRow, const bool /*isHalo*/)
+	{
+		remapPixels(rows, (lastRow - firstRow) * width, lookupTable.data());
+	};
+}
+
+// Toggled pixels of the kept rows are added to changedCount.
+PointOperation binaryNoiseOperation(const BinaryNoise &noise, std::atomic<int64_t> &changedCount)
+{
+	return [&noise, &changedCount](unsigned char *rows, const int width, const int firstRow, const int lastRow, const bool isHalo)
+	{
+		const int64_t changed = noise.applyToRows(rows, width, firstRow, lastRow);
+
+		if (!isHalo)
+		{
+			changedCount += changed;
+		}
+	};
+}
+
+// Runs the pipeline strip by strip, so every row travels through all stages while it is in the
+// cache. Each thread owns a band of rows and slides a buffer of strip + halo rows over it: new
+// rows are read from input and put through the point operations, the rows no window reaches
+// any more are dropped. The image after the point operations goes to staged, the image after
+// the neighbourhood operation to output, and the histogram of output to histogram. The halo
+// rows of a band are recomputed from input instead of being shared, so input must not alias
+// staged or output, and the point operations must only depend on the row index, not on the
+// order of evaluation.
+int runPipeline(const unsigned char *input, unsigned char *staged, unsigned char *output, const int width, const int height, const Pipeline &pipeline, uint64_t *histogram)
+{
+	if ((input == staged) || (input == output) || (pipeline.radius < 0))
+	{
+		return -1;
+	}
+
+	const int rowSize = width * COMPONENT_COUNT;
+	const int radius = pipeline.neighbourhoodOperation ? pipeline.radius : 0;
+	const int stripRows = std::max(PIPELINE_MIN_STRIP_ROWS, PIPELINE_STRIP_BYTES / std::max(1, rowSize) - 2 * radius);
+	const int chunkCount = chunkCountFor(height, PIPELINE_MIN_ROWS_PER_THREAD);
+
+	std::vector<uint64_t> partials((size_t)chunkCount * BUCKET_COUNT, 0);
+
+	parallelFor(height, PIPELINE_MIN_ROWS_PER_THREAD, [&](const int chunk, const int firstRow, const int lastRow)
+	{
+		std::vector<unsigned char> buffer((size_t)(stripRows + 2 * radius) * rowSize);
+
+		// the buffer holds the rows [bufferFirst, bufferLast) after the point operations
+		int bufferFirst = std::max(0, firstRow - radius);
+		int bufferLast = bufferFirst;
+
+		for (int stripFirst = firstRow; stripFirst < lastRow; stripFirst += stripRows)
+		{
+			const int stripLast = std::min(lastRow, stripFirst + stripRows);
+			const int neededFirst = std::max(0, stripFirst - radius);
+			const int neededLast = std::min(height, stripLast + radius);
+
+			if (neededFirst > bufferFirst)
+			{
+				memmove(buffer.data(), buffer.data() + (size_t)(neededFirst - bufferFirst) * rowSize, (size_t)(bufferLast - neededFirst) * rowSize);
+
+				bufferFirst = neededFirst;
+			}
+
+			unsigned char *newRows = buffer.data() + (size_t)(bufferLast - bufferFirst) * rowSize;
+
+			memcpy(newRows, input + indexOf(0, bufferLast, width), (size_t)(neededLast - bufferLast) * rowSize);
+
+			// split at the band borders, so the operations know which rows are halo
+			int row = bufferLast;
+
+			while (row < neededLast)
+			{
+				const bool isHalo = (row < firstRow) || (row >= lastRow);
+				const int runLast = (row < firstRow) ? std::min(firstRow, neededLast) : ((row < lastRow) ? std::min(lastRow, neededLast) : neededLast);
+
+				unsigned char *runRows = buffer.data() + (size_t)(row - bufferFirst) * rowSize;
+
+				for (const PointOperation &operation : pipeline.pointOperations)
+				{
+					operation(runRows, width, row, runLast, isHalo);
+				}
+
+				if (!isHalo)
+				{
+					memcpy(staged + indexOf(0, row, width), runRows, (size_t)(runLast - row) * rowSize);
+				}
+
+				row = runLast;
+			}
+
+			bufferLast = neededLast;
+
+			unsigned char *stripOutput = output + indexOf(0, stripFirst, width);
+
+			if (pipeline.neighbourhoodOperation)
+			{
+				pipeline.neighbourhoodOperation(buffer.data(), bufferFirst, stripOutput, width, height, stripFirst, stripLast);
+			}
+			else
+			{
+				memcpy(stripOutput, buffer.data() + (size_t)(stripFirst - bufferFirst) * rowSize, (size_t)(stripLast - stripFirst) * rowSize);
+			}
+
+			accumulateHistogram(stripOutput, (int64_t)(stripLast - stripFirst) * width, COMPONENT_COUNT, partials.data() + (size_t)chunk * BUCKET_COUNT);
+		}
+	});
+
+	memset(histogram, 0, BUCKET_COUNT * sizeof(uint64_t));
+
+	for (int chunk = 0; chunk < chunkCount; ++chunk)
+	{
+		for (int bucket = 0; bucket < BUCKET_COUNT; ++bucket)
+		{
+			histogram[bucket] += partials[(size_t)chunk * BUCKET_COUNT + bucket];
+		}
+	}
+
+	return 0;
+}
+
+}
+#endif
@@ -0,0 +1,353 @@
+#ifndef QUALITY_FUNCS_H
+#define QUALITY_FUNCS_H
+
+#include <limits>
+
+#include "image_funcs.h"
+
+// SSIM of Wang et al.: statistics over 11x11 Gaussian windows with sigma 1.5, the divisions
+// stabilized by (K1 * 255)^2 and (K2 * 255)^2.
+constexpr int SSIM_RADIUS = 5;
+constexpr double SSIM_SIGMA = 1.5;
+constexpr double SSIM_K1 = 0.01;
+constexpr double SSIM_K2 = 0.03;
+constexpr int SSIM_STATISTIC_COUNT = 5;
+
+constexpr int QUALITY_MIN_ROWS_PER_THREAD = 32;
+
+// Squared differences are summed in 32 bit lanes, each 16 byte block adds at most 4 * 255^2
+// to a lane, so the lanes are flushed after this many blocks.
+constexpr int SQUARED_DIFFERENCE_FLUSH_BLOCKS = 4096;
+
+namespace imgf
+{
+
+struct ImageQuality
+{
+	double meanSquaredError;
+	double peakSignalToNoiseRatio;
+	double structuralSimilarity;
+};
+
+// Adds the squared differences of the first blocks of 16 bytes to sum and returns how many
+// bytes were processed.
+int64_t sumSquaredDifferencesSse2(const unsigned char *a, const unsigned char *b, const int64_t count, uint64_t *sum)
+{
+	const __m128i zero = _mm_setzero_si128();
+
+	int64_t i = 0;
+
+	while (i + 16 <= count)
+	{
+		const int64_t batchEnd = std::min(count, i + (int64_t)SQUARED_DIFFERENCE_FLUSH_BLOCKS * 16);
+
+		__m128i lanes = _mm_setzero_si128();
+
+		for (; i + 16 <= batchEnd; i += 16)
+		{
+			const __m128i x = _mm_loadu_si128((const __m128i *)(a + i));
+			const __m128i y = _mm_loadu_si128((const __m128i *)(b + i));
+
+			const __m128i low = _mm_sub_epi16(_mm_unpacklo_epi8(x, zero), _mm_unpacklo_epi8(y, zero));
+			const __m128i high = _mm_sub_epi16(_mm_unpackhi_epi8(x, zero), _mm_unpackhi_epi8(y, zero));
+
+			lanes = _mm_add_epi32(lanes, _mm_add_epi32(_mm_madd_epi16(low, low), _mm_madd_epi16(high, high)));
+		}
+
+		uint32_t parts[4];
+
+		_mm_storeu_si128((__m128i *)parts, lanes);
+
+		*sum += (uint64_t)parts[0] + parts[1] + parts[2] + parts[3];
+	}
+
+	return i;
+}
+
+// Mean of the squared differences of all components of two RGB images.
+double meanSquaredError(const unsigned char *reference, const unsigned char *image, const int width, const int height)
+{
+	std::vector<uint64_t> partials(chunkCountFor(height, QUALITY_MIN_ROWS_PER_THREAD), 0);
+
+	parallelFor(height, QUALITY_MIN_ROWS_PER_THREAD, [&](const int chunk, const int firstRow, const int lastRow)
+	{
+		const unsigned char *a = reference + indexOf(0, firstRow, width);
+		const unsigned char *b = image + indexOf(0, firstRow, width);
+		const int64_t count = (int64_t)(lastRow - firstRow) * width * COMPONENT_COUNT;
+
+		uint64_t sum = 0;
+
+		for (int64_t i = sumSquaredDifferencesSse2(a, b, count, &sum); i < count; ++i)
+		{
+			const int difference = a[i] - b[i];
+
+			sum += difference * difference;
+		}
+
+		partials[chunk] = sum;
+	});
+
+	uint64_t sum = 0;
+
+	for (const uint64_t partial : partials)
+	{
+		sum += partial;
+	}
+
+	return (double)sum / ((double)width * height * COMPONENT_COUNT);
+}
+
+// Identical images have an infinite PSNR.
+double peakSignalToNoiseRatio(const double meanSquaredError)
+{
+	if (meanSquaredError <= 0.0)
+	{
+		return std::numeric_limits<double>::infinity();
+	}
+
+	return 10.0 * std::log10((double)MAX_RGB_VALUE * MAX_RGB_VALUE / meanSquaredError);
+}
+
+// Row pass of the SSIM statistics. x and y are gray rows padded by SSIM_RADIUS pixels, the
+// window weighted means of x, y, x^2, y^2 and xy are written to statistics, one row of width
+// values after the other.
+void ssimRowPass(const float *x, const float *y, const float *weights, const int width, float *statistics)
+{
+	const int size = 2 * SSIM_RADIUS + 1;
+
+	int column = 0;
+
+	for (; column + 4 <= width; column += 4)
+	{
+		__m128 sums[SSIM_STATISTIC_COUNT];
+
+		for (int statistic = 0; statistic < SSIM_STATISTIC_COUNT; ++statistic)
+		{
+			sums[statistic] = _mm_setzero_ps();
+		}
+
+		for (int k = 0; k < size; ++k)
+		{
+			const __m128 weight = _mm_set1_ps(weights[k]);
+			const __m128 a = _mm_loadu_ps(x + column + k);
+			const __m128 b = _mm_loadu_ps(y + column + k);
+			const __m128 weightedA = _mm_mul_ps(weight, a);
+			const __m128 weightedB = _mm_mul_ps(weight, b);
+
+			sums[0] = _mm_add_ps(sums[0], weightedA);
+			sums[1] = _mm_add_ps(sums[1], weightedB);
+			sums[2] = _mm_add_ps(sums[2], _mm_mul_ps(weightedA, a));
+			sums[3] = _mm_add_ps(sums[3], _mm_mul_ps(weightedB, b));
+			sums[4] = _mm_add_ps(sums[4], _mm_mul_ps(weightedA, b));
+		}
+
+		for (int statistic = 0; statistic < SSIM_STATISTIC_COUNT; ++statistic)
+		{
+			_mm_storeu_ps(statistics + (size_t)statistic * width + column, sums[statistic]);
+		}
+	}
+
+	for (; column < width; ++column)
+	{
+		float sums[SSIM_STATISTIC_COUNT] = {};
+
+		for (int k = 0; k < size; ++k)
+		{
+			const float a = x[column + k];
+			const float b = y[column + k];
+
+			sums[0] += weights[k] * a;
+			sums[1] += weights[k] * b;
+			sums[2] += weights[k] * a * a;
+			sums[3] += weights[k] * b * b;
+			sums[4] += weights[k] * a * b;
+		}
+
+		for (int statistic = 0; statistic < SSIM_STATISTIC_COUNT; ++statistic)
+		{
+			statistics[(size_t)statistic * width + column] = sums[statistic];
+		}
+	}
+}
+
+float ssimOf(const float meanA, const float meanB, const float squareA, const float squareB, const float product, const float c1, const float c2)
+{
+	const float varianceA = squareA - meanA * meanA;
+	const float varianceB = squareB - meanB * meanB;
+	const float covariance = product - meanA * meanB;
+
+	return ((2.0f * meanA * meanB + c1) * (2.0f * covariance + c2))
+		/ ((meanA * meanA + meanB * meanB + c1) * (varianceA + varianceB + c2));
+}
+
+// Column pass of the statistics in rows, the row pass results of the window rows, followed by
+// the SSIM of every pixel. Returns the sum of the row's SSIM values.
+double ssimColumnPass(const float *const *rows, const float *weights, const int width, const float c1, const float c2)
+{
+	const int size = 2 * SSIM_RADIUS + 1;
+	const __m128 two = _mm_set1_ps(2.0f);
+	const __m128 c1s = _mm_set1_ps(c1);
+	const __m128 c2s = _mm_set1_ps(c2);
+
+	__m128 total = _mm_setzero_ps();
+
+	int column = 0;
+
+	for (; column + 4 <= width; column += 4)
+	{
+		__m128 sums[SSIM_STATISTIC_COUNT];
+
+		for (int statistic = 0; statistic < SSIM_STATISTIC_COUNT; ++statistic)
+		{
+			sums[statistic] = _mm_setzero_ps();
+		}
+
+		for (int k = 0; k < size; ++k)
+		{
+			const __m128 weight = _mm_set1_ps(weights[k]);
+
+			for (int statistic = 0; statistic < SSIM_STATISTIC_COUNT; ++statistic)
+			{
+				sums[statistic] = _mm_add_ps(sums[statistic], _mm_mul_ps(weight, _mm_loadu_ps(rows[k] + (size_t)statistic * width + column)));
+			}
+		}
+
+		const __m128 meanProduct = _mm_mul_ps(sums[0], sums[1]);
+		const __m128 meanSquares = _mm_add_ps(_mm_mul_ps(sums[0], sums[0]), _mm_mul_ps(sums[1], sums[1]));
+		const __m128 variances = _mm_sub_ps(_mm_add_ps(sums[2], sums[3]), meanSquares);
+		const __m128 covariance = _mm_sub_ps(sums[4], meanProduct);
+
+		const __m128 numerator = _mm_mul_ps(_mm_add_ps(_mm_mul_ps(two, meanProduct), c1s), _mm_add_ps(_mm_mul_ps(two, covariance), c2s));
+		const __m128 denominator = _mm_mul_ps(_mm_add_ps(meanSquares, c1s), _mm_add_ps(variances, c2s));
+
+		total = _mm_add_ps(total, _mm_div_ps(numerator, denominator));
+	}
+
+	float lanes[4];
+
+	_mm_storeu_ps(lanes, total);
+
+	double sum = (double)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+
+	for (; column < width; ++column)
+	{
+		float sums[SSIM_STATISTIC_COUNT] = {};
+
+		for (int k = 0; k < size; ++k)
+		{
+			for (int statistic = 0; statistic < SSIM_STATISTIC_COUNT; ++statistic)
+			{
+				sums[statistic] += weights[k] * rows[k][(size_t)statistic * width + column];
+			}
+		}
+
+		sum += ssimOf(sums[0], sums[1], sums[2], sums[3], sums[4], c1, c2);
+	}
+
+	return sum;
+}
+
+// Mean SSIM of the gray values of two RGB images, windows reaching past the border see
+// replicated pixels. Every band keeps the row pass statistics of the last 11 rows in a
+// ring, so no full size statistics planes are needed.
+double structuralSimilarity(const unsigned char *reference, const unsigned char *image, const int width, const int height)
+{
+	const int size = 2 * SSIM_RADIUS + 1;
+	const int paddedWidth = width + 2 * SSIM_RADIUS;
+	const float c1 = (float)((SSIM_K1 * MAX_RGB_VALUE) * (SSIM_K1 * MAX_RGB_VALUE));
+	const float c2 = (float)((SSIM_K2 * MAX_RGB_VALUE) * (SSIM_K2 * MAX_RGB_VALUE));
+
+	float weights[size];
+	double total = 0.0;
+
+	for (int i = 0; i < size; ++i)
+	{
+		total += std::exp(-(double)(i - SSIM_RADIUS) * (i - SSIM_RADIUS) / (2.0 * SSIM_SIGMA * SSIM_SIGMA));
+	}
+
+	for (int i = 0; i < size; ++i)
+	{
+		weights[i] = (float)(std::exp(-(double)(i - SSIM_RADIUS) * (i - SSIM_RADIUS) / (2.0 * SSIM_SIGMA * SSIM_SIGMA)) / total);
+	}
+
+	std::vector<double> partials(chunkCountFor(height, QUALITY_MIN_ROWS_PER_THREAD), 0.0);
+
+	parallelFor(height, QUALITY_MIN_ROWS_PER_THREAD, [&](const int chunk, const int firstRow, const int lastRow)
+	{
+		std::vector<unsigned char> gray(width);
+		std::vector<float> values(width), paddedA(paddedWidth), paddedB(paddedWidth);
+		std::vector<float> ring((size_t)size * SSIM_STATISTIC_COUNT * width);
+		std::vector<const float *> rows(size);
+
+		auto slot = [&](const int y)
+		{
+			return ring.data() + (size_t)(((y % size) + size) % size) * SSIM_STATISTIC_COUNT * width;
+		};
+
+		auto loadPadded = [&](const unsigned char *row, float *padded)
+		{
+			convertPixelsToGrayscale(row, gray.data(), width, false);
+
+			for (int x = 0; x < width; ++x)
+			{
+				values[x] = gray[x];
+			}
+
+			padRow(values.data(), width, SSIM_RADIUS, BORDER_REPLICATE, padded);
+		};
+
+		auto loadRow = [&](const int y)
+		{
+			const int source = borderIndex(y, height, BORDER_REPLICATE);
+
+			loadPadded(reference + indexOf(0, source, width), paddedA.data());
+			loadPadded(image + indexOf(0, source, width), paddedB.data());
+
+			ssimRowPass(paddedA.data(), paddedB.data(), weights, width, slot(y));
+		};
+
+		for (int y = firstRow - SSIM_RADIUS; y < firstRow + SSIM_RADIUS; ++y)
+		{
+			loadRow(y);
+		}
+
+		double sum = 0.0;
+
+		for (int y = firstRow; y < lastRow; ++y)
+		{
+			loadRow(y + SSIM_RADIUS);
+
+			for (int k = 0; k < size; ++k)
+			{
+				rows[k] = slot(y - SSIM_RADIUS + k);
+			}
+
+			sum += ssimColumnPass(rows.data(), weights, width, c1, c2);
+		}
+
+		partials[chunk] = sum;
+	});
+
+	double sum = 0.0;
+
+	for (const double partial : partials)
+	{
+		sum += partial;
+	}
+
+	return sum / ((double)width * height);
+}
+
+ImageQuality measureQuality(const unsigned char *reference, const unsigned char *image, const int width, const int height)
+{
+	ImageQuality quality;
+
+	quality.meanSquaredError = meanSquaredError(reference, image, width, height);
+	quality.peakSignalToNoiseRatio = peakSignalToNoiseRatio(quality.meanSquaredError);
+	quality.structuralSimilarity = structuralSimilarity(reference, image, width, height);
+
+	return quality;
+}
+
+}
+#endif
@@ -5,6 +5,17 @@
 #include <random>
 #include <cstdint>
 #include <algorithm>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define IMGF_TARGET_SSSE3
+#define IMGF_TARGET_AVX2
+#else
+#include <cpuid.h>
+#include <x86intrin.h>
+#define IMGF_TARGET_SSSE3 __attribute__((target("ssse3")))
+#define IMGF_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
 #include <cmath>
 #include <complex>
 
@@ -22,36 +33,364 @@ constexpr float R_WEIGHT = 0.3f;
 constexpr float G_WEIGHT = 0.59f;
 constexpr float B_WEIGHT = 0.11f;
 
+// 8.8 fixed-point versions of the weights above, they add up to exactly 256, so gray stays gray
+constexpr int GRAYSCALE_FIXED_SHIFT = 8;
+constexpr int GRAYSCALE_FIXED_ROUNDING = 1 << (GRAYSCALE_FIXED_SHIFT - 1);
+constexpr int R_FIXED_WEIGHT = (int)(R_WEIGHT * (1 << GRAYSCALE_FIXED_SHIFT) + 0.5f);
+constexpr int G_FIXED_WEIGHT = (int)(G_WEIGHT * (1 << GRAYSCALE_FIXED_SHIFT) + 0.5f);
+constexpr int B_FIXED_WEIGHT = (int)(B_WEIGHT * (1 << GRAYSCALE_FIXED_SHIFT) + 0.5f);
+
 constexpr int MIN_RGB_VALUE = 0;
 constexpr int MAX_RGB_VALUE = 255;
 
 namespace imgf
 {
 
+struct CpuFeatures
+{
+	bool ssse3;
+	bool avx2;
+};
+
+void cpuid(int registers[4], const int leaf, const int subleaf)
+{
+#if defined(_MSC_VER)
+	__cpuidex(registers, leaf, subleaf);
+#else
+	__cpuid_count(leaf, subleaf, registers[0], registers[1], registers[2], registers[3]);
+#endif
+}
+
+uint64_t extendedControlRegister()
+{
+#if defined(_MSC_VER)
+	return _xgetbv(0);
+#else
+	uint32_t low, high;
+
+	__asm__ volatile ("xgetbv" : "=a"(low), "=d"(high) : "c"(0));
+
+	return ((uint64_t)high << 32) | low;
+#endif
+}
+
+CpuFeatures detectCpuFeatures()
+{
+	CpuFeatures features = { false, false };
+
+	int registers[4];
+
+	cpuid(registers, 0, 0);
+
+	const int maxLeaf = registers[0];
+
+	if (maxLeaf < 1)
+	{
+		return features;
+	}
+
+	cpuid(registers, 1, 0);
+
+	features.ssse3 = (registers[2] & (1 << 9)) != 0;
+
+	const bool osSavesYmm = ((registers[2] & (1 << 27)) != 0) && ((extendedControlRegister() & 0x6) == 0x6);
+
+	if (osSavesYmm && (maxLeaf >= 7))
+	{
+		cpuid(registers, 7, 0);
+
+		features.avx2 = (registers[1] & (1 << 5)) != 0;
+	}
+
+	return features;
+}
+
+const CpuFeatures &cpuFeatures()
+{
+	static const CpuFeatures features = detectCpuFeatures();
+
+	return features;
+}
+
 int indexOf(const int x, const int y, const int width)
 {
 	return y * width * COMPONENT_COUNT + x * COMPONENT_COUNT;
 }
 
-bool isGrayscale(const unsigned char *data)
+bool isGrayPixel(const unsigned char *pixel)
 {
-	return data[0] == data[1] == data[2];
+	return (pixel[R] == pixel[G]) && (pixel[G] == pixel[B]);
 }
 
-void convertToGrayscale(unsigned char *data, const int width, const int height)
+// Comparing the buffer against itself shifted by one byte yields R==G and G==B in the
+// first two bytes of every pixel, the third byte compares B to the next pixel's R and is ignored.
+uint32_t grayscaleCompareMask(const int byteOffset, const int byteCount)
+{
+	uint32_t mask = 0;
+
+	for (int i = 0; i < byteCount; ++i)
+	{
+		if (((byteOffset + i) % COMPONENT_COUNT) != B)
+		{
+			mask |= 1u << i;
+		}
+	}
+
+	return mask;
+}
+
+// Returns the number of leading pixels verified to be gray, or -1 when a colored pixel was found.
+IMGF_TARGET_AVX2
+int64_t scanGrayPixelsAvx2(const unsigned char *data, const int64_t byteCount)
+{
+	const uint32_t masks[3] = { grayscaleCompareMask(0, 32), grayscaleCompareMask(32, 32), grayscaleCompareMask(64, 32) };
+
+	int64_t i = 0;
+
+	// strictly less, the shifted load reads one byte past the block
+	for (; i + 96 < byteCount; i += 96)
+	{
+		for (int block = 0; block < 3; ++block)
+		{
+			const unsigned char *position = data + i + block * 32;
+
+			const __m256i equal = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)position),
+				_mm256_loadu_si256((const __m256i *)(position + 1)));
+
+			if (((uint32_t)_mm256_movemask_epi8(equal) & masks[block]) != masks[block])
+			{
+				return -1;
+			}
+		}
+	}
+
+	return i / COMPONENT_COUNT;
+}
+
+int64_t scanGrayPixelsSse2(const unsigned char *data, const int64_t byteCount)
+{
+	const uint32_t masks[3] = { grayscaleCompareMask(0, 16), grayscaleCompareMask(16, 16), grayscaleCompareMask(32, 16) };
+
+	int64_t i = 0;
+
+	for (; i + 48 < byteCount; i += 48)
+	{
+		for (int block = 0; block < 3; ++block)
+		{
+			const unsigned char *position = data + i + block * 16;
+
+			const __m128i equal = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)position),
+				_mm_loadu_si128((const __m128i *)(position + 1)));
+
+			if (((uint32_t)_mm_movemask_epi8(equal) & masks[block]) != masks[block])
+			{
+				return -1;
+			}
+		}
+	}
+
+	return i / COMPONENT_COUNT;
+}
+
+// Checks R == G == B over the whole image and stops at the first colored pixel.
+bool isGrayscale(const unsigned char *data, const int width, const int height)
+{
+	const int64_t pixelCount = (int64_t)width * height;
+
+	const int64_t verified = cpuFeatures().avx2
+		? scanGrayPixelsAvx2(data, pixelCount * COMPONENT_COUNT)
+		: scanGrayPixelsSse2(data, pixelCount * COMPONENT_COUNT);
+
+	if (verified < 0)
+	{
+		return false;
+	}
+
+	for (int64_t i = verified; i < pixelCount; ++i)
+	{
+		if (!isGrayPixel(data + i * COMPONENT_COUNT))
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+unsigned char grayValueOf(const unsigned char *pixel)
+{
+	return (R_FIXED_WEIGHT * pixel[R]
+		+ G_FIXED_WEIGHT * pixel[G]
+		+ B_FIXED_WEIGHT * pixel[B]
+		+ GRAYSCALE_FIXED_ROUNDING) >> GRAYSCALE_FIXED_SHIFT;
+}
+
+// Splits 16 packed RGB pixels (48 bytes) into one register per component.
+IMGF_TARGET_SSSE3
+void deinterleaveRgb(const unsigned char *pixels, __m128i *r, __m128i *g, __m128i *b)
+{
+	const __m128i first = _mm_loadu_si128((const __m128i *)pixels);
+	const __m128i second = _mm_loadu_si128((const __m128i *)(pixels + 16));
+	const __m128i third = _mm_loadu_si128((const __m128i *)(pixels + 32));
+
+	*r = _mm_or_si128(_mm_or_si128(
+		_mm_shuffle_epi8(first, _mm_setr_epi8(0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1)),
+		_mm_shuffle_epi8(second, _mm_setr_epi8(-1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14, -1, -1, -1, -1, -1))),
+		_mm_shuffle_epi8(third, _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 1, 4, 7, 10, 13)));
+
+	*g = _mm_or_si128(_mm_or_si128(
+		_mm_shuffle_epi8(first, _mm_setr_epi8(1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1)),
+		_mm_shuffle_epi8(second, _mm_setr_epi8(-1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1))),
+		_mm_shuffle_epi8(third, _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14)));
+
+	*b = _mm_or_si128(_mm_or_si128(
+		_mm_shuffle_epi8(first, _mm_setr_epi8(2, 5, 8, 11, 14, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1)),
+		_mm_shuffle_epi8(second, _mm_setr_epi8(-1, -1, -1, -1, -1, 1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1))),
+		_mm_shuffle_epi8(third, _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15)));
+}
+
+// Writes every byte of value three times, producing 16 gray RGB pixels (48 bytes).
+IMGF_TARGET_SSSE3
+void storeTriplicated(unsigned char *pixels, const __m128i value)
+{
+	_mm_storeu_si128((__m128i *)pixels,
+		_mm_shuffle_epi8(value, _mm_setr_epi8(0, 0, 0, 1, 1, 1, 2, 2, 2, 3, 3, 3, 4, 4, 4, 5)));
+	_mm_storeu_si128((__m128i *)(pixels + 16),
+		_mm_shuffle_epi8(value, _mm_setr_epi8(5, 5, 6, 6, 6, 7, 7, 7, 8, 8, 8, 9, 9, 9, 10, 10)));
+	_mm_storeu_si128((__m128i *)(pixels + 32),
+		_mm_shuffle_epi8(value, _mm_setr_epi8(10, 11, 11, 11, 12, 12, 12, 13, 13, 13, 14, 14, 14, 15, 15, 15)));
+}
+
+IMGF_TARGET_SSSE3
+__m128i weightedGray(const __m128i r, const __m128i g, const __m128i b)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i rWeight = _mm_set1_epi16(R_FIXED_WEIGHT);
+	const __m128i gWeight = _mm_set1_epi16(G_FIXED_WEIGHT);
+	const __m128i bWeight = _mm_set1_epi16(B_FIXED_WEIGHT);
+	const __m128i rounding = _mm_set1_epi16(GRAYSCALE_FIXED_ROUNDING);
+
+	// 255 * 256 + 128 still fits into an unsigned 16 bit lane
+	__m128i low = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(r, zero), rWeight), rounding);
+	low = _mm_add_epi16(low, _mm_mullo_epi16(_mm_unpacklo_epi8(g, zero), gWeight));
+	low = _mm_add_epi16(low, _mm_mullo_epi16(_mm_unpacklo_epi8(b, zero), bWeight));
+
+	__m128i high = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(r, zero), rWeight), rounding);
+	high = _mm_add_epi16(high, _mm_mullo_epi16(_mm_unpackhi_epi8(g, zero), gWeight));
+	high = _mm_add_epi16(high, _mm_mullo_epi16(_mm_unpackhi_epi8(b, zero), bWeight));
+
+	return _mm_packus_epi16(_mm_srli_epi16(low, GRAYSCALE_FIXED_SHIFT), _mm_srli_epi16(high, GRAYSCALE_FIXED_SHIFT));
+}
+
+IMGF_TARGET_SSSE3
+int convertPixelsToGrayscaleSsse3(const unsigned char *rgb, unsigned char *gray, const int count, const bool triplicate)
 {
-	for (int y = 0; y < height; ++y)
+	int i = 0;
+
+	for (; i + 16 <= count; i += 16)
 	{
-		for (int x = 0; x < width; ++x)
+		__m128i r, g, b;
+
+		deinterleaveRgb(rgb + i * COMPONENT_COUNT, &r, &g, &b);
+
+		const __m128i value = weightedGray(r, g, b);
+
+		if (triplicate)
 		{
-			const int position = indexOf(x, y, width);
-			const int grayValue = R_WEIGHT * data[position + R]
-				+ G_WEIGHT * data[position + G]
-				+ B_WEIGHT * data[position + B];
+			storeTriplicated(gray + i * COMPONENT_COUNT, value);
+		}
+		else
+		{
+			_mm_storeu_si128((__m128i *)(gray + i), value);
+		}
+	}
+
+	return i;
+}
+
+IMGF_TARGET_AVX2
+int convertPixelsToGrayscaleAvx2(const unsigned char *rgb, unsigned char *gray, const int count, const bool triplicate)
+{
+	const __m256i rWeight = _mm256_set1_epi16(R_FIXED_WEIGHT);
+	const __m256i gWeight = _mm256_set1_epi16(G_FIXED_WEIGHT);
+	const __m256i bWeight = _mm256_set1_epi16(B_FIXED_WEIGHT);
+	const __m256i rounding = _mm256_set1_epi16(GRAYSCALE_FIXED_ROUNDING);
+
+	int i = 0;
+
+	for (; i + 32 <= count; i += 32)
+	{
+		__m128i r[2], g[2], b[2];
+
+		// pshufb does not cross 128 bit lanes, so the 96 input bytes are split in two halves
+		deinterleaveRgb(rgb + i * COMPONENT_COUNT, &r[0], &g[0], &b[0]);
+		deinterleaveRgb(rgb + (i + 16) * COMPONENT_COUNT, &r[1], &g[1], &b[1]);
+
+		__m256i sum[2];
 
-			memset(data + position, grayValue, COMPONENT_COUNT);
+		for (int half = 0; half < 2; ++half)
+		{
+			sum[half] = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_cvtepu8_epi16(r[half]), rWeight), rounding);
+			sum[half] = _mm256_add_epi16(sum[half], _mm256_mullo_epi16(_mm256_cvtepu8_epi16(g[half]), gWeight));
+			sum[half] = _mm256_add_epi16(sum[half], _mm256_mullo_epi16(_mm256_cvtepu8_epi16(b[half]), bWeight));
+			sum[half] = _mm256_srli_epi16(sum[half], GRAYSCALE_FIXED_SHIFT);
+		}
+
+		// packus works per lane, the permute restores pixel order
+		const __m256i value = _mm256_permute4x64_epi64(_mm256_packus_epi16(sum[0], sum[1]), 0xD8);
+
+		if (triplicate)
+		{
+			storeTriplicated(gray + i * COMPONENT_COUNT, _mm256_castsi256_si128(value));
+			storeTriplicated(gray + (i + 16) * COMPONENT_COUNT, _mm256_extracti128_si256(value, 1));
+		}
+		else
+		{
+			_mm256_storeu_si256((__m256i *)(gray + i), value);
 		}
 	}
+
+	return i;
+}
+
+// Converts count packed RGB pixels. The output is either one byte per pixel (planar)
+// or the gray value repeated for all three components (triplicated), which may alias the input.
+void convertPixelsToGrayscale(const unsigned char *rgb, unsigned char *gray, const int count, const bool triplicate)
+{
+	int i = 0;
+
+	if (cpuFeatures().avx2)
+	{
+		i = convertPixelsToGrayscaleAvx2(rgb, gray, count, triplicate);
+	}
+	else if (cpuFeatures().ssse3)
+	{
+		i = convertPixelsToGrayscaleSsse3(rgb, gray, count, triplicate);
+	}
+
+	for (; i < count; ++i)
+	{
+		const unsigned char value = grayValueOf(rgb + i * COMPONENT_COUNT);
+
+		if (triplicate)
+		{
+			memset(gray + i * COMPONENT_COUNT, value, COMPONENT_COUNT);
+		}
+		else
+		{
+			gray[i] = value;
+		}
+	}
+}
+
+void convertToGrayscale(unsigned char *data, const int width, const int height)
+{
+	convertPixelsToGrayscale(data, data, width * height, true);
+}
+
+void convertToGrayscalePlanar(const unsigned char *data, unsigned char *gray, const int width, const int height)
+{
+	convertPixelsToGrayscale(data, gray, width * height, false);
 }
 
 void toComplexImage(unsigned char *data, const int width, const int height, std::vector<std::complex<double>> &result)
@@ -65,6 +404,21 @@ void toComplexImage(unsigned char *data, const int width, const int height, std:
 	}
 }
 
+// 16 bit gray samples of at most maxValue, scaled to the range of the 8 bit path. The samples
+// go straight to double, so the bits below the 8 bit range are kept.
+void toComplexImage(const uint16_t *data, const int width, const int height, const int maxValue, std::vector<std::complex<double>> &result)
+{
+	const double scale = (double)MAX_RGB_VALUE / maxValue;
+
+	for (long y = 0; y < height; ++y)
+	{
+		for (long x = 0; x < width; ++x)
+		{
+			result.push_back(std::complex<double>(data[y * width + x] * scale));
+		}
+	}
+}
+
 void butterworthLowPassFilter(std::vector<std::complex<double>> &data, const int width, const int height, double cutoff, double order)
 {
 	for (long y = 0; y < height; ++y)